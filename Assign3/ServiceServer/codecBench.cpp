@@ -0,0 +1,314 @@
+//+
+// File:   codecBench.cpp
+//
+// Times the packet codec in svcDirCodec.hpp against the way the server
+// used to read packets (pointer casts and a string copy of every name),
+// and fuzzes it.
+//
+//   codecbench [iterations]        time both ways of reading packets
+//   codecbench fuzz [iterations]   feed random and damaged packets to
+//                                  every reader, and check that what
+//                                  the writer writes reads back the same
+//
+// The fuzz mode is best run on a build with -fsanitize=address so any
+// read outside a packet is caught:
+//
+//   make clean; make CXXFLAGS="-std=c++2a -g -fsanitize=address" LDFLAGS=-fsanitize=address bin/codecbench
+//-
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <string.h>
+
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "svcCluster.hpp"
+#include "svcDirCodec.hpp"
+#include "svcRegistry.hpp"
+
+using namespace std;
+using namespace svcCodec;
+
+//+
+// the old way
+//
+// readName and the register parsing as they were in main.cpp before the
+// codec, less the logging.
+//-
+
+static bool legacyReadName(uint8_t * buffer, int32_t n, uint32_t &curPos, string & name, string errName){
+    if (curPos >= n){
+        return false;
+    }
+    int nameLen = *((uint8_t*)(buffer+curPos++));
+    if (n < curPos + nameLen){
+        return false;
+    }
+    name = string((char*)(buffer+curPos),nameLen);
+    curPos += nameLen;
+    return true;
+}
+
+static bool legacyRegister(uint8_t * buffer, int32_t n, string & svcName, serverEntity & server, uint32_t & lease){
+    uint32_t curPos = DETAILOFFSET;
+    if (!legacyReadName(buffer,n,curPos,svcName,"service")) return false;
+    curPos = ((curPos + 3) & 0xFFFFFFFC);
+    if (curPos >= n) return false;
+    if (!legacyReadName(buffer,n,curPos,server.name,"server")) return false;
+    curPos = ((curPos + 1) & 0xFFFFFFFE);
+    if ((curPos + 2) > n) return false;
+    server.port = ntohs(*((uint16_t*)(buffer+curPos)));
+    curPos += 2;
+    lease = 0;
+    curPos = ((curPos + 3) & 0xFFFFFFFC);
+    if ((curPos + 4) <= n){
+        lease = ntohl(*((uint32_t*)(buffer+curPos)));
+    }
+    return true;
+}
+
+// the codec way, as addServer does it now
+static bool codecRegister(uint8_t * buffer, int32_t n, string_view & svcName, serverEntity & server, uint32_t & lease){
+    packetReader rd(buffer, n);
+    svcName = rd.name();
+    server.name = rd.align(4).server(server.port);
+    lease = 0;
+    rd.align(4);
+    if (rd.has(4)) lease = rd.u32();
+    return rd.ok();
+}
+
+static uint32_t buildRegister(uint8_t * buffer, const string & svcName, const serverEntity & server, uint32_t lease){
+    writeHeader(buffer, 1, 42);
+    packetWriter wr(buffer, 2048);
+    wr.name(svcName).align(4).server(server.name, server.port).align(4).u32(lease);
+    return wr.pos();
+}
+
+static uint32_t buildSearch(uint8_t * buffer, const string & svcName){
+    writeHeader(buffer, 3, 42);
+    return packetWriter(buffer, 2048).name(svcName).pos();
+}
+
+template <typename F>
+static double nsPer(uint64_t iterations, F f){
+    auto start = chrono::steady_clock::now();
+    for (uint64_t i = 0; i < iterations; i++){
+        f(i);
+    }
+    chrono::duration<double, nano> took = chrono::steady_clock::now() - start;
+    return took.count() / iterations;
+}
+
+static void bench(uint64_t iterations){
+    uint32_t bufferInt[512];
+    uint8_t * buffer = (uint8_t*)bufferInt;
+
+    // names long enough that std::string can't keep them inline
+    serverEntity server{"compute-node-17.cluster.example.org", 3617};
+    string svcName = "calculator-service-primary-instance";
+    int32_t n = buildRegister(buffer, svcName, server, 30);
+
+    uint64_t sink = 0;
+    double legacy = nsPer(iterations, [&](uint64_t){
+        string name;
+        serverEntity se;
+        uint32_t lease;
+        legacyRegister(buffer, n, name, se, lease);
+        sink += name.length() + se.port + lease;
+    });
+    double codec = nsPer(iterations, [&](uint64_t){
+        string_view name;
+        serverEntity se;
+        uint32_t lease;
+        codecRegister(buffer, n, name, se, lease);
+        sink += name.length() + se.port + lease;
+    });
+    cout << "register packet   legacy " << legacy << " ns   codec " << codec << " ns" << endl;
+
+    // search: read the name and look it up, the whole request path
+    // short of the socket.
+    serviceRegistry registry;
+    vector<string> names;
+    for (int i = 0; i < 1000; i++){
+        names.push_back("calculator-service-instance-" + to_string(i));
+        registry.add(names.back(), serverEntity{"node" + to_string(i), (uint16_t)(3600 + i % 100)});
+    }
+    vector<vector<uint8_t>> packets;
+    for (auto & name : names){
+        uint32_t len = buildSearch(buffer, name);
+        packets.emplace_back(buffer, buffer + len);
+    }
+
+    legacy = nsPer(iterations, [&](uint64_t i){
+        vector<uint8_t> & p = packets[i % packets.size()];
+        uint32_t curPos = DETAILOFFSET;
+        string name;
+        serverEntity se;
+        if (legacyReadName(p.data(), p.size(), curPos, name, "service") && registry.pickRandom(name, se)){
+            sink += se.port;
+        }
+    });
+    codec = nsPer(iterations, [&](uint64_t i){
+        vector<uint8_t> & p = packets[i % packets.size()];
+        packetReader rd(p.data(), p.size());
+        string_view name = rd.name();
+        serverEntity se;
+        if (rd.ok() && registry.pickRandom(name, se)){
+            sink += se.port;
+        }
+    });
+    cout << "search + lookup   legacy " << legacy << " ns   codec " << codec << " ns" << endl;
+
+    if (sink == 0) cout << "nothing read" << endl;
+}
+
+//+
+// fuzz
+//
+// every reader is given random bytes, valid packets cut short and valid
+// packets with bytes changed. Nothing may crash and a reader that says
+// ok must never have read past the end.
+//-
+
+static uint64_t fuzzOne(uint8_t * buffer, uint32_t n){
+    uint64_t sink = 0;
+
+    // register
+    {
+        packetReader rd(buffer, n);
+        sink += rd.name().length();
+        uint16_t port;
+        sink += rd.align(4).server(port).length() + port;
+        if (rd.ok() && rd.pos() > n){
+            cerr << "register read past the end" << endl;
+            exit(1);
+        }
+        // the optional fields, align alone may go past the end
+        rd.align(4);
+        if (rd.has(4)) sink += rd.u32();
+        if (rd.has(4)) sink += rd.u16() + rd.u16();
+    }
+    // search all reply
+    {
+        packetReader rd(buffer, n);
+        sink += rd.u16() + rd.u16();
+        uint16_t count = rd.u16();
+        for (uint16_t i = 0; i < count && rd.ok(); i++){
+            uint16_t port;
+            sink += rd.server(port).length();
+        }
+        if (rd.ok() && rd.pos() > n){
+            cerr << "search all read past the end" << endl;
+            exit(1);
+        }
+    }
+    // notification
+    {
+        packetReader rd(buffer, n);
+        sink += rd.name().length();
+        sink += rd.align(4).u32() + rd.u32() + rd.u8();
+        uint16_t port;
+        sink += rd.server(port).length();
+    }
+    // replica packet
+    {
+        packetReader rd(buffer, n);
+        uint16_t count = rd.u16();
+        rd.u16();
+        uint32_t curPos = rd.pos();
+        replica r;
+        for (uint16_t i = 0; i < count && rd.ok(); i++){
+            if (!cluster::readReplica(buffer, n, curPos, r)) break;
+            sink += r.svcName.length() + r.server.name.length();
+        }
+    }
+    return sink;
+}
+
+static void fuzz(uint64_t iterations){
+    mt19937_64 gen(random_device{}());
+    uint32_t bufferInt[512];
+    uint8_t * buffer = (uint8_t*)bufferInt;
+    uint8_t packet[2048];
+    uint64_t sink = 0;
+
+    for (uint64_t i = 0; i < iterations; i++){
+        uint32_t n = 0;
+        switch (i % 3){
+            case 0:
+                // random bytes
+                n = gen() % 300;
+                for (uint32_t j = 0; j < n; j++) buffer[j] = gen();
+                break;
+            case 1:
+            case 2: {
+                // a valid packet, cut short or damaged
+                string svcName(gen() % 64, 's');
+                serverEntity se{string(gen() % 64, 'h'), (uint16_t)gen()};
+                n = buildRegister(buffer, svcName, se, gen());
+                if (i % 3 == 1){
+                    n = gen() % (n + 1);
+                } else {
+                    for (int j = 0; j < 3; j++) buffer[gen() % n] = gen();
+                }
+                break;
+            }
+        }
+        // a copy of exactly n bytes so the sanitizer sees the end
+        vector<uint8_t> exact(buffer, buffer + n);
+        sink += fuzzOne(exact.data(), n);
+    }
+
+    // round trip
+    for (uint64_t i = 0; i < iterations / 10; i++){
+        replica in{string(gen() % 64, 'a' + gen() % 26), serverEntity{string(gen() % 64, 'b'), (uint16_t)gen()},
+                   gen(), (uint32_t)gen(), (gen() & 1) != 0, (uint16_t)gen(), (uint16_t)gen()};
+        uint32_t end = cluster::writeReplica(packet, 0, in);
+        uint32_t curPos = 0;
+        replica out;
+        if (!cluster::readReplica(packet, end, curPos, out) || curPos != end
+            || out.svcName != in.svcName || !(out.server == in.server) || out.stamp != in.stamp
+            || out.leaseSeconds != in.leaseSeconds || out.present != in.present
+            || out.weight != in.weight || out.load != in.load){
+            cerr << "replica did not read back the same" << endl;
+            exit(1);
+        }
+    }
+    cout << "fuzzed " << iterations << " packets, no problems (" << (sink & 1) << ")" << endl;
+}
+
+static void usage(const char * name){
+    cerr << "Usage: " << name << " [iterations]" << endl
+         << "       " << name << " fuzz [iterations]" << endl;
+    exit(1);
+}
+
+// a count of iterations, all digits and more than 0
+static uint64_t iterations(const char * name, const char * arg){
+    char * end;
+    uint64_t n = strtoull(arg, &end, 10);
+    if (!isdigit((unsigned char)arg[0]) || *end != '\0' || n == 0){
+        usage(name);
+    }
+    return n;
+}
+
+int main(int argc, char * argv[]){
+    bool fuzzing = argc > 1 && string(argv[1]) == "fuzz";
+    int first = fuzzing ? 2 : 1;
+    if (argc > first + 1){
+        usage(argv[0]);
+    }
+    uint64_t n = argc > first ? iterations(argv[0], argv[first]) : (fuzzing ? 1000000 : 5000000);
+    if (fuzzing){
+        fuzz(n);
+    } else {
+        bench(n);
+    }
+    return 0;
+}
@@ -6,32 +6,87 @@
 // Originally for multi project, it kept track of origin network, that
 // has now been moved to separate servers for each grouop.
 //
-// There are four operations:
+// Requests are served by a pool of worker threads (-t option). On
+// Linux each worker has its own socket on the port (SO_REUSEPORT, the
+// kernel spreads the clients over them) and takes packets off it in
+// batches with recvmmsg, sending the replies back with one sendmmsg.
+// Elsewhere the workers share one socket and use recvfrom. The
+// dictionary is in svcRegistry.cpp, it is sharded so the workers
+// seldom wait on each other.
+//
+// There are eight operations, and one for monitoring:
 //
 //    1. register service (add a server for a service)
 //    2. remove service (delete a server from a service)
 //    3. return a server for a service
 //    4. reset the dictionary .
+//    5. renew the lease on a registration (heartbeat)
+//    6. return all of the servers for a service
+//    7. return a server for each of several services
+//    8. watch a service for changes
+//   13. report statistics (request counts, registry size and memory),
+//       used by svcdirbench
+//
+// A registration may carry a weight and a load, searches then favour
+// heavier and less loaded servers (see svcRegistry.hpp).
+//
+// A registration may carry a lease in seconds. If the lease is not
+// renewed in time the server is removed, so servers that crash
+// without removing themselves stop being handed out to clients.
+//
+// A watcher is sent a notification (opcode 9, from the server) each
+// time a server is added to or removed from the service it watches,
+// see svcWatch.hpp. Watches also have a lease and are renewed by
+// sending the watch request again.
+//
+// Several servers can act as one directory (-p gives the other nodes).
+// Registrations, removals and resets made on any node are copied to
+// the others (opcodes 10 and 11, only accepted from peers), and a node
+// that restarts gets the registrations back from its peers. See
+// svcCluster.hpp. Removals are remembered for a day (-k sets the
+// seconds) so a node that was down for less than that can't bring
+// back servers removed while it was gone, see svcRegistry.hpp. A
+// server with no peers doesn't keep them.
+//
+// Searches from each client address are limited to a rate (-r, see
+// svcAdmit.hpp), and are served after registrations and removals. A
+// search over the rate, or that waited too long while the server was
+// behind, is answered busy (opcode 12, from the server) with how many
+// milliseconds to wait before asking again, rather than being dropped.
+//
+// With -d the directory is kept on disk (a snapshot and a log of the
+// changes since), so a restarted server comes back with everything it
+// had. See svcStore.hpp.
 //
 //-
 
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/resource.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <signal.h>
 #include <poll.h>
 
 #include <iostream>
-#include <map>
+#include <atomic>
+#include <chrono>
+#include <thread>
 #include <vector>
-#include <random>
 
 #include "HexDump.hpp"
+#include "svcLog.hpp"
+#include "svcCluster.hpp"
+#include "svcAdmit.hpp"
+#include "svcDirCodec.hpp"
+#include "svcRegistry.hpp"
+#include "svcStore.hpp"
+#include "svcWatch.hpp"
 
 // Port Range - set to your groups values
 #define SERVICE_START_PORT 3600
@@ -40,31 +95,56 @@
 // bigger than anything that will happen.
 #define BUFFSIZE 2048
 
+// most packets taken off a socket by one recvmmsg
+#define RECVBATCH 32
+// receive buffer asked for on each socket, enough to hold a burst of
+// registrations while the workers catch up.
+#define RCVBUFSIZE (4 * 1024 * 1024)
+
+// searches a second from one client address (-r), bursts of twice that
+#define DEFAULTRATE 2000
+// a search that waited longer than this (ms) in the socket is answered
+// busy, and the client told to wait BUSYWAIT ms.
+#define MAXQUEUEDELAY 100
+#define BUSYWAIT 200
+// seconds between logging how many searches were answered busy
+#define SHEDLOGINTERVAL 10
+
+// default number of threads receiving requests
+#define DEFAULTTHREADS 4
+
+// seconds between sending everything to a peer
+#define SYNCINTERVAL 10
+
+// seconds between snapshots, or sooner if the log gets this long
+#define SNAPSHOTINTERVAL 60
+#define MAXLOGRECORDS 10000
+
 #ifdef __APPLE__
 // MacOS does not have the MSG_CONFIRM flag,
 // set to 0 so no effect in flags.
 #define MSG_CONFIRM 0
+#else
+// recvmmsg and sendmmsg, and SO_REUSEPORT spreading packets
+// over the sockets.
+#define BATCHRECEIVE
 #endif
 
 using namespace std;
-
-// magic and version
-// these are not defined in a .hpp file so that
-// the client file can be self contained.
-
-static const uint32_t magic = 'SRVC';
-static const uint16_t version = 0x1000;
-
-enum opCode { regService = 1, remService, srchService, resetServer };
+// magic, version, offsets and name lengths are in svcDirCodec.hpp,
+// which the client uses as well.
+using namespace svcCodec;
+
+// ntfyService and busyService are only ever sent by the server, they
+// are not valid requests. rplService and syncState are between
+// directory nodes.
+enum opCode { regService = 1, remService, srchService, resetServer, rnwService,
+              srchAllService, srchBatchService, wtchService, ntfyService,
+              rplService, syncState, busyService, statService };
+#define MAXOPCODE statService
 string opString[] = {
-    "none", "register", "remove", "search", "reset"
-};
-
-struct header {
-   uint32_t magic;
-   uint16_t version;
-   uint16_t opCode;
-   uint32_t serial;
+    "none", "register", "remove", "search", "reset", "renew", "search all", "search batch",
+    "watch", "notify", "replicate", "sync", "busy", "stats"
 };
 
 // prototypes for service routines
@@ -72,52 +152,132 @@ bool registerService(uint8_t *buffer, int32_t & n);
 bool removeService(uint8_t *buffer, int32_t & n);
 bool searchService(uint8_t *buffer, int32_t & n);
 bool resetServiceServer(uint8_t *buffer, int32_t & n);
-
-// offsets into packets and max lengths
-#define VERSIONOFFSET   4
-#define OPOFFSET        6
-#define SERIALOFFSET    8
-#define DETAILOFFSET    12
-#define MAXSERVERNAME   63
-#define MAXSERVICENAME  63
+bool renewService(uint8_t *buffer, int32_t & n);
+bool searchAllService(uint8_t *buffer, int32_t & n);
+bool searchBatchService(uint8_t *buffer, int32_t & n);
+bool watchService(uint8_t *buffer, int32_t & n, const struct sockaddr_in & cliaddr);
+bool replicateService(uint8_t *buffer, int32_t & n, const struct sockaddr_in & cliaddr);
+bool syncService(uint8_t *buffer, int32_t & n, const struct sockaddr_in & cliaddr);
+bool statsService(uint8_t *buffer, int32_t & n);
+
+// max lengths
+// replies with more than one server are kept under a typical MTU
+#define MAXREPLYLEN     1400
+// most service names in one batch search, so the reply fits in MAXREPLYLEN
+#define MAXBATCH        16
 
 // utility routine prototypes
-bool parseHeader(uint8_t * buff, int32_t l, header & hdr );
+bool parseHeader(uint8_t * buff, int32_t l, packetHeader & hdr );
+void buildHeader(uint8_t * buff, opCode op, uint32_t serial);
 
 // main continuation flag
-// this will be set to false by the interrupt signal handler
-// global because changed by the interupthandler routine
-// TODO - investigate using poll/signalfd instead of sigaction
-bool processing = false;
-
-// Interrupt signal handler. Called when the user
-// types Ctrl-C. Setts the processing to false
-extern "C" void mainIntrHandler(int signal){
-#ifdef DEBUG
-    cerr << "***************** Interrupt **********************" << endl;
-#endif
-    processing = false;
+// this is set to false by main when SIGINT or SIGTERM arrives.
+// The worker threads check it after every packet.
+std::atomic<bool> processing{false};
+
+// This is the main dictionary used by the server.
+serviceRegistry registry;
+// and the clients watching it for changes.
+watchTable watches;
+// the other directory nodes, if there are any.
+cluster peers;
+// the copy on disk, if -d was given.
+registryStore store;
+// the search rate limits.
+admissionControl admission;
+// requests handled by opcode, for the stats request.
+std::atomic<uint64_t> requestCounts[MAXOPCODE + 1];
+// when the server started, for the stats request.
+chrono::steady_clock::time_point startTime = chrono::steady_clock::now();
+// the socket, for sending to peers and watchers.
+int serverSocket = -1;
+
+static int openSocket(const struct sockaddr_in & servaddr, bool reusePort);
+static bool handleRequest(uint8_t *buffer, int32_t & n, const struct sockaddr_in & cliaddr);
+static bool isSearch(uint8_t *buffer, int32_t n);
+static bool serveSearch(uint8_t *buffer, int32_t & n, const struct sockaddr_in & cliaddr, uint32_t waited);
+void serveRequests(int sockfd);
+void expireLeases();
+void sendNotifications(int sockfd);
+void syncPeers();
+void sendReplicas(const vector<replica> & replicas, const struct sockaddr_in & addr);
+
+// SIGUSR1 and SIGUSR2 make the log more or less verbose
+// while the server is running.
+extern "C" void logLevelHandler(int signal){
+    if (signal == SIGUSR1){
+        svcLog::moreVerbose();
+    } else {
+        svcLog::lessVerbose();
+    }
+}
+
+static void usage(const char * name){
+    std::cerr << "Usage: " << name << " [-t threads] [-p host:port,host:port...] [-d directory] [-r rate[:burst]] [-k seconds] portnumber" << std::endl;
+    exit(1);
 }
 
 //+
 // main routine
 //
-// Opens the socket, receives messages and calls the appropriate
-// service handling routine and sends back the packet.
+// Opens the sockets and starts the worker threads that receive
+// messages, call the appropriate service handling routine and
+// send back the packet. The main thread then just waits for
+// Ctrl-C or SIGTERM.
 //
 //-
 
 int main(int argc, char * argv[]) {
-    int sockfd;
-    uint32_t bufferInt[BUFFSIZE];
-    uint8_t *buffer = (uint8_t*)bufferInt;
-    struct sockaddr_in servaddr, cliaddr;
-    
-    if (argc != 2){
-        std::cerr << "Usage: " << argv[0] << " portnumber" << std::endl;
-        exit(1);
+    struct sockaddr_in servaddr;
+    int numThreads = DEFAULTTHREADS;
+    int opt;
+
+    string peerList;
+    string storeDir;
+    uint32_t rate = DEFAULTRATE;
+    uint32_t burst = 2 * DEFAULTRATE;
+    uint32_t keepRemoved = DEFAULTTOMBSTONESECONDS;
+    char * end;
+
+    while ((opt = getopt(argc, argv, "t:p:d:r:k:")) != -1){
+        switch (opt){
+            case 't':
+                numThreads = atoi(optarg);
+                break;
+            case 'p':
+                peerList = optarg;
+                break;
+            case 'd':
+                storeDir = optarg;
+                break;
+            case 'r':
+                // rate or rate:burst, 0 for no limit
+                rate = strtoul(optarg, &end, 10);
+                burst = 2 * rate;
+                if (end != optarg && *end == ':'){
+                    char * start = end + 1;
+                    burst = strtoul(start, &end, 10);
+                    if (end == start) usage(argv[0]);
+                }
+                if (end == optarg || *end != '\0'){
+                    usage(argv[0]);
+                }
+                break;
+            case 'k':
+                // seconds removals are remembered
+                keepRemoved = strtoul(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || keepRemoved == 0){
+                    usage(argv[0]);
+                }
+                break;
+            default:
+                usage(argv[0]);
+        }
     }
-    uint16_t port = atoi(argv[1]);
+    if (optind != argc - 1 || numThreads < 1){
+        usage(argv[0]);
+    }
+    uint16_t port = atoi(argv[optind]);
     if (port == 0){
         std::cerr << "Port number canot be zero" << std::endl;
         exit(1);
@@ -128,30 +288,14 @@ int main(int argc, char * argv[]) {
             << SERVICE_END_PORT << std::endl;
         exit(1);
     }
-    
-    // seed the random number generator
-    std::random_device rd; 
-    std::mt19937 gen(rd());
-
-    // double check buffer alignment for ARM machines
-    if ((long long)buffer & 3){
-        cerr << "buffer is not word aligned" << endl;
+    // the port tells this node's changes apart from the peers'.
+    peers.setNodeId(port);
+    if (!peerList.empty() && !peers.addPeers(peerList)){
         exit(1);
     }
 
-
-    // Create a socket to recieve messages
-#ifdef DEBUG
-    cout << "Server creating a socket" << endl;
-#endif
-    if ( (sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ) {
-        perror("socket creation failed");
-        exit(errno);
-    }
-    
     // Initialize sockaddr_in structures to zero.
     memset(&servaddr, 0, sizeof(servaddr));
-    memset(&cliaddr, 0, sizeof(cliaddr));
        
     // Bind the server, currently to
     // the port given on the command line and
@@ -159,28 +303,445 @@ int main(int argc, char * argv[]) {
     servaddr.sin_family    = AF_INET; // IPv4
     servaddr.sin_addr.s_addr = INADDR_ANY;
     servaddr.sin_port = htons(port);
-       
-    if (::bind(sockfd, (const struct sockaddr *)&servaddr, sizeof(servaddr)) < 0 ) {
-        perror("bind failed");
-        exit(EXIT_FAILURE);
+
+    // Create the sockets to recieve messages, one for each worker
+    // where the kernel can share the packets out between them.
+#ifdef DEBUG
+    cout << "Server creating sockets" << endl;
+#endif
+    vector<int> sockets;
+#ifdef BATCHRECEIVE
+    // a socket without SO_REUSEPORT can't bind while another server
+    // has the port, so a second server stops here instead of quietly
+    // taking half the packets with a directory of its own.
+    close(openSocket(servaddr, false));
+    for (int i = 0; i < numThreads; i++){
+        sockets.push_back(openSocket(servaddr, true));
+    }
+#else
+    sockets.push_back(openSocket(servaddr, false));
+#endif
+
+    // the first socket also sends to peers and watchers.
+    serverSocket = sockets[0];
+
+    // start the logger, the level can be set with SVCLOG_LEVEL
+    svcLog::start();
+    SVCLOG(svcLog::lvlInfo, "Service Server listening on port {} with {} threads, {} sockets and {} peers",
+        port, numThreads, sockets.size(), peers.peers().size());
+
+    // a lone node has no one to bring back what it removed.
+    registry.keepTombstones(peers.empty() ? 0 : keepRemoved);
+    admission.configure(rate, burst);
+    if (admission.limited()){
+        SVCLOG(svcLog::lvlInfo, "Searches limited to {} a second from each address, bursts of {}", rate, burst);
+    }
+
+    // put back what was saved. The clock is moved past every stamp
+    // restored so that new changes here are newer than all of them.
+    if (!storeDir.empty()){
+        bool opened = store.open(storeDir, [](const replica & r){
+            peers.observe(r.stamp);
+            if (r.present){
+                registry.add(r.svcName, r.server, r.leaseSeconds, r.stamp, r.weight, r.load);
+            } else {
+                registry.remove(r.svcName, r.server, r.stamp);
+            }
+        });
+        if (!opened){
+            svcLog::stop();
+            exit(1);
+        }
     }
 
     // set global processing flag.
     processing = true;
 
-    // direct cntrl C to our Interrupt Handler
-    struct sigaction mySigHandler;
-    mySigHandler.sa_handler = mainIntrHandler;
-    mySigHandler.sa_flags = 0;
-    sigaction(SIGINT,&mySigHandler, NULL);
-    sigaction(SIGTERM,&mySigHandler, NULL);
+    // SIGINT and SIGTERM are blocked here, before the workers are
+    // created, so that they are only seen by the sigwait below.
+    sigset_t stopSignals;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stopSignals, NULL);
 
     struct sigaction ignoreSignal;
-    mySigHandler.sa_handler = SIG_IGN;
-    mySigHandler.sa_flags = 0;
+    memset(&ignoreSignal, 0, sizeof(ignoreSignal));
+    ignoreSignal.sa_handler = SIG_IGN;
     sigaction(SIGHUP,&ignoreSignal, NULL);
 
-    // processing is set to false by the signal handler
+    struct sigaction levelSignal;
+    memset(&levelSignal, 0, sizeof(levelSignal));
+    levelSignal.sa_handler = logLevelHandler;
+    levelSignal.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1,&levelSignal, NULL);
+    sigaction(SIGUSR2,&levelSignal, NULL);
+
+    // every add and remove (including expired leases) goes to the watchers.
+    registry.observe([](const string & svcName, bool added, const serverEntity & server){
+        watches.changed(svcName, added, server);
+    });
+
+    vector<thread> workers;
+    for (int i = 0; i < numThreads; i++){
+        workers.emplace_back(serveRequests, sockets[i % sockets.size()]);
+    }
+    thread leaseThread(expireLeases);
+    thread notifyThread(sendNotifications, serverSocket);
+    thread syncThread(syncPeers);
+
+    // wait for cntrl C or SIGTERM
+    int sig;
+    sigwait(&stopSignals, &sig);
+#ifdef DEBUG
+    cerr << "***************** Interrupt **********************" << endl;
+#endif
+    processing = false;
+
+    // wake up the workers that are blocked receiving. Shutting down
+    // the receive side makes a blocked recvmmsg return at once, which
+    // a packet sent to the port can't do when there are several
+    // sockets as it only reaches one of them. Where that doesn't work
+    // for UDP the workers share one socket and are each sent an empty
+    // packet instead.
+#ifdef BATCHRECEIVE
+    for (int fd : sockets){
+        shutdown(fd, SHUT_RD);
+    }
+#else
+    int wakefd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in selfaddr = servaddr;
+    selfaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (int i = 0; i < numThreads; i++){
+        sendto(wakefd, "", 0, 0, (const struct sockaddr *)&selfaddr, sizeof(selfaddr));
+    }
+    close(wakefd);
+#endif
+    for (auto & w : workers){
+        w.join();
+    }
+    leaseThread.join();
+    syncThread.join();
+    watches.stop();
+    notifyThread.join();
+
+    // the next start then only has the snapshot to read.
+    store.snapshot(registry);
+
+    // we get here on an interrupt (Ctrl-C) or SIGTERM
+#ifdef DEBUG
+    cerr << "Server done" << endl;
+#endif
+    
+    for (int fd : sockets){
+        close(fd);
+    }
+    SVCLOG(svcLog::lvlInfo, "Service Server stopped");
+    svcLog::stop();
+    return 0;
+}
+
+//+
+// openSocket
+//
+// a UDP socket bound to the server's port, exits if it can't be bound.
+// With reusePort several can be bound to the same port, and a second
+// server started by the same user would join in rather than failing,
+// so main binds one without it first to check the port is free.
+//-
+
+static int openSocket(const struct sockaddr_in & servaddr, bool reusePort){
+    int sockfd;
+    if ( (sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ) {
+        perror("socket creation failed");
+        exit(errno);
+    }
+    int on = 1;
+    if (reusePort && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0){
+        perror("setting SO_REUSEPORT failed");
+        exit(EXIT_FAILURE);
+    }
+    // not fatal, the kernel may cap it.
+    int rcvBuf = RCVBUFSIZE;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvBuf, sizeof(rcvBuf));
+#ifdef BATCHRECEIVE
+    // the time each packet arrived, to see how far behind the server is.
+    setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+#endif
+
+    if (::bind(sockfd, (const struct sockaddr *)&servaddr, sizeof(servaddr)) < 0 ) {
+        perror("bind failed");
+        exit(EXIT_FAILURE);
+    }
+    return sockfd;
+}
+
+//+
+// handleRequest
+//
+// check the header of one received packet and call its service
+// routine. The reply is built in place in buffer, n is then its
+// length. Returns false if there is nothing to send back.
+//-
+
+static bool handleRequest(uint8_t *buffer, int32_t & n, const struct sockaddr_in & cliaddr){
+#ifdef DEBUG
+    cout << "Server received -------"<< endl << HexDump{buffer, (uint32_t)n};
+    cerr << "-----------------------" << endl;
+#endif
+
+    // the header contains the opcodes.
+    // parseHeader checks the magic and signal.
+    // We reuse the buffer, only modifying the bufer after
+    // the header (header is 12 bytes), so all
+    // the header fields will be returned to the client unchanged.
+
+    packetHeader receivedHeader;
+    if (!parseHeader(buffer, n, receivedHeader)){
+        // invalid packet after header that was not handled by the service routines
+        // currently the packet is simply ignored and the client will have to time out.
+        return false;
+    }
+
+#ifdef DEBUG
+    cerr << "  Opcode is " << opString[receivedHeader.opCode] << endl;
+    cerr << "  Serial is " << receivedHeader.serial << endl;
+#endif
+    requestCounts[receivedHeader.opCode].fetch_add(1, memory_order_relaxed);
+
+    bool result = false;
+    switch((opCode)receivedHeader.opCode){
+        case regService:
+            result = registerService(buffer,n);
+            break;
+        case remService:
+            result = removeService(buffer,n);
+            break;
+        case srchService:
+            result = searchService(buffer,n);
+            break;
+        case resetServer:
+            result = resetServiceServer(buffer,n);
+            break;
+        case rnwService:
+            result = renewService(buffer,n);
+            break;
+        case srchAllService:
+            result = searchAllService(buffer,n);
+            break;
+        case srchBatchService:
+            result = searchBatchService(buffer,n);
+            break;
+        case wtchService:
+            result = watchService(buffer,n,cliaddr);
+            break;
+        case ntfyService:
+            break;
+        case rplService:
+            result = replicateService(buffer,n,cliaddr);
+            break;
+        case syncState:
+            result = syncService(buffer,n,cliaddr);
+            break;
+        case busyService:
+            break;
+        case statService:
+            result = statsService(buffer,n);
+            break;
+    }
+    // this should alwasy be true.
+    // service routines should handle errors and set an appropriate return
+    // value.
+    // TODO - not all errors are correctly handled must be updaqated
+#ifdef DEBUG
+    if (result){
+        cerr << "Buffer to return is:" << endl << HexDump{buffer,n};
+    }
+#endif
+    return result;
+}
+
+//+
+// isSearch
+//
+// true for a valid search request. Searches are served after the
+// other requests and are the ones that may be answered busy.
+//-
+
+static bool isSearch(uint8_t *buffer, int32_t n){
+    packetHeader hdr;
+    if (!readHeader(buffer, n, hdr) || hdr.magic != PACKETMAGIC || hdr.version != PACKETVERSION){
+        return false;
+    }
+    return hdr.opCode == srchService || hdr.opCode == srchAllService || hdr.opCode == srchBatchService;
+}
+
+//+
+// serveSearch
+//
+// answer a search, or tell the client it is busy if the search waited
+// more than MAXQUEUEDELAY ms to be read (waited) or the client is over
+// its rate. The busy reply is
+//
+//    header (opcode busyService, serial from the request)
+//    wait: 4 bytes - milliseconds before asking again
+//-
+
+static bool serveSearch(uint8_t *buffer, int32_t & n, const struct sockaddr_in & cliaddr, uint32_t waited){
+    uint32_t wait = 0;
+    if (waited > MAXQUEUEDELAY){
+        admission.overloaded();
+        wait = BUSYWAIT;
+    } else {
+        wait = admission.admit(cliaddr.sin_addr.s_addr);
+    }
+    if (wait == 0){
+        return handleRequest(buffer, n, cliaddr);
+    }
+
+    SVCLOG(svcLog::lvlTrace, "Busy, {} told to wait {}ms", inet_ntoa(cliaddr.sin_addr), wait);
+    store16(buffer + OPOFFSET, busyService);
+    n = packetWriter(buffer, BUFFSIZE).u32(wait).pos();
+    return true;
+}
+
+#ifdef BATCHRECEIVE
+// milliseconds from the packet arriving to now, from the timestamp
+// the kernel attached.
+static uint32_t waitedFor(struct msghdr & hdr, const struct timespec & now){
+    for (struct cmsghdr * c = CMSG_FIRSTHDR(&hdr); c != nullptr; c = CMSG_NXTHDR(&hdr, c)){
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPNS){
+            struct timespec arrived;
+            memcpy(&arrived, CMSG_DATA(c), sizeof(arrived));
+            int64_t ms = (now.tv_sec - arrived.tv_sec) * 1000 + (now.tv_nsec - arrived.tv_nsec) / 1000000;
+            return ms > 0 ? ms : 0;
+        }
+    }
+    return 0;
+}
+#endif
+
+//+
+// serveRequests
+//
+// the receive loop, one of these runs on each worker thread.
+//
+// With BATCHRECEIVE each worker has a socket of its own. recvmmsg
+// waits for the first packet and then takes whatever else has arrived,
+// up to RECVBATCH, so a burst costs one system call per batch rather
+// than one per packet. Everything else in the batch is handled before
+// the searches, and a search that sat in the socket too long is
+// answered busy, which is cheap, so a backlog clears quickly and
+// registrations are not stuck behind it. The replies are built in the
+// packets' buffers and sent back together with sendmmsg.
+//
+// Otherwise all of the workers share the one socket, the kernel hands
+// each packet to exactly one of them.
+//-
+
+#ifdef BATCHRECEIVE
+
+void serveRequests(int sockfd){
+    // one buffer per packet in the batch, word aligned.
+    vector<uint32_t> bufferInt(RECVBATCH * BUFFSIZE / 4);
+    uint8_t *buffers = (uint8_t*)bufferInt.data();
+    struct sockaddr_in cliaddr[RECVBATCH];
+    struct iovec iov[RECVBATCH];
+    struct mmsghdr msgs[RECVBATCH];
+    // room for the arrival time of each packet
+    union {
+        struct cmsghdr align;
+        char buff[CMSG_SPACE(sizeof(struct timespec))];
+    } control[RECVBATCH];
+    // the replies point at the same buffers and addresses
+    struct iovec replyIov[RECVBATCH];
+    struct mmsghdr replies[RECVBATCH];
+
+    memset(msgs, 0, sizeof(msgs));
+    memset(replies, 0, sizeof(replies));
+    for (int i = 0; i < RECVBATCH; i++){
+        iov[i].iov_base = buffers + i * BUFFSIZE;
+        iov[i].iov_len = BUFFSIZE;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &cliaddr[i];
+        msgs[i].msg_hdr.msg_control = control[i].buff;
+    }
+
+    // processing is set to false by main on a signal
+    while (processing){
+        // msg_namelen and msg_controllen are value/result fields,
+        // reset them every time.
+        for (int i = 0; i < RECVBATCH; i++){
+            msgs[i].msg_hdr.msg_namelen = sizeof(cliaddr[i]);
+            msgs[i].msg_hdr.msg_controllen = sizeof(control[i].buff);
+        }
+
+#ifdef DEBUG
+        cerr << "******************************************************" << endl;
+#endif
+        SVCLOG(svcLog::lvlTrace, "Service Server waiting for a message");
+
+        // wait for at least one packet, then take what else is there.
+        int count = recvmmsg(sockfd, msgs, RECVBATCH, MSG_WAITFORONE, nullptr);
+        // count is 0 once main has shut the socket down.
+        if (!processing || count <= 0){
+            // if count < 0 then there was an error in reciving, go arround again.
+            continue;
+        }
+#ifdef DEBUG
+        cerr << "Server received " << dec << count << " packets" << endl;
+#endif
+
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+
+        // everything but searches on the first pass, searches on the second.
+        bool search[RECVBATCH];
+        for (int i = 0; i < count; i++){
+            search[i] = isSearch((uint8_t*)iov[i].iov_base, msgs[i].msg_len);
+        }
+        int replyCount = 0;
+        for (int pass = 0; pass < 2; pass++){
+            for (int i = 0; i < count; i++){
+                int32_t n = msgs[i].msg_len;
+                if (n <= 0 || search[i] != (pass == 1)) continue;
+                uint8_t *buffer = (uint8_t*)iov[i].iov_base;
+                bool reply = search[i] ? serveSearch(buffer, n, cliaddr[i], waitedFor(msgs[i].msg_hdr, now))
+                                       : handleRequest(buffer, n, cliaddr[i]);
+                if (reply){
+                    replyIov[replyCount].iov_base = buffer;
+                    replyIov[replyCount].iov_len = n;
+                    replies[replyCount].msg_hdr.msg_iov = &replyIov[replyCount];
+                    replies[replyCount].msg_hdr.msg_iovlen = 1;
+                    replies[replyCount].msg_hdr.msg_name = &cliaddr[i];
+                    replies[replyCount].msg_hdr.msg_namelen = msgs[i].msg_hdr.msg_namelen;
+                    replyCount++;
+                }
+            }
+        }
+
+        // sendmmsg can stop short, send the rest. A reply that fails
+        // is dropped, the client will time out as it would for a lost
+        // packet.
+        int sent = 0;
+        while (sent < replyCount){
+            int r = sendmmsg(sockfd, replies + sent, replyCount - sent, MSG_CONFIRM);
+            sent += (r > 0) ? r : 1;
+        }
+    }
+}
+
+#else
+
+void serveRequests(int sockfd){
+    uint32_t bufferInt[BUFFSIZE/4];
+    uint8_t *buffer = (uint8_t*)bufferInt;
+    struct sockaddr_in cliaddr;
+
+    memset(&cliaddr, 0, sizeof(cliaddr));
+
+    // processing is set to false by main on a signal
     while (processing){
         socklen_t len;
         int32_t n;
@@ -196,7 +757,7 @@ int main(int argc, char * argv[]) {
 #ifdef DEBUG
         cerr << "******************************************************" << endl;
 #endif
-        cerr << "Service Server waiting for a message" << endl;
+        SVCLOG(svcLog::lvlTrace, "Service Server waiting for a message");
 
         // wait for packet from a client
         n = recvfrom(sockfd, (char *)buffer, BUFFSIZE, MSG_WAITALL, ( struct sockaddr *) &cliaddr, &len);
@@ -204,68 +765,166 @@ int main(int argc, char * argv[]) {
 #ifdef DEBUG
         cerr << "Server received " << dec << n << " bytes from " << inet_ntoa(cliaddr.sin_addr)<< endl;
 #endif
-        if (processing && n > 0){
+        // no arrival times here, searches are only held to the rate.
+        if (processing && n > 0 && (isSearch(buffer, n) ? serveSearch(buffer, n, cliaddr, 0)
+                                                        : handleRequest(buffer, n, cliaddr))){
+            sendto(sockfd,(char*)buffer, n,MSG_CONFIRM, (const struct sockaddr *)&cliaddr, len);
+        }
+	     // if n < 0 then there was an error in reciving the packet, go arround again.
+    }
+}
 
-#ifdef DEBUG
-            cout << "Server received -------"<< endl << HexDump{buffer, (uint32_t)n};
-            cerr << "-----------------------" << endl;
 #endif
 
-            // the header contains the opcodes.
-            // parseHeader checks the magic and signal.
-            // We reuse the buffer, only modifying the bufer after
-            // the header (header is 12 bytes), so all
-            // the header fields will be returned to the client unchanged.
-            
-            header receivedHeader;
-            if (parseHeader(buffer, n, receivedHeader)){
+//+
+// expireLeases
+//
+// runs on its own thread, ticking the lease timer wheels once a second.
+// Watches that have not been renewed are dropped at the same time, and
+// the snapshot is written here when it is due. Expired leases are not
+// logged, they are worked out again from the lease when restored.
+// Searches answered busy are logged every SHEDLOGINTERVAL seconds.
+//-
 
-#ifdef DEBUG
-                cerr << "  Opcode is " << opString[receivedHeader.opCode] << endl;
-                cerr << "  Serial is " << receivedHeader.serial << endl;
-#endif
-                
-                bool result;
-                switch((opCode)receivedHeader.opCode){
-                    case regService:
-                        result = registerService(buffer,n);
-                        break;
-                    case remService:
-                        result = removeService(buffer,n);
-                        break;
-                    case srchService:
-                        result = searchService(buffer,n);
-                        break;
-                    case resetServer:
-                        result = resetServiceServer(buffer,n);
-                        break;
-                }
-                if (result){
-                    // this should alwasy be true.
-                    // service routines should handle errors and set an appropriate return
-                    // value.
-                    // TODO - not all errors are correctly handled must be updaqated
-#ifdef DEBUG
-                    cerr << "Buffer to return is:" << endl << HexDump{buffer,n};
-#endif
-                    
-                    uint32_t sendn = sendto(sockfd,(char*)buffer, n,MSG_CONFIRM, (const struct sockaddr *)&cliaddr, len);
-                }
-            } else {
-               // invalid packet after header that was not handled by the service routines
-               // currently the packet is simply ignored and the client will have to time out.
+void expireLeases(){
+    vector<registration> expired;
+    int seconds = 0;
+    int shedSeconds = 0;
+    while (processing){
+        this_thread::sleep_for(chrono::seconds(1));
+        if (store.enabled() && (++seconds >= SNAPSHOTINTERVAL || store.logged() >= MAXLOGRECORDS)){
+            seconds = 0;
+            store.snapshot(registry);
+        }
+        if (++shedSeconds >= SHEDLOGINTERVAL){
+            shedSeconds = 0;
+            uint64_t overRate, behind;
+            admission.takeShed(overRate, behind);
+            if (overRate != 0 || behind != 0){
+                SVCLOG(svcLog::lvlWarn, "Answered busy to {} searches over the rate and {} while behind",
+                    overRate, behind);
             }
+            admission.prune();
         }
-	     // if n < 0 then there was an error in reciving the packet, go arround again.
+        expired.clear();
+        registry.expireLeases(expired);
+        for (auto & r : expired){
+            SVCLOG(svcLog::lvlInfo, "Lease expired {} -> ({},{})", r.svcName, r.server.name, r.server.port);
+        }
+        watches.expire(registry.now());
     }
+}
 
-    // we get here on an interrupt (Ctrl-C) or SIGTERM
-#ifdef DEBUG
-    cerr << "Server done" << endl;
-#endif
-    
-    close(sockfd);
-    return 0;
+//+
+// sendNotifications
+//
+// runs on its own thread, sending the queued changes to the watchers.
+// The notification packet is
+//
+//    header (opcode ntfyService, serial is the version)
+//    service name, null padded to a multiple of 4
+//    epoch: 4 bytes
+//    version: 4 bytes
+//    change: 1 byte - 1 added, 2 removed, 3 new epoch
+//    serverEntity (added and removed only)
+//
+// Notifications are not acknowledged, a watcher that misses one sees
+// a gap in the versions and fetches the whole service again.
+//-
+
+void sendNotifications(int sockfd){
+    uint32_t bufferInt[BUFFSIZE/4];
+    uint8_t *buffer = (uint8_t*)bufferInt;
+    vector<watchTable::notification> batch;
+
+    while (watches.next(batch)){
+        for (auto & nt : batch){
+            buildHeader(buffer, ntfyService, nt.version);
+
+            packetWriter wr(buffer, BUFFSIZE);
+            wr.name(nt.svcName).align(4).u32(nt.epoch).u32(nt.version).u8(nt.what);
+            if (nt.what != watchTable::chgEpoch){
+                wr.server(nt.server.name, nt.server.port);
+            }
+            uint32_t curPos = wr.pos();
+
+            SVCLOG(svcLog::lvlTrace, "Notifying {} watchers of {} version {}",
+                nt.watchers.size(), nt.svcName, nt.version);
+            for (auto & addr : nt.watchers){
+                sendto(sockfd, (char*)buffer, curPos, MSG_CONFIRM, (const struct sockaddr *)&addr, sizeof(addr));
+            }
+        }
+        batch.clear();
+    }
+}
+
+//+
+// syncPeers
+//
+// runs on its own thread. Asks every peer for its registrations when
+// the node starts, then every SYNCINTERVAL seconds sends everything
+// this node has to one peer picked at random, which repairs anything
+// lost in a replica packet that went missing.
+//-
+
+void syncPeers(){
+    if (peers.empty()) return;
+
+    uint32_t bufferInt[DETAILOFFSET/4];
+    uint8_t *buffer = (uint8_t*)bufferInt;
+    buildHeader(buffer, syncState, 0);
+    for (auto & addr : peers.peers()){
+        sendto(serverSocket, (char*)buffer, DETAILOFFSET, MSG_CONFIRM, (const struct sockaddr *)&addr, sizeof(addr));
+    }
+
+    int seconds = 0;
+    vector<replica> state;
+    while (processing){
+        this_thread::sleep_for(chrono::seconds(1));
+        if (++seconds < SYNCINTERVAL) continue;
+        seconds = 0;
+        state.clear();
+        registry.dump(state);
+        sendReplicas(state, peers.randomPeer());
+    }
+}
+
+//+
+// sendReplicas
+//
+// send replicas to a node, as many to a packet as fit in MAXREPLYLEN.
+//-
+
+void sendReplicas(const vector<replica> & replicas, const struct sockaddr_in & addr){
+    uint32_t bufferInt[BUFFSIZE/4];
+    uint8_t *buffer = (uint8_t*)bufferInt;
+
+    size_t next = 0;
+    while (next < replicas.size()){
+        buildHeader(buffer, rplService, 0);
+        uint32_t curPos = DETAILOFFSET + 4;
+        uint16_t count = 0;
+        while (next < replicas.size() && curPos + MAXREPLICALEN <= MAXREPLYLEN){
+            const replica & r = replicas[next++];
+            uint32_t end = cluster::writeReplica(buffer, curPos, r);
+            if (end == 0){
+                SVCLOG(svcLog::lvlWarn, "replica for {} -> ({},{}) is too long to send", r.svcName,
+                    r.server.name, r.server.port);
+                continue;
+            }
+            curPos = end;
+            count++;
+        }
+        packetWriter(buffer, BUFFSIZE).u16(count).u16(0);
+        sendto(serverSocket, (char*)buffer, curPos, MSG_CONFIRM, (const struct sockaddr *)&addr, sizeof(addr));
+    }
+}
+
+// send a change made on this node to all of the peers.
+static void replicate(const vector<replica> & replicas){
+    for (auto & addr : peers.peers()){
+        sendReplicas(replicas, addr);
+    }
 }
 
 // ************************************
@@ -294,36 +953,32 @@ void exitf(string routine){
 // returns false if the header cannot be parsed.
 //-
 
-bool parseHeader(uint8_t * buff, int32_t l, header & hdr ){
+bool parseHeader(uint8_t * buff, int32_t l, packetHeader & hdr ){
 #ifdef TRACE
     enterf("parseHeader");
 #endif
     
-    if (l < 12) {
+    if (!readHeader(buff, l, hdr)) {
         exitf("parseHeader");
         return false;
     }
     
-    hdr.magic = ntohl(*((uint32_t*)buff));
-    if (hdr.magic != magic){
-        cerr << "Magic in packet not correct" << endl;
+    if (hdr.magic != PACKETMAGIC){
+        SVCLOG(svcLog::lvlWarn, "Magic in packet not correct");
         exitf("parseHeader");
         return false;
     }
 
-    hdr.version = ntohs(*(uint16_t*)(buff + VERSIONOFFSET));
-    if (hdr.version != version){
-        cerr << "Packet version not correct" << endl;
+    if (hdr.version != PACKETVERSION){
+        SVCLOG(svcLog::lvlWarn, "Packet version {} not correct", hdr.version);
         exitf("parseHeader");
         return false;
     }
-    hdr.opCode = ntohs(*(uint16_t*)(buff + OPOFFSET));
-    if (hdr.opCode > 4 || hdr.opCode == 0) {
-        cerr << "opCode on packet not correct" << endl;
+    if (hdr.opCode > MAXOPCODE || hdr.opCode == 0) {
+        SVCLOG(svcLog::lvlWarn, "opCode {} on packet not correct", hdr.opCode);
         exitf("parseHeader");
         return false;
     }
-    hdr.serial = ntohl(*(uint32_t*)(buff + SERIALOFFSET));
     
 #ifdef TRACE
     exitf("parseHeader");
@@ -332,69 +987,74 @@ bool parseHeader(uint8_t * buff, int32_t l, header & hdr ){
 }
 
 
-// Data structures describing in packets
-// server name and port
-
-struct serverEntity {
-    string name;
-    uint16_t port;
-};
+//+
+// buildHeader
+//
+// write the four key values into the 12 byte packet header, for
+// packets the server starts itself rather than replies.
+//-
 
-// stream formatter for debugging
-ostream &operator << (ostream&s,serverEntity se){
-    s << "{"<< se.name << ", " << dec << se.port << "}";
-    return s;
+void buildHeader(uint8_t * buff, opCode op, uint32_t serial){
+    writeHeader(buff, op, serial);
 }
 
-// This is the main dictionary used by the server.
-
-// Map service name to a vector of server/port entities
-map<string,vector<serverEntity>> svcMap;
-
 //+
 // readName
 //
 // a name is stored as a single byte length followed the string data. No null
-// byte is stored at the end. The curpos parameter is pass by reference and
-// set to the position of the byte following the end of the name.
+// byte is stored at the end. The name is a view into the packet, it is only
+// good until the reply is written over it.
 //
+// Names that are kept (registrations) are limited to maxLen, the
+// replicas and the store have no room for more. A search can give any
+// name the byte allows, it just won't find anything.
 //-
 
-bool readName(uint8_t * buffer, int32_t n, uint32_t &curPos, string & name, string errName){
-#ifdef TRACE
-    enterf("readName");
-#endif
-    
-    // recover length of name
-    if (curPos >= n){
-       cerr << "packet doesn't contain " << errName << " name" << endl;
-        exitf("readName");
+static bool readName(packetReader & rd, string_view & name, const char * errName, uint32_t maxLen = 0xFF){
+    name = rd.name();
+    if (!rd.ok()){
+        SVCLOG(svcLog::lvlWarn, "packet doesn't contain {} name", errName);
+        return false;
+    }
+    if (name.length() > maxLen){
+        SVCLOG(svcLog::lvlWarn, "{} name of {} bytes is too long", errName, name.length());
         return false;
     }
-
-    int nameLen = *((uint8_t*)(buffer+curPos++));
-    
 #ifdef DEBUG
-    cout << "  " << errName << " name length is " << nameLen << endl;
+    cout << "  " << errName << " name is " << name << endl;
 #endif
-    
-    // recover name data
-    if (n < curPos + nameLen){
-        cerr << "packet doesn't contain " << errName << " name data" << endl;
-        exitf("readName");
+    return true;
+}
+
+//+
+// readServer
+//
+// the service name, padded to 4, and the serverEntity that start the
+// register, renew and remove packets.
+//-
+
+static bool readServer(packetReader & rd, string_view & svcName, serverEntity & server){
+    if (!readName(rd, svcName, "service", MAXSERVICENAME)){
+        return false;
+    }
+    // 4 byte alignment. Note this might take us past
+    // the end of the buffer, the reader checks.
+    rd.align(4);
+
+    string_view serverName;
+    if (!readName(rd, serverName, "server", MAXSERVERNAME)){
         return false;
     }
-    name = string((char*)(buffer+curPos),nameLen);
+    server.name = serverName;
 
+    // go to 2 byte alignment and get the port
+    server.port = rd.align(2).u16();
+    if (!rd.ok()) {
+       SVCLOG(svcLog::lvlWarn, "packet doesn't contain port");
+       return false;
+    }
 #ifdef DEBUG
-    cout << "  " << errName << " name is " << name << endl;
-#endif
-    
-    // advance curPos
-    curPos += nameLen;
-    
-#ifdef TRACE
-    exitf("readName");
+    cout << " server is " << server << endl;
 #endif
     return true;
 }
@@ -409,80 +1069,93 @@ bool readName(uint8_t * buffer, int32_t n, uint32_t &curPos, string & name, stri
 // extract the service name, server name and port from the packet data.
 // add it to the dictionary given by the client address (masked to a network number)
 //
-// TODO - shoud create an appropriate response when the packet is malformed
-//   - add a false byte at end of header and set length to header + 1
+// the port may be followed (at 4 byte alignment) by a lease time in
+// seconds. Older clients don't send it and their registration never
+// expires. The lease may be followed by a weight (2 bytes, 0 means the
+// default) and the server's current load (2 bytes, 0 for none).
+//
+// renewService is the heartbeat for a leased registration. The packet
+// is the same as for register, so it carries the load the server
+// reports. If the registration has already expired (or the directory
+// was restarted) it is simply added again.
+//
+// A malformed packet, or one with a name longer than the directory
+// keeps (MAXSERVICENAME, MAXSERVERNAME), is answered false.
 //-
 
+static bool addServer(uint8_t *buffer, int32_t & n, bool renew);
+
 bool registerService(uint8_t *buffer, int32_t & n){
+    return addServer(buffer, n, false);
+}
+
+bool renewService(uint8_t *buffer, int32_t & n){
+    return addServer(buffer, n, true);
+}
+
+static bool addServer(uint8_t *buffer, int32_t & n, bool renew){
     //note header is already read. So next byte availble in the record
     // is DETAILOFFSET (byte 13 at index 12).
-    
-    string svcName;
-    uint32_t curPos = DETAILOFFSET;
+    packetReader rd(buffer, n);
 
 #ifdef TRACE
-    enterf("registerServce");
+    enterf("addServer");
 #endif
 
-    // read the service name
-    if (!readName(buffer,n,curPos,svcName,"service")){
-        exitf("registerServce");
-        return false;
-    }
-
-    // 4 byte alignment. Note this might take us past
-    // the end of the buffer, must be checked.
-    curPos = ((curPos + 3) & 0xFFFFFFFC);
-
-    // check more data available.
-    if (curPos >= n){
-        cerr << "packet doesn't contain server name" << endl;
-        exitf("registerServce");
-        return false;
-    }
-
-    // get server data
+    string_view svcView;
     serverEntity server;
-
-    // read the server name.
-    if (!readName(buffer,n,curPos,server.name,"server")){
-        exitf("registerServce");
-        return false;
+    if (!readServer(rd, svcView, server)){
+        // answer false rather than leave the client to time out
+        buffer[DETAILOFFSET] = 0;
+        n = DETAILOFFSET + 1;
+        exitf("addServer");
+        return true;
     }
-
-#ifdef DEBUG
-    cout << " server name is " << server.name << endl;
-#endif
-    // go to 2 byte alignment (again may take us past the end of the data)
-    curPos = ((curPos + 1) & 0xFFFFFFFE);
-        
-    // check that room in the packet for the port
-    if ((curPos + 2) > n) {
-       cerr << "packet doesn't contain port" << endl;
-       exitf("registerServce");
-       return false;
+    // the registry keeps the name
+    string svcName(svcView);
+
+    // optional lease
+    uint32_t lease = 0;
+    rd.align(4);
+    if (rd.has(4)){
+        lease = rd.u32();
+    }
+    // optional weight and load
+    uint16_t weight = DEFAULTWEIGHT;
+    uint16_t load = 0;
+    if (rd.has(4)){
+        weight = rd.u16();
+        load = rd.u16();
+        if (weight == 0) weight = DEFAULTWEIGHT;
     }
-    // recover the port number
-    server.port = ntohs(*((uint16_t*)(buffer+curPos)));
-    curPos += 2;
-
-#ifdef DEBUG
-    cout << " port = " << dec << server.port << endl;
-#endif
     
-    cerr << "Adding " << svcName << " -> (" << server.name << "," << server.port << ")" << endl;
-    // add the server to the service
-    vector<serverEntity> servers = svcMap[svcName];
-    bool found = false;
-    for (auto it = servers.begin(); it != servers.end(); it++){
-        if (it->name == server.name && it->port == server.port)
-	   found = true;
-    }
-    if (!found){
+    if (renew){
+        SVCLOG(svcLog::lvlTrace, "Renewing {} -> ({},{}) for {}s load {}", svcName, server.name, server.port,
+            lease, load);
+    } else {
+        SVCLOG(svcLog::lvlDebug, "Adding {} -> ({},{}) lease {}s weight {}", svcName, server.name, server.port,
+            lease, weight);
+    }
+    // add the server to the service, if it is
+    // already registered only the lease, weight and load are changed.
+    // a renewal that only pushes the lease on is kept to this node, the
+    // others keep their own lease long enough (serviceRegistry::add).
+    uint64_t stamp = peers.nextStamp();
+    bool passOn;
+    if (registry.add(svcName, server, lease, stamp, weight, load, &passOn)){
 #ifdef DEBUG
-        cout << " adding to map" << endl;
+        cout << " added to map" << endl;
 #endif
-        svcMap[svcName].push_back(server);
+        if (renew){
+            SVCLOG(svcLog::lvlInfo, "Renewal re-added {} -> ({},{})", svcName, server.name, server.port);
+        }
+    }
+    if (passOn || !renew){
+        replica change{svcName, server, stamp, lease, true, weight, load};
+        store.append(change);
+        if (!peers.empty()){
+            replicate({change});
+        }
     }
 
     //return boolean true
@@ -492,7 +1165,7 @@ bool registerService(uint8_t *buffer, int32_t & n){
     n = DETAILOFFSET + 1;
 
 #ifdef TRACE
-    exitf("registerServce");
+    exitf("addServer");
 #endif
     return true;
 
@@ -504,98 +1177,40 @@ bool registerService(uint8_t *buffer, int32_t & n){
 // extract the service name, server name and port from the packet data.
 // remove it to the dictionary given by the client address (masked to a network number)
 // The bulk of the code is the same as registerService, only the final details.
-//
-// TODO - shoud create an appropriate response when the packet is malformed
-//   - add a false byte at end of header and set length to header + 1
+// A malformed packet (or a name too long to keep) is answered false.
 //-
 
 bool removeService(uint8_t *buffer, int32_t & n){
     //note header is already read. So next byte availble in the record
     // is DETAILOFFSET (byte 13 at index 12).
-    
-    string svcName;
-    uint32_t curPos = DETAILOFFSET;
+    packetReader rd(buffer, n);
 
 #ifdef TRACE
     enterf("removeService");
 #endif
     
-    // read the service name
-    if (!readName(buffer,n,curPos,svcName,"service")){
-        exitf("removeService");
-        return false;
-    }
-
-    // 4 byte alignment. Note this might take us past
-    // the end of the buffer, must be checked.
-    curPos = ((curPos + 3) & 0xFFFFFFFC);
-
-    // check more data available.
-    if (curPos >= n){
-        cerr << "packet doesn't contain server name" << endl;
-        exitf("removeService");
-        return false;
-    }
-
-    // get server data
+    string_view svcView;
     serverEntity server;
-
-    // read the server name.
-    if (!readName(buffer,n,curPos,server.name,"server")) {
-        exitf("removeService");
-        return false;
-    }
-#ifdef DEBUG
-    cout << "  server name is " << server.name << endl;
-#endif
-
-    // go to 2 byte alignment (again may take us past the end of the data)
-    curPos = ((curPos + 1) & 0xFFFFFFFE);
-
-    // check that room in the packet for the port
-    if ((curPos + 2) > n) {
-        cerr << "packet doesn't contain port" << endl;
+    if (!readServer(rd, svcView, server)){
+        // answer false rather than leave the client to time out
+        buffer[DETAILOFFSET] = 0;
+        n = DETAILOFFSET + 1;
         exitf("removeService");
-        return false;
+        return true;
     }
-    server.port = ntohs(*((uint16_t*)(buffer+curPos)));
-    curPos += 2;
-
-#ifdef DEBUG
-    cout << "  port = " << dec << server.port << endl;
-#endif
+    string svcName(svcView);
     
-#ifdef DEBUG
-    cout << "  Removing " << server << endl;
-#endif
-    
-    cerr << "Removing " << svcName << " -> (" << server.name << "," << server.port << ")" << endl;
+    SVCLOG(svcLog::lvlDebug, "Removing {} -> ({},{})", svcName, server.name, server.port);
     // remove the server from the service If it is there.
-    // iterate over the vectore of servers associated with the
-    // service name. Note must be a reference variable or
-    // we get a copy of the vecor and don't actually delete
-    // from the vector in the map.
-    vector<serverEntity> &servers = svcMap[svcName];
-    bool found = false;
-    auto it = servers.begin();
-    while ( it != servers.end() && !found){
-
+    uint64_t stamp = peers.nextStamp();
+    if (registry.remove(svcName, server, stamp)) {
 #ifdef DEBUG
-        cout << "  checking " << *it << endl;
+        cout << "  removed " << server << " from map" << endl;
 #endif
-        
-        if (it->name == server.name && it->port == server.port){
-            found = true;
-            break;
-        }
-        it++;
     }
-    
-    if (found) {
-#ifdef DEBUG
-        cout << "  removing " << *it << "from map" << endl;
-#endif
-	    svcMap[svcName].erase(it);
+    store.append(replica{svcName, server, stamp, 0, false});
+    if (!peers.empty()){
+        replicate({replica{svcName, server, stamp, 0, false}});
     }
     
     // alwasy return true. If it wasn't there it didn't need to be deleted,
@@ -610,35 +1225,15 @@ bool removeService(uint8_t *buffer, int32_t & n){
 
 }
 
-//********************************************************************************
-// Template to select a random element of a C++ Container
-// from
-// https://stackoverflow.com/questions/6942273/how-to-get-a-random-element-from-a-c-container
-//********************************************************************************
-
-#include  <iterator>
-
-template<typename Iter, typename RandomGenerator>
-Iter select_randomly(Iter start, Iter end, RandomGenerator& g) {
-    std::uniform_int_distribution<> dis(0, std::distance(start, end) - 1);
-    std::advance(start, dis(g));
-    return start;
-}
-
-template<typename Iter>
-Iter select_randomly(Iter start, Iter end) {
-    static std::random_device rd;
-    static std::mt19937 gen(rd());
-    return select_randomly(start, end, gen);
-}
-//********************************************************************************
-
 //+
 // searchService
 //
 // extract the service name, server name and port from the packet data.
 // add it to the dictionary given by the client address (masked to a network number)
 //
+// The name is looked up straight from the packet, nothing is copied
+// until the server picked is written into the reply.
+//
 // TODO - shoud create an appropriate response when the packet is malformed
 //   - add a false byte at end of header and set length to header + 1
 //-
@@ -646,61 +1241,279 @@ Iter select_randomly(Iter start, Iter end) {
 bool searchService(uint8_t *buffer, int32_t & n){
     //note header is already read. So next byte availble in the record
     // is DETAILOFFSET (byte 13 at index 12).
-    string svcName;
-    uint32_t curPos = DETAILOFFSET;
+    packetReader rd(buffer, n);
+    string_view svcName;
 
 #ifdef TRACE
     enterf("searchService");
 #endif
     
     // read the service name
-    if (!readName(buffer,n,curPos,svcName,"service")) {
+    if (!readName(rd, svcName, "service")) {
         exitf("searchService");
         return false;
     }
     // there is only a service name in the packet,
     // so this is the end of the  input
 
-    // pick random server from vector
-    vector<serverEntity> &servers = svcMap[svcName];
+    // pick random server for the service
     serverEntity se;
-    if (servers.size() == 0){
+    if (!registry.pickRandom(svcName, se)){
         // no servers to pick from
         se = serverEntity{"None",0};
-    } else{
-        se = *select_randomly(servers.begin(), servers.end());
     }
 
-    // return the server that was picked.
-    // reset curPos back to the end of the
-    curPos = DETAILOFFSET;
-
 #ifdef DEBUG
     cout << "  Returning server " << se << endl;
 #endif
     
-    cerr << "Searching for " << svcName << " returned (" << se.name << "," << se.port << ")" << endl;
-    
-    // store server name lentth
-    buffer[curPos++] = se.name.length();
+    SVCLOG(svcLog::lvlDebug, "Searching for {} returned ({},{})", svcName, se.name, se.port);
     
-    // store srver name data
-    memcpy((buffer+curPos),se.name.data(), se.name.length());
-    curPos += se.name.length();
-    // align at 2 bytew
-    curPos = ((uint64_t)(curPos + 1) & 0xFFFFFFFFFFFFFFFEllu);
-    // store port number
-    *((uint16_t*)(buffer+curPos)) = htons(se.port);
-    curPos += 2;
+    // return the server that was picked, this overwrites the name.
+    packetWriter wr(buffer, MAXREPLYLEN);
+    wr.server(se.name, se.port);
     
     // set length of return packet.
-    n = curPos;
+    n = wr.pos();
     
     exitf("searchService");
     return true;
 
 }
 
+//+
+// searchAllService
+//
+// return every server registered for a service. The request is the
+// service name, then (at 2 byte alignment) the index of the first
+// server wanted, 0 if it isn't there. The reply is
+//
+//    total: 2 bytes - number of servers registered for the service
+//    start: 2 bytes - index of the first server in this packet
+//    count: 2 bytes - number of servers in this packet
+//    count serverEntities (each 2 byte aligned)
+//
+// The reply is kept under MAXREPLYLEN, if start + count < total the
+// client asks again with start + count to get the rest. Each packet
+// is a fresh look at the dictionary so a service that changes between
+// packets may show a server twice or miss one.
+//-
+
+bool searchAllService(uint8_t *buffer, int32_t & n){
+    packetReader rd(buffer, n);
+    string_view svcName;
+
+#ifdef TRACE
+    enterf("searchAllService");
+#endif
+
+    if (!readName(rd, svcName, "service")) {
+        exitf("searchAllService");
+        return false;
+    }
+
+    uint16_t start = 0;
+    rd.align(2);
+    if (rd.has(2)){
+        start = rd.u16();
+    }
+
+    // each server takes at least 4 bytes, never need more than this many.
+    vector<serverEntity> servers;
+    uint32_t total = registry.list(svcName, start, (MAXREPLYLEN - DETAILOFFSET - 6) / 4, servers);
+    if (total > 0xFFFF) total = 0xFFFF;
+    SVCLOG(svcLog::lvlDebug, "Searching all for {} from {} of {}", svcName, start, total);
+
+    packetWriter wr(buffer, MAXREPLYLEN, DETAILOFFSET + 6);
+    uint16_t count = 0;
+    for (auto & se : servers){
+        // 1 length byte, name, possible pad byte and port
+        if (!wr.fits(1 + se.name.length() + 1 + 2)) break;
+        wr.server(se.name, se.port);
+        count++;
+    }
+    packetWriter(buffer, MAXREPLYLEN).u16(total).u16(start).u16(count);
+    n = wr.pos();
+
+    exitf("searchAllService");
+    return true;
+}
+
+//+
+// searchBatchService
+//
+// pick a server for each of several services. The request is
+//
+//    count: 1 byte - number of service names, at most MAXBATCH
+//    count service names (length byte and data, no padding)
+//
+// the reply is count followed by one serverEntity (2 byte aligned) for
+// each name in the same order, {None, 0} for unknown services.
+//-
+
+bool searchBatchService(uint8_t *buffer, int32_t & n){
+    packetReader rd(buffer, n);
+
+#ifdef TRACE
+    enterf("searchBatchService");
+#endif
+
+    uint8_t count = rd.u8();
+    if (!rd.ok()){
+        SVCLOG(svcLog::lvlWarn, "packet doesn't contain service count");
+        exitf("searchBatchService");
+        return false;
+    }
+    if (count > MAXBATCH){
+        SVCLOG(svcLog::lvlWarn, "batch of {} services is too large", count);
+        exitf("searchBatchService");
+        return false;
+    }
+
+    // the names are views into the packet, every server has to be
+    // picked before the reply overwrites them.
+    serverEntity picked[MAXBATCH];
+    for (int i = 0; i < count; i++){
+        string_view svcName;
+        if (!readName(rd, svcName, "service")) {
+            exitf("searchBatchService");
+            return false;
+        }
+        if (!registry.pickRandom(svcName, picked[i])){
+            picked[i] = serverEntity{"None",0};
+        }
+    }
+
+    packetWriter wr(buffer, MAXREPLYLEN);
+    wr.u8(count);
+    for (int i = 0; i < count; i++){
+        wr.server(picked[i].name, picked[i].port);
+    }
+    n = wr.pos();
+
+    SVCLOG(svcLog::lvlDebug, "Batch search for {} services", count);
+
+    exitf("searchBatchService");
+    return true;
+}
+
+//+
+// watchService
+//
+// start, renew or stop watching a service. The request is the service
+// name, null padded to a multiple of 4, then the lease in seconds
+// (4 bytes, 0 stops the watch). Notifications go to the address the
+// request came from. The reply is the epoch and version (4 bytes each)
+// the service is at, the watcher fetches the servers if it doesn't
+// already have that version.
+//-
+
+bool watchService(uint8_t *buffer, int32_t & n, const struct sockaddr_in & cliaddr){
+    packetReader rd(buffer, n);
+    string_view svcView;
+
+#ifdef TRACE
+    enterf("watchService");
+#endif
+
+    if (!readName(rd, svcView, "service")) {
+        exitf("watchService");
+        return false;
+    }
+
+    uint32_t lease = rd.align(4).u32();
+    if (!rd.ok()){
+        SVCLOG(svcLog::lvlWarn, "packet doesn't contain watch lease");
+        exitf("watchService");
+        return false;
+    }
+
+    uint32_t epoch, ver;
+    watches.watch(string(svcView), cliaddr, lease, registry.now(), epoch, ver);
+
+    SVCLOG(svcLog::lvlDebug, "Watch {} from {}:{} lease {}s at version {}", svcView,
+        inet_ntoa(cliaddr.sin_addr), ntohs(cliaddr.sin_port), lease, ver);
+
+    packetWriter wr(buffer, MAXREPLYLEN);
+    wr.u32(epoch).u32(ver);
+    n = wr.pos();
+
+    exitf("watchService");
+    return true;
+}
+
+//+
+// replicateService
+//
+// apply the replicas another directory node sent. Each is applied only
+// if it is newer than what is here. No reply is sent, anything lost is
+// put right by the next full sync.
+//-
+
+bool replicateService(uint8_t *buffer, int32_t & n, const struct sockaddr_in & cliaddr){
+#ifdef TRACE
+    enterf("replicateService");
+#endif
+
+    if (!peers.isPeer(cliaddr)){
+        SVCLOG(svcLog::lvlWarn, "replica packet from {}:{} which is not a peer",
+            inet_ntoa(cliaddr.sin_addr), ntohs(cliaddr.sin_port));
+        exitf("replicateService");
+        return false;
+    }
+    packetReader rd(buffer, n);
+    uint16_t count = rd.u16();
+    rd.u16();
+    if (!rd.ok()){
+        SVCLOG(svcLog::lvlWarn, "packet doesn't contain replica count");
+        exitf("replicateService");
+        return false;
+    }
+    uint32_t curPos = rd.pos();
+    uint16_t applied = 0;
+
+    replica r;
+    for (uint16_t i = 0; i < count; i++){
+        if (!cluster::readReplica(buffer, n, curPos, r)){
+            SVCLOG(svcLog::lvlWarn, "replica packet is truncated");
+            break;
+        }
+        peers.observe(r.stamp);
+        bool changed = r.present ? registry.add(r.svcName, r.server, r.leaseSeconds, r.stamp, r.weight, r.load)
+                                 : registry.remove(r.svcName, r.server, r.stamp);
+        if (changed){
+            store.append(r);
+            applied++;
+            SVCLOG(svcLog::lvlDebug, "Replica {} {} -> ({},{})", r.present ? "added" : "removed",
+                r.svcName, r.server.name, r.server.port);
+        }
+    }
+    SVCLOG(svcLog::lvlTrace, "Replica packet from {} with {} changes, {} applied",
+        ntohs(cliaddr.sin_port), count, applied);
+
+    exitf("replicateService");
+    return false;
+}
+
+//+
+// syncService
+//
+// a peer has started and wants everything this node has.
+//-
+
+bool syncService(uint8_t *buffer, int32_t & n, const struct sockaddr_in & cliaddr){
+    if (!peers.isPeer(cliaddr)){
+        SVCLOG(svcLog::lvlWarn, "sync request from {}:{} which is not a peer",
+            inet_ntoa(cliaddr.sin_addr), ntohs(cliaddr.sin_port));
+        return false;
+    }
+    vector<replica> state;
+    registry.dump(state);
+    SVCLOG(svcLog::lvlInfo, "Sending {} registrations to peer {}", state.size(), ntohs(cliaddr.sin_port));
+    sendReplicas(state, cliaddr);
+    return false;
+}
+
 //+
 // resetService
 //
@@ -714,7 +1527,27 @@ bool resetServiceServer(uint8_t *buffer, int32_t & n){
     // start with the clint net address
 
 
-    svcMap.clear();
+    if (peers.empty()){
+        registry.clear();
+        // nothing in the old snapshot or log is wanted now.
+        store.snapshot(registry);
+    } else {
+        // every registration is removed with a new stamp so that the
+        // removals win on the other nodes too.
+        vector<replica> state;
+        registry.dump(state);
+        vector<replica> removed;
+        for (auto & r : state){
+            if (!r.present) continue;
+            uint64_t stamp = peers.nextStamp();
+            registry.remove(r.svcName, r.server, stamp);
+            removed.push_back(replica{r.svcName, r.server, stamp, 0, false});
+        }
+        store.append(removed);
+        replicate(removed);
+    }
+    // the watchers' histories are now meaningless, start them again.
+    watches.reset();
 
     // return true
     buffer[DETAILOFFSET] = 1;
@@ -724,3 +1557,61 @@ bool resetServiceServer(uint8_t *buffer, int32_t & n){
     return true;
 }
 
+
+//+
+// statsService
+//
+// how busy the directory has been and how big it is. The reply is
+//
+//    header
+//    uptime: 4 bytes - seconds
+//    services, servers, leases, tombstones, names: 4 bytes each
+//    registry bytes: 8 bytes - estimate of the memory the registry uses
+//    resident bytes: 8 bytes - memory the whole server process uses
+//    busy over rate, busy while behind: 8 bytes each, since the start
+//    count: 2 bytes, then 2 bytes of padding
+//    count request counters: 8 bytes each, for opcodes 1 up
+//
+// The registry is measured under its shard locks, so this is not a
+// request to send very often on a big directory.
+//-
+
+static uint64_t residentBytes(){
+#ifdef __APPLE__
+    // only the peak is available here
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+#else
+    FILE * f = fopen("/proc/self/statm", "r");
+    if (f == nullptr) return 0;
+    unsigned long pages = 0, resident = 0;
+    if (fscanf(f, "%lu %lu", &pages, &resident) != 2) resident = 0;
+    fclose(f);
+    return (uint64_t)resident * sysconf(_SC_PAGESIZE);
+#endif
+}
+
+bool statsService(uint8_t *buffer, int32_t & n){
+    enterf("statsService");
+
+    registrySize size;
+    registry.measure(size);
+    uint64_t overRate, behind;
+    admission.totalShed(overRate, behind);
+    uint32_t uptime = chrono::duration_cast<chrono::seconds>(chrono::steady_clock::now() - startTime).count();
+
+    packetWriter wr(buffer, MAXREPLYLEN);
+    wr.u32(uptime).u32(size.services).u32(size.servers).u32(size.leases).u32(size.tombstones).u32(size.names);
+    wr.u64(size.bytes).u64(residentBytes()).u64(overRate).u64(behind);
+    wr.u16(MAXOPCODE).u16(0);
+    for (uint32_t op = 1; op <= MAXOPCODE; op++){
+        wr.u64(requestCounts[op].load(memory_order_relaxed));
+    }
+    n = wr.pos();
+
+    SVCLOG(svcLog::lvlDebug, "Stats: {} services, {} servers, registry about {} bytes",
+        size.services, size.servers, size.bytes);
+    exitf("statsService");
+    return true;
+}
@@ -0,0 +1,88 @@
+//+
+// File:   svcAdmit.cpp
+//
+// Per address token buckets for searches.
+//-
+
+#include <cmath>
+
+#include "svcAdmit.hpp"
+
+using namespace std;
+
+admissionControl::admissionControl(uint32_t numShards)
+    : numShards(numShards), shards(new shard[numShards]) {
+}
+
+void admissionControl::configure(uint32_t rate, uint32_t burst){
+    this->rate = rate;
+    this->burst = burst < 1 ? 1 : burst;
+}
+
+void admissionControl::refill(bucket & b, chrono::steady_clock::time_point now){
+    chrono::duration<double> gone = now - b.last;
+    b.tokens = min(burst, b.tokens + gone.count() * rate);
+    b.last = now;
+}
+
+uint32_t admissionControl::admit(uint32_t addr){
+    if (rate == 0) return 0;
+    auto now = chrono::steady_clock::now();
+    shard & s = shards[addr % numShards];
+    lock_guard<mutex> guard(s.lock);
+
+    auto it = s.buckets.find(addr);
+    if (it == s.buckets.end()){
+        // a new address starts with a full bucket
+        it = s.buckets.emplace(addr, bucket{burst, now}).first;
+    } else {
+        refill(it->second, now);
+    }
+    bucket & b = it->second;
+    if (b.tokens >= 1){
+        b.tokens -= 1;
+        return 0;
+    }
+    shedOverRate++;
+    // at least a millisecond so a client that waits as it is told
+    // always finds a token.
+    return max(1u, (uint32_t)ceil((1 - b.tokens) * 1000 / rate));
+}
+
+//+
+// prune
+//
+// an address whose bucket is full again would start with a full one
+// anyway, so it can go. Keeps the table to the clients seen lately.
+//-
+
+void admissionControl::prune(){
+    if (rate == 0) return;
+    auto now = chrono::steady_clock::now();
+    for (uint32_t i = 0; i < numShards; i++){
+        lock_guard<mutex> guard(shards[i].lock);
+        auto & buckets = shards[i].buckets;
+        for (auto it = buckets.begin(); it != buckets.end(); ){
+            refill(it->second, now);
+            if (it->second.tokens >= burst){
+                it = buckets.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+}
+
+void admissionControl::takeShed(uint64_t & overRate, uint64_t & behind){
+    uint64_t totalRate, totalBehind;
+    totalShed(totalRate, totalBehind);
+    overRate = totalRate - takenOverRate;
+    behind = totalBehind - takenOverloaded;
+    takenOverRate = totalRate;
+    takenOverloaded = totalBehind;
+}
+
+void admissionControl::totalShed(uint64_t & overRate, uint64_t & behind) const {
+    overRate = shedOverRate;
+    behind = shedOverloaded;
+}
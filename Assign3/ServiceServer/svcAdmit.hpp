@@ -0,0 +1,77 @@
+//+
+// File:   svcAdmit.hpp
+//
+// Admission control for the directory server.
+//
+// Each client address has a token bucket for searches, filled at rate
+// tokens a second up to burst. A search takes a token, a search that
+// finds the bucket empty is answered busy (see main.cpp) with the time
+// until the next token. One client looping on searchService then only
+// gets its share and can't crowd out everyone else.
+//
+// Registrations, removals, renewals, watches and packets from peers
+// are never limited here. They are few, and refusing them would let
+// leases run out. Instead they are served ahead of searches, and when
+// the server falls behind it answers searches busy so the writes still
+// get through (serveRequests in main.cpp).
+//
+// Addresses are hashed onto shards each with its own lock, as in the
+// registry, so the workers seldom wait on each other.
+//-
+
+#ifndef __SVCADMIT_H__
+#define __SVCADMIT_H__
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+class admissionControl {
+public:
+    admissionControl(uint32_t numShards = 16);
+
+    // rate searches a second from each address, up to burst at once.
+    // A rate of 0 lets every search through.
+    void configure(uint32_t rate, uint32_t burst);
+    bool limited() const { return rate != 0; }
+
+    // take a token for a search from addr (network order). Returns 0
+    // if it may go ahead, otherwise milliseconds until it could.
+    uint32_t admit(uint32_t addr);
+    // a search was answered busy because the server is behind.
+    void overloaded() { shedOverloaded++; }
+
+    // forget addresses whose buckets have filled up again.
+    void prune();
+    // searches answered busy since the last call, only called from
+    // one thread.
+    void takeShed(uint64_t & overRate, uint64_t & behind);
+    // and since the start
+    void totalShed(uint64_t & overRate, uint64_t & behind) const;
+
+private:
+    struct bucket {
+        double tokens;
+        std::chrono::steady_clock::time_point last;
+    };
+    struct shard {
+        std::mutex lock;
+        std::unordered_map<uint32_t, bucket> buckets;
+    };
+
+    double rate = 0;
+    double burst = 0;
+    uint32_t numShards;
+    std::unique_ptr<shard[]> shards;
+    std::atomic<uint64_t> shedOverRate{0};
+    std::atomic<uint64_t> shedOverloaded{0};
+    uint64_t takenOverRate = 0;
+    uint64_t takenOverloaded = 0;
+
+    void refill(bucket & b, std::chrono::steady_clock::time_point now);
+};
+
+#endif
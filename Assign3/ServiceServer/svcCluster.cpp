@@ -0,0 +1,103 @@
+//+
+// File:   svcCluster.cpp
+//
+// Peers, the Lamport clock and the replica encoding.
+//-
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <string.h>
+
+#include <iostream>
+#include <random>
+#include <sstream>
+
+#include "svcCluster.hpp"
+#include "svcDirCodec.hpp"
+
+using namespace std;
+using namespace svcCodec;
+
+bool cluster::addPeers(const string & list){
+    stringstream ss(list);
+    string item;
+    while (getline(ss, item, ',')){
+        size_t colon = item.rfind(':');
+        if (colon == string::npos || colon == 0){
+            cerr << "Peer '" << item << "' must have the form 'serverName:portnum'" << endl;
+            return false;
+        }
+        string host = item.substr(0, colon);
+        uint16_t port = atoi(item.c_str() + colon + 1);
+        if (port == 0){
+            cerr << "Peer '" << item << "' has no port" << endl;
+            return false;
+        }
+
+        struct addrinfo hints;
+        struct addrinfo * result;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_DGRAM;
+        int errcode = getaddrinfo(host.c_str(), nullptr, &hints, &result);
+        if (errcode != 0){
+            cerr << "error finding address of " << host << ": " << gai_strerror(errcode) << endl;
+            return false;
+        }
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr = ((sockaddr_in*)result->ai_addr)->sin_addr;
+        freeaddrinfo(result);
+        peerAddrs.push_back(addr);
+    }
+    return true;
+}
+
+bool cluster::isPeer(const sockaddr_in & addr) const {
+    for (auto & p : peerAddrs){
+        if (p.sin_addr.s_addr == addr.sin_addr.s_addr && p.sin_port == addr.sin_port){
+            return true;
+        }
+    }
+    return false;
+}
+
+const sockaddr_in & cluster::randomPeer() const {
+    static thread_local std::mt19937 gen(std::random_device{}());
+    std::uniform_int_distribution<size_t> pick(0, peerAddrs.size() - 1);
+    return peerAddrs[pick(gen)];
+}
+
+uint64_t cluster::nextStamp(){
+    return ((clock.fetch_add(1) + 1) << 16) | nodeId;
+}
+
+void cluster::observe(uint64_t stamp){
+    uint64_t seen = stamp >> 16;
+    uint64_t current = clock.load();
+    while (current < seen && !clock.compare_exchange_weak(current, seen)){
+    }
+}
+
+uint32_t cluster::writeReplica(uint8_t * buffer, uint32_t curPos, const replica & r){
+    packetWriter wr(buffer, curPos + MAXREPLICALEN, curPos);
+    wr.u64(r.stamp).u32(r.leaseSeconds).u16(r.weight).u16(r.load).u8(r.present ? 1 : 0);
+    wr.name(r.svcName).server(r.server.name, r.server.port).align(4);
+    return wr.ok() ? wr.pos() : 0;
+}
+
+bool cluster::readReplica(uint8_t * buffer, int32_t n, uint32_t & curPos, replica & r){
+    packetReader rd(buffer, n, curPos);
+    r.stamp = rd.u64();
+    r.leaseSeconds = rd.u32();
+    r.weight = rd.u16();
+    r.load = rd.u16();
+    r.present = rd.u8() != 0;
+    r.svcName = rd.name();
+    r.server.name = rd.server(r.server.port);
+    // the padding at the end of the last replica may be missing
+    curPos = alignTo(rd.pos(), 4);
+    return rd.ok();
+}
@@ -0,0 +1,82 @@
+//+
+// File:   svcCluster.hpp
+//
+// Replication between directory nodes.
+//
+// Several directory servers (usually on different ports of the same
+// machine) can be run as one directory by giving each the others with
+// -p. A change made on one node is stamped and sent to all of its
+// peers, which apply it if it is newer than what they have (see
+// svcRegistry.hpp). A lost packet is made up for by anti-entropy: each
+// node regularly sends everything it has to one of its peers, and a
+// node that starts asks all of its peers for their state, so a crashed
+// node gets its registrations back.
+//
+// Stamps are a Lamport clock in the top 48 bits and the node id (the
+// node's port) in the bottom 16, so stamps from different nodes are
+// never equal and every node orders them the same way.
+//
+// replica packet (opcode 10, between nodes only, never answered)
+//     header (12 bytes)
+//     count: 2 bytes, then 2 bytes of padding
+//     count replicas, each
+//         stamp: 8 bytes (high 4 bytes first)
+//         lease: 4 bytes - seconds left, 0 for no lease
+//         weight: 2 bytes
+//         load: 2 bytes - last reported, 0 for none
+//         present: 1 byte - 0 for a removal
+//         serviceName (length byte and data)
+//         serverEntity (length byte, name, pad to 2, port)
+//         null padded to a multiple of 4
+//
+// sync packet (opcode 11) is just a header, the answer is the node's
+// whole state in replica packets.
+//-
+
+#ifndef __SVCCLUSTER_H__
+#define __SVCCLUSTER_H__
+
+#include <netinet/in.h>
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "svcRegistry.hpp"
+
+// the most a replica can take in a packet
+#define MAXREPLICALEN (8 + 4 + 4 + 1 + 64 + 64 + 1 + 2 + 3)
+
+class cluster {
+public:
+    // node id is put in every stamp made here, the port is used.
+    explicit cluster(uint16_t nodeId = 0) : nodeId(nodeId) {}
+    void setNodeId(uint16_t id) { nodeId = id; }
+
+    // add the peers in a list of the form host:port,host:port.
+    // returns false if a peer can't be found.
+    bool addPeers(const std::string & list);
+    bool empty() const { return peerAddrs.empty(); }
+    const std::vector<sockaddr_in> & peers() const { return peerAddrs; }
+    bool isPeer(const sockaddr_in & addr) const;
+    const sockaddr_in & randomPeer() const;
+
+    // stamp for a change made on this node.
+    uint64_t nextStamp();
+    // a stamp from another node, keeps this clock ahead of it.
+    void observe(uint64_t stamp);
+
+    // replica encoding. writeReplica returns the position after the
+    // replica, or 0 if its names are too long for MAXREPLICALEN and
+    // nothing usable was written. readReplica updates curPos past it.
+    static uint32_t writeReplica(uint8_t * buffer, uint32_t curPos, const replica & r);
+    static bool readReplica(uint8_t * buffer, int32_t n, uint32_t & curPos, replica & r);
+
+private:
+    uint16_t nodeId;
+    std::atomic<uint64_t> clock{0};
+    std::vector<sockaddr_in> peerAddrs;
+};
+
+#endif
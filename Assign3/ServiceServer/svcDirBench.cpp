@@ -0,0 +1,528 @@
+//+
+// File:   svcDirBench.cpp
+//
+// Load generator for the service directory, for sizing it for a fleet.
+//
+// Simulates servers registering with a lease, renewing it at a third
+// of the lease and leaving and coming back (churn), and clients
+// searching, all at set rates. Requests are sent on a schedule whether
+// or not earlier ones have been answered (open loop), so a directory
+// that falls behind shows up as latency and lost requests rather than
+// as the generator slowing down.
+//
+// There are two parts:
+//
+//   burst    every server registers at once, as after a deploy, with
+//            at most -w requests outstanding on each thread
+//   steady   renewals, churn and searches for -d seconds
+//
+// Latency percentiles are printed for each kind of request, then what
+// the directory says about itself (opcode 13): how many registrations
+// it holds and an estimate of the memory the registry takes, with the
+// growth of the whole process during the burst.
+//
+// Each server has a host name of its own unless -H is given, then the
+// servers are spread over that many hosts, as when a host runs servers
+// for several services.
+//
+// The generator sends from one address, so start the directory with
+// -r 0 unless the search rate limit is what is being measured.
+//
+// usage: svcdirbench [-s servers] [-n services] [-H hosts] [-c clients] [-q searches]
+//                    [-l lease] [-k churn] [-d seconds] [-t threads] [-w window]
+//        svcdirbench -S       just print the directory's statistics
+//
+// The directory is SERVICEADDR (host:port), localhost:3650 if not set.
+// Registrations are left to expire with their leases.
+//-
+
+#include <netdb.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "svcDirCodec.hpp"
+
+using namespace std;
+using namespace svcCodec;
+
+// the directory's opcodes used here
+enum opCode { regService = 1, remService, srchService, rnwService = 5, busyService = 12, statService };
+
+// requests remembered on each thread, a power of 2. Must hold more
+// than a second's worth of requests so a slot isn't reused before its
+// reply can arrive.
+#define RINGSIZE (1 << 18)
+#define BUFFSIZE 2048
+// how long to wait for stragglers at the end of each part
+#define DRAINTIME chrono::seconds(1)
+
+typedef chrono::steady_clock benchClock;
+
+struct options {
+    uint32_t servers = 1000;
+    uint32_t services = 100;
+    uint32_t hosts = 0;         // servers share this many host names, 0 for one each
+    uint32_t clients = 10;
+    double searchRate = 100;    // per client per second
+    uint32_t lease = 30;
+    double churn = 10;          // servers leaving or coming back a second
+    uint32_t seconds = 10;
+    uint32_t threads = 4;
+    uint32_t window = 256;
+};
+
+// the kinds of request, and how they went
+enum kind : uint8_t { kRegister, kRenew, kRemove, kSearch, numKinds };
+static const char * kindName[numKinds] = { "register", "renew", "remove", "search" };
+
+struct results {
+    uint64_t sent = 0;
+    uint64_t answered = 0;
+    uint64_t busy = 0;
+    vector<uint32_t> latency;   // microseconds, answered only
+
+    void add(const results & other){
+        sent += other.sent;
+        answered += other.answered;
+        busy += other.busy;
+        latency.insert(latency.end(), other.latency.begin(), other.latency.end());
+    }
+};
+
+// what the directory reports, see statsService in main.cpp
+struct dirStats {
+    uint32_t uptime, services, servers, leases, tombstones, names;
+    uint64_t registryBytes, residentBytes, busyOverRate, busyBehind;
+    vector<uint64_t> requests;
+};
+
+static struct sockaddr_storage dirAddr;
+static socklen_t dirAddrLen;
+
+//+
+// findDirectory
+//
+// look up SERVICEADDR, host:port.
+//-
+
+static bool findDirectory(){
+    const char * env = getenv("SERVICEADDR");
+    string addr = env ? env : "localhost:3650";
+    size_t colon = addr.rfind(':');
+    if (colon == string::npos){
+        cerr << "SERVICEADDR must be host:port" << endl;
+        return false;
+    }
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (getaddrinfo(addr.substr(0, colon).c_str(), addr.substr(colon + 1).c_str(), &hints, &res) != 0){
+        cerr << "can't find directory " << addr << endl;
+        return false;
+    }
+    memcpy(&dirAddr, res->ai_addr, res->ai_addrlen);
+    dirAddrLen = res->ai_addrlen;
+    freeaddrinfo(res);
+    return true;
+}
+
+static int openSocket(){
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&dirAddr, dirAddrLen) < 0){
+        perror("socket");
+        exit(1);
+    }
+    // room for the replies to a burst
+    int size = 8 * 1024 * 1024;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    return fd;
+}
+
+//+
+// loadThread
+//
+// one socket's worth of the load. Server i belongs to thread
+// i % threads, so each thread knows which of its servers are up.
+//-
+
+class loadThread {
+public:
+    loadThread(const options & opt, uint32_t id) : opt(opt), id(id), gen(id * 7919 + 1) {
+        fd = openSocket();
+        for (uint32_t i = id; i < opt.servers; i += opt.threads){
+            mine.push_back(i);
+        }
+        up.assign(mine.size(), false);
+    }
+    ~loadThread(){ close(fd); }
+
+    // register every server, keeping at most window unanswered.
+    void burst(){
+        for (uint32_t i = 0; i < mine.size(); i++){
+            while (outstanding >= opt.window){
+                receive(1);
+            }
+            send(kRegister, i);
+            up[i] = true;
+        }
+        drain();
+    }
+
+    // renew, churn and search at the rates asked for until end.
+    void steady(benchClock::time_point end){
+        // renewals for this thread's servers, churn and searches shared
+        // out between the threads.
+        double renewRate = mine.size() * 3.0 / opt.lease;
+        double churnRate = opt.churn / opt.threads;
+        double searchRate = opt.clients * opt.searchRate / opt.threads;
+        double total = renewRate + churnRate + searchRate;
+        if (total <= 0) return;
+        chrono::nanoseconds interval((int64_t)(1e9 / total));
+        uniform_real_distribution<double> pick(0, total);
+
+        auto next = benchClock::now();
+        while (next < end){
+            // everything that's due, then wait for replies until the
+            // next one is.
+            auto now = benchClock::now();
+            while (next <= now && next < end){
+                double r = pick(gen);
+                if (r < renewRate){
+                    renewNext();
+                } else if (r < renewRate + churnRate){
+                    churnOne();
+                } else {
+                    send(kSearch, gen() % opt.services);
+                }
+                next += interval;
+            }
+            auto wait = chrono::duration_cast<chrono::milliseconds>(next - benchClock::now());
+            if (wait.count() > 0){
+                receive(wait.count());
+            } else {
+                // poll can't wait less than a millisecond, sleep rather
+                // than spin and take the cpu from the directory.
+                receive(0);
+                this_thread::sleep_until(next);
+            }
+        }
+        drain();
+    }
+
+    results done[numKinds];
+
+private:
+    struct slot {
+        benchClock::time_point sent;
+        uint32_t serial;
+        kind what;
+        bool waiting;
+    };
+
+    const options & opt;
+    uint32_t id;
+    int fd;
+    mt19937_64 gen;
+    vector<uint32_t> mine;
+    vector<bool> up;
+    uint32_t renewAt = 0;
+    uint32_t serial = 0;
+    uint32_t outstanding = 0;
+    vector<slot> ring = vector<slot>(RINGSIZE);
+
+    static string serviceName(uint32_t i){ return "bench-svc-" + to_string(i); }
+    // with -H several servers run on each host, on different ports
+    string serverName(uint32_t i) const { return "bench-host-" + to_string(opt.hosts == 0 ? i : i % opt.hosts); }
+    uint16_t serverPort(uint32_t i) const { return 5000 + (opt.hosts == 0 ? 0 : i / opt.hosts); }
+
+    // which is the index into mine for servers, the service for searches
+    void send(kind what, uint32_t which){
+        uint32_t bufferInt[BUFFSIZE/4];
+        uint8_t * buffer = (uint8_t*)bufferInt;
+        uint32_t ser = ++serial;
+        packetWriter wr(buffer, BUFFSIZE);
+        switch (what){
+            case kRegister:
+            case kRenew: {
+                uint32_t server = mine[which];
+                writeHeader(buffer, what == kRegister ? regService : rnwService, ser);
+                wr.name(serviceName(server % opt.services)).align(4).server(serverName(server), serverPort(server));
+                wr.align(4).u32(opt.lease).u16(1).u16(0);
+                break;
+            }
+            case kRemove: {
+                uint32_t server = mine[which];
+                writeHeader(buffer, remService, ser);
+                wr.name(serviceName(server % opt.services)).align(4).server(serverName(server), serverPort(server));
+                break;
+            }
+            default:
+                writeHeader(buffer, srchService, ser);
+                wr.name(serviceName(which));
+                break;
+        }
+
+        slot & s = ring[ser & (RINGSIZE - 1)];
+        if (s.waiting){
+            // never answered, counted as lost
+            outstanding--;
+        }
+        s = slot{benchClock::now(), ser, what, true};
+        outstanding++;
+        done[what].sent++;
+        ::send(fd, buffer, wr.pos(), 0);
+    }
+
+    void renewNext(){
+        for (uint32_t tries = 0; tries < mine.size(); tries++){
+            uint32_t i = renewAt;
+            renewAt = (renewAt + 1) % mine.size();
+            if (up[i]){
+                send(kRenew, i);
+                return;
+            }
+        }
+    }
+
+    void churnOne(){
+        if (mine.empty()) return;
+        uint32_t i = gen() % mine.size();
+        send(up[i] ? kRemove : kRegister, i);
+        up[i] = !up[i];
+    }
+
+    // take the replies that are there, waiting up to ms for the first.
+    void receive(int ms){
+        uint32_t bufferInt[BUFFSIZE/4];
+        uint8_t * buffer = (uint8_t*)bufferInt;
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, ms) <= 0) return;
+
+        int32_t n;
+        while ((n = recv(fd, buffer, BUFFSIZE, MSG_DONTWAIT)) > 0){
+            packetHeader hdr;
+            if (!readHeader(buffer, n, hdr) || hdr.magic != PACKETMAGIC) continue;
+            slot & s = ring[hdr.serial & (RINGSIZE - 1)];
+            if (!s.waiting || s.serial != hdr.serial) continue;
+            s.waiting = false;
+            outstanding--;
+            if (hdr.opCode == busyService){
+                done[s.what].busy++;
+            } else {
+                done[s.what].answered++;
+                auto took = chrono::duration_cast<chrono::microseconds>(benchClock::now() - s.sent);
+                done[s.what].latency.push_back(took.count());
+            }
+        }
+    }
+
+    void drain(){
+        auto until = benchClock::now() + DRAINTIME;
+        while (outstanding > 0 && benchClock::now() < until){
+            receive(10);
+        }
+    }
+};
+
+//+
+// getStats
+//
+// ask the directory about itself.
+//-
+
+static bool getStats(dirStats & st){
+    int fd = openSocket();
+    uint32_t bufferInt[BUFFSIZE/4];
+    uint8_t * buffer = (uint8_t*)bufferInt;
+    bool got = false;
+    for (int tries = 0; tries < 3 && !got; tries++){
+        writeHeader(buffer, statService, tries + 1);
+        ::send(fd, buffer, DETAILOFFSET, 0);
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 1000) <= 0) continue;
+        int32_t n = recv(fd, buffer, BUFFSIZE, 0);
+        packetHeader hdr;
+        if (!readHeader(buffer, n, hdr) || hdr.opCode != statService) continue;
+
+        packetReader rd(buffer, n);
+        st.uptime = rd.u32();
+        st.services = rd.u32();
+        st.servers = rd.u32();
+        st.leases = rd.u32();
+        st.tombstones = rd.u32();
+        st.names = rd.u32();
+        st.registryBytes = rd.u64();
+        st.residentBytes = rd.u64();
+        st.busyOverRate = rd.u64();
+        st.busyBehind = rd.u64();
+        uint16_t count = rd.u16();
+        rd.u16();
+        st.requests.clear();
+        for (uint16_t i = 0; i < count && rd.ok(); i++){
+            st.requests.push_back(rd.u64());
+        }
+        got = rd.ok();
+    }
+    close(fd);
+    return got;
+}
+
+static void printStats(const dirStats & st){
+    static const char * opNames[] = { "register", "remove", "search", "reset", "renew", "search all",
+        "search batch", "watch", "notify", "replicate", "sync", "busy", "stats" };
+    cout << "directory up " << st.uptime << "s: " << st.services << " services, " << st.servers
+         << " servers (" << st.leases << " lease timers), " << st.tombstones << " tombstones, "
+         << st.names << " distinct names" << endl;
+    cout << "  registry about " << st.registryBytes / 1024 << " KB";
+    if (st.servers > 0) cout << " (" << st.registryBytes / st.servers << " bytes a server)";
+    cout << ", process " << st.residentBytes / 1024 << " KB resident" << endl;
+    cout << "  answered busy: " << st.busyOverRate << " over the rate, " << st.busyBehind << " while behind" << endl;
+    cout << "  requests:";
+    for (size_t i = 0; i < st.requests.size(); i++){
+        if (st.requests[i] == 0) continue;
+        cout << " " << (i < size(opNames) ? opNames[i] : to_string(i + 1)) << " " << st.requests[i];
+    }
+    cout << endl;
+}
+
+// microseconds at fraction p of the sorted latencies
+static uint32_t percentile(const vector<uint32_t> & sorted, double p){
+    if (sorted.empty()) return 0;
+    size_t at = min(sorted.size() - 1, (size_t)(p * sorted.size()));
+    return sorted[at];
+}
+
+static void printResults(const string & title, results (&r)[numKinds], double seconds){
+    uint64_t sent = 0, answered = 0;
+    for (int k = 0; k < numKinds; k++){
+        sent += r[k].sent;
+        answered += r[k].answered + r[k].busy;
+    }
+    cout << title << ": " << sent << " requests in " << fixed << setprecision(2) << seconds << "s, "
+         << (uint64_t)(answered / seconds) << " replies/s" << endl;
+    cout << "  " << left << setw(10) << "" << right << setw(10) << "sent" << setw(10) << "answered"
+         << setw(8) << "busy" << setw(8) << "lost"
+         << setw(8) << "p50" << setw(8) << "p90" << setw(8) << "p99" << setw(8) << "p99.9"
+         << setw(8) << "max" << "  (us)" << endl;
+    for (int k = 0; k < numKinds; k++){
+        if (r[k].sent == 0) continue;
+        sort(r[k].latency.begin(), r[k].latency.end());
+        cout << "  " << left << setw(10) << kindName[k] << right << setw(10) << r[k].sent
+             << setw(10) << r[k].answered << setw(8) << r[k].busy
+             << setw(8) << r[k].sent - r[k].answered - r[k].busy
+             << setw(8) << percentile(r[k].latency, 0.5) << setw(8) << percentile(r[k].latency, 0.9)
+             << setw(8) << percentile(r[k].latency, 0.99) << setw(8) << percentile(r[k].latency, 0.999)
+             << setw(8) << (r[k].latency.empty() ? 0 : r[k].latency.back()) << endl;
+    }
+}
+
+// run part on every thread and put the results together
+template <typename F>
+static double runAll(vector<unique_ptr<loadThread>> & threads, results (&total)[numKinds], F part){
+    for (int k = 0; k < numKinds; k++){
+        total[k] = results();
+    }
+    auto start = benchClock::now();
+    vector<thread> running;
+    for (auto & t : threads){
+        running.emplace_back([&t, &part]{ part(*t); });
+    }
+    for (auto & r : running){
+        r.join();
+    }
+    double seconds = chrono::duration<double>(benchClock::now() - start).count();
+    for (auto & t : threads){
+        for (int k = 0; k < numKinds; k++){
+            total[k].add(t->done[k]);
+            t->done[k] = results();
+        }
+    }
+    return seconds;
+}
+
+static void usage(const char * name){
+    cerr << "Usage: " << name << " [-s servers] [-n services] [-H hosts] [-c clients] [-q searches a second each]" << endl
+         << "       [-l lease seconds] [-k churn a second] [-d seconds] [-t threads] [-w window]" << endl
+         << "       " << name << " -S" << endl;
+    exit(1);
+}
+
+int main(int argc, char * argv[]){
+    options opt;
+    bool statsOnly = false;
+    int c;
+    while ((c = getopt(argc, argv, "s:n:H:c:q:l:k:d:t:w:S")) != -1){
+        switch (c){
+            case 's': opt.servers = atoi(optarg); break;
+            case 'n': opt.services = atoi(optarg); break;
+            case 'H': opt.hosts = atoi(optarg); break;
+            case 'c': opt.clients = atoi(optarg); break;
+            case 'q': opt.searchRate = atof(optarg); break;
+            case 'l': opt.lease = atoi(optarg); break;
+            case 'k': opt.churn = atof(optarg); break;
+            case 'd': opt.seconds = atoi(optarg); break;
+            case 't': opt.threads = atoi(optarg); break;
+            case 'w': opt.window = atoi(optarg); break;
+            case 'S': statsOnly = true; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind != argc || opt.services == 0 || opt.threads == 0 || opt.lease < 3 || opt.window == 0){
+        usage(argv[0]);
+    }
+    if (!findDirectory()) return 1;
+
+    dirStats before, after;
+    if (!getStats(before)){
+        cerr << "the directory did not answer" << endl;
+        return 1;
+    }
+    if (statsOnly){
+        printStats(before);
+        return 0;
+    }
+
+    cout << opt.servers << " servers on " << opt.services << " services, lease " << opt.lease << "s, churn "
+         << opt.churn << "/s, " << opt.clients << " clients searching " << opt.searchRate << "/s each, "
+         << opt.threads << " threads" << endl;
+
+    vector<unique_ptr<loadThread>> threads;
+    for (uint32_t i = 0; i < opt.threads; i++){
+        threads.emplace_back(new loadThread(opt, i));
+    }
+
+    results total[numKinds];
+    double seconds = runAll(threads, total, [](loadThread & t){ t.burst(); });
+    printResults("burst", total, seconds);
+    bool haveAfter = getStats(after);
+
+    auto end = benchClock::now() + chrono::seconds(opt.seconds);
+    seconds = runAll(threads, total, [end](loadThread & t){ t.steady(end); });
+    printResults("steady", total, seconds);
+
+    if (haveAfter){
+        int64_t grew = (int64_t)after.residentBytes - (int64_t)before.residentBytes;
+        cout << "process grew " << grew / 1024 << " KB during the burst";
+        if (opt.servers > 0) cout << " (" << grew / (int64_t)opt.servers << " bytes a server)";
+        cout << endl;
+    }
+    if (getStats(after)){
+        printStats(after);
+    }
+    return 0;
+}
@@ -5,10 +5,17 @@
 // server. 
 //
 // Approach:
-//   Since this is typically only called once (client) or twice (server), we do the socket setup
-//   and teardown for each request. If for some reason there are multiple threads,
-//   then the sockets will use different epherimal port nubers, but since the
-//   server will be replying to the sending port, there should not be and issue
+//   The directory's address is looked up and the socket is created on
+//   the first request and kept until the object is destroyed. Requests
+//   from any number of threads share the socket. Each waits in a table
+//   keyed by its serial number and a receive thread hands every reply
+//   to the request with the matching serial. A request that gets no
+//   reply is sent again (at least once semantics), all of the requests
+//   are safe to repeat.
+//
+//   Watch replies and notifications arrive on the same socket, since
+//   the directory sends notifications to the address the watch came
+//   from. The receive thread passes them to the watch thread.
 //
 //-
 
@@ -18,13 +25,22 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <poll.h>
 
 #include <iostream>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstring>
+#include <deque>
+#include <mutex>
+#include <random>
 #include <regex>
+#include <thread>
+#include <unordered_map>
 
 #include "svcDirClient.hpp"
+#include "svcDirCodec.hpp"
 #include "HexDump.hpp"
 
 #ifdef __APPLE__
@@ -37,7 +53,7 @@ using namespace std;
 // Packet header (12 bytes)
 //    magic: 4 bytes - value SRVC
 //    version: 2 bytes - high odeer byte major, low order byte minor
-//    opcode: 2 bytes - opcode 1 = register, 2 = remove, 3 = search, 4 = reset
+//    opcode: 2 bytes - opcode 1 = register, 2 = remove, 3 = search, 4 = reset, 5 = renew
 //    serial: 4 bytes - serial number of request.
 //
 //  serverEntity(max 64 bytes)
@@ -50,29 +66,75 @@ using namespace std;
 //     serviceNameLength = 1 bytes
 //     serviceName Max 63 bytes, null padded so that length name + length byte divisible by 4
 //     serverEntity (max 64 bytes)
+//
+// register/renew packets can add a lease (max 152 bytes)
+//     null padded to a multiple of 4
+//     lease: 4 bytes - seconds, 0 for never expires
+// and after it a weight and load (max 156 bytes)
+//     weight: 2 bytes - share of the requests, 0 for the default (1)
+//     load: 2 bytes - reported by the server, 0 for none
 //     
 // search format (max 46 bytes)
 //     header (12 bytes)
 //     serviceNameLength = 1 bytes
 //     serviceName Max 63 bytes
 //     does not need to be null padded because nothing following it.
+//
+// search all format
+//     header (12 bytes)
+//     serviceNameLength = 1 bytes
+//     serviceName Max 63 bytes, null padded to a multiple of 2
+//     start: 2 bytes - index of first server wanted
+//   reply
+//     header, total (2 bytes), start (2 bytes), count (2 bytes)
+//     count serverEntities
+//
+// search batch format
+//     header (12 bytes)
+//     count: 1 byte - at most MAXBATCH
+//     count service names (length byte and name, no padding)
+//   reply
+//     header, count (1 byte), count serverEntities
+//
+// watch format
+//     header (12 bytes)
+//     serviceNameLength = 1 bytes
+//     serviceName Max 63 bytes, null padded to a multiple of 4
+//     lease: 4 bytes - seconds, 0 to stop watching
+//   reply
+//     header, epoch (4 bytes), version (4 bytes)
+//
+// notification format (sent by the directory, opcode 9)
+//     header (12 bytes), serial is the version
+//     serviceNameLength = 1 bytes
+//     serviceName Max 63 bytes, null padded to a multiple of 4
+//     epoch: 4 bytes
+//     version: 4 bytes - one more for every change in the epoch
+//     change: 1 byte - 1 added, 2 removed, 3 new epoch
+//     serverEntity (added and removed only)
 //_
 
 namespace svcDir {
 
-// This is all inline so that the only header file for
-// the students is the client interface file.
-
-// packet layout
-// defines so can be used for array lengths.
-#define VERSIONOFFSET   4
-#define OPOFFSET        6
-#define SERIALOFFSET    8
-#define DETAILOFFSET   12
-#define MAXSERVERNAME  63
-#define MAXSERVICENAME 63
+// the packet layout (offsets, name lengths, magic and version) is in
+// svcDirCodec.hpp, shared with the server.
+using namespace svcCodec;
+
 // maximum send message length
-#define SENDBUFFLEN  (12 + MAXSERVERNAME + 1 + MAXSERVERNAME + 1 + 2)
+#define SENDBUFFLEN  (12 + MAXSERVERNAME + 1 + MAXSERVERNAME + 1 + 2 + 2 + 4 + 4)
+// most service names in one batch search
+#define MAXBATCH     16
+#define BATCHBUFFLEN (12 + 1 + MAXBATCH * (MAXSERVICENAME + 1))
+// receive buffer size
+#define RECVBUFFLEN  4096
+// seconds the directory keeps a watch without it being renewed
+#define WATCHLEASE   30
+// times a request is sent, and how long to wait for each reply
+#define MAXTRIES     3
+#define REPLYTIMEOUT std::chrono::milliseconds(500)
+// longest wait a busy directory can ask for before the request is sent
+// again
+#define MAXBUSYWAIT  1000
 
 
 
@@ -82,18 +144,25 @@ namespace svcDir {
 class serviceServer::serviceServerImpl{
 public:
     serviceServerImpl(){};
-    ~serviceServerImpl(){};
-    bool registerService(string serviceName, serverEntity &server);
+    ~serviceServerImpl();
+    bool registerService(string serviceName, serverEntity &server, uint32_t leaseSeconds, uint16_t weight);
+    bool reportLoad(string serviceName, serverEntity &server, uint16_t load);
     bool removeService(string serviceName, serverEntity &server);
     serverEntity searchService(string serviceName);
+    bool searchServiceAll(string serviceName, vector<serverEntity> & res);
+    vector<serverEntity> searchServices(const vector<string> & serviceNames);
     bool resetServiceServer();
+    bool watchService(string serviceName, watchCallback callback);
+    void unwatchService(string serviceName);
 
 private:
-    const uint32_t magic = 'SRVC';
-    const uint16_t version = 0x1000;
-    enum opCode { regService = 1, remService, srchService, resetServer };
-    string opString[5] = {
-        "none", "register", "remove", "search", "reset"
+    // 10 and 11 are only used between directory nodes.
+    enum opCode { regService = 1, remService, srchService, resetServer, rnwService,
+                  srchAllService, srchBatchService, wtchService, ntfyService,
+                  busyService = 12 };
+    string opString[13] = {
+        "none", "register", "remove", "search", "reset", "renew", "search all", "search batch",
+        "watch", "notify", "replicate", "sync", "busy"
     };
 
     // serial number for packets.
@@ -102,28 +171,313 @@ private:
     std::atomic<uint32_t> serial = 0;
     
     // server information.
-    // this is only set once, and must be set before any other functions are called
+    // this is only set once, by setupNetwork on the first request.
+    // several addresses if the directory is replicated, requests go to
+    // servaddrs[current] until it stops answering.
     string serverAddressName;
-    struct sockaddr_in servaddr;
+    vector<struct sockaddr_in> servaddrs;
+    std::atomic<uint32_t> current{0};
     uint16_t port;
-    int sockfd;
+    int sockfd = -1;
     bool addressInitialized = false;
+
+    // a request waiting for its reply
+    struct pendingReply {
+        uint8_t * buffer;
+        int32_t n;
+        bool done;
+        std::condition_variable cond;
+        // the directory was too busy, the reply holds how long to wait
+        bool busy() const {
+            return n >= (int32_t)(DETAILOFFSET + 4) && load16(buffer + OPOFFSET) == busyService;
+        }
+    };
+    // requests by serial number, guarded by netLock along with the setup.
+    std::unordered_map<uint32_t, pendingReply*> pending;
+    std::mutex netLock;
+    std::thread receiveThread;
+    std::atomic<bool> netStopping{false};
+    int wakePipe[2] = {-1, -1};
+
+    void receiver();
+    void failover(uint32_t from);
+
+    // leased registrations that are renewed in the background
+    struct lease {
+        string serviceName;
+        serverEntity server;
+        uint32_t seconds;
+        uint16_t weight;
+        uint16_t load;          // sent with the next renewal
+        std::chrono::steady_clock::time_point nextRenewal;
+
+        bool same(const lease & other) const {
+            return serviceName == other.serviceName && server.name == other.server.name && server.port == other.server.port;
+        }
+    };
+    std::vector<lease> leases;
+    std::mutex leaseLock;
+    std::condition_variable leaseCond;
+    std::thread heartbeatThread;
+    bool stopping = false;
+
+    // watched services, kept up to date by the watch thread
+    struct watch {
+        watchCallback callback;
+        uint32_t epoch;
+        uint32_t version;
+        bool synced;
+        bool awaitingReply;
+        vector<serverEntity> servers;
+        std::chrono::steady_clock::time_point nextRenewal;
+    };
+    std::unordered_map<string, watch> watches;
+    // serial of each watch request waiting for a reply
+    std::unordered_map<uint32_t, string> watchRequests;
+    // watch replies and notifications passed on by the receive thread
+    std::deque<vector<uint8_t>> watchPackets;
+    std::mutex watchLock;
+    std::condition_variable watchCond;
+    std::thread watchThread;
+    bool watchStopping = false;
+    bool watchAdded = false;
+
+    void watcher();
+    bool sendWatch(const string & serviceName, uint32_t leaseSeconds);
+    void receiveWatch(uint8_t * buff, int32_t n);
+    void resync(const string & serviceName, uint32_t epoch, uint32_t ver);
+
+    void heartbeat();
+    bool sendRegistration(opCode op, const string & serviceName, const serverEntity &server, uint32_t leaseSeconds,
+                          uint16_t weight, uint16_t load);
     
     bool setupNetwork();
     void buildHeader(uint8_t *buff,opCode op, uint32_t ser);
     
-    // header data structure to read return packets into.
-    struct header {
-       uint32_t magic;
-       uint16_t version;
-       uint16_t opCode;
-       uint32_t serial;
+
+    bool parseHeader(uint8_t * buff, int32_t l, packetHeader & hdr );
+    int32_t transact(uint8_t * sendBuff, uint32_t msgLen, uint32_t ser, uint8_t * recvBuffer);
+    bool readServer(packetReader & rd, serverEntity & se);
+
+};
+
+//+
+//**********************************************
+// lookupCache
+//
+// the process wide cache behind lookupService. Every service looked
+// up is kept with all of its servers and one is picked at random
+// locally, so a lookup is normally just a memory read and the load
+// is still spread over the servers.
+//
+//  - an entry is fresh for CACHETTL seconds (NEGATIVETTL if the
+//    service has no servers, so a new service is found quickly).
+//  - for STALETTL seconds after that the old servers are still
+//    handed out while the refresh thread fetches the service again.
+//  - only one thread fetches a missing service, the others wait.
+//  - the cache watches every service in it. Changes arrive as they
+//    happen and watched entries stay fresh for WATCHEDTTL seconds.
+//  - registering or removing through this process drops the entry.
+//
+// The cache is created on first use and never destroyed, its threads
+// run until the process exits.
+//**********************************************
+//-
+
+#define CACHETTL     std::chrono::seconds(5)
+#define NEGATIVETTL  std::chrono::seconds(1)
+#define WATCHEDTTL   std::chrono::seconds(60)
+#define STALETTL     std::chrono::seconds(30)
+
+class lookupCache {
+public:
+    static lookupCache & instance();
+    // drop a service, if there is a cache.
+    static void forget(const string & serviceName);
+    static void forgetAll();
+
+    serverEntity lookup(const string & serviceName);
+
+private:
+    lookupCache();
+
+    struct entry {
+        vector<serverEntity> servers;
+        std::chrono::steady_clock::time_point expires;
+        bool valid = false;         // servers have been fetched
+        bool fetching = false;      // a fetch is under way
+        bool watched = false;
     };
 
-    bool parseHeader(uint8_t * buff, int32_t l, header & hdr );
+    std::mutex lock;
+    std::condition_variable fetched;
+    std::unordered_map<string, entry> entries;
+    std::deque<string> refreshQueue;
+    std::condition_variable refreshCond;
+    serviceServer dir;
+    std::thread refreshThread;
+
+    static std::atomic<lookupCache*> theCache;
 
+    void fetch(const string & serviceName);
+    void refresher();
+    void changed(const string & serviceName, watchEvent event, const serverEntity & server);
 };
 
+std::atomic<lookupCache*> lookupCache::theCache{nullptr};
+
+lookupCache & lookupCache::instance(){
+    static std::once_flag once;
+    std::call_once(once, []{ theCache = new lookupCache(); });
+    return *theCache;
+}
+
+void lookupCache::forget(const string & serviceName){
+    lookupCache * c = theCache.load();
+    if (c == nullptr) return;
+    std::lock_guard<std::mutex> guard(c->lock);
+    auto it = c->entries.find(serviceName);
+    if (it != c->entries.end() && !it->second.fetching){
+        it->second.valid = false;
+    }
+}
+
+void lookupCache::forgetAll(){
+    lookupCache * c = theCache.load();
+    if (c == nullptr) return;
+    std::lock_guard<std::mutex> guard(c->lock);
+    for (auto & e : c->entries){
+        if (!e.second.fetching) e.second.valid = false;
+    }
+}
+
+lookupCache::lookupCache(){
+    refreshThread = thread(&lookupCache::refresher, this);
+}
+
+//+
+// lookup
+//
+// pick a server from the cache, fetching the service if it isn't
+// there or has been stale for too long.
+//-
+
+serverEntity lookupCache::lookup(const string & serviceName){
+    static thread_local std::mt19937 gen(std::random_device{}());
+    auto now = chrono::steady_clock::now();
+
+    std::unique_lock<std::mutex> guard(lock);
+    entry & e = entries[serviceName];
+    if (!e.valid || now >= e.expires + STALETTL){
+        if (!e.fetching){
+            e.fetching = true;
+            guard.unlock();
+            fetch(serviceName);
+            guard.lock();
+        } else {
+            fetched.wait(guard, [&e]{ return !e.fetching; });
+        }
+    } else if (now >= e.expires && !e.fetching){
+        // stale, hand it out anyway and refresh in the background
+        e.fetching = true;
+        refreshQueue.push_back(serviceName);
+        refreshCond.notify_one();
+    }
+
+    if (e.servers.empty()){
+        return serverEntity{"None", 0};
+    }
+    std::uniform_int_distribution<size_t> pick(0, e.servers.size() - 1);
+    return e.servers[pick(gen)];
+}
+
+//+
+// fetch
+//
+// get every server for the service from the directory. Called with
+// the entry's fetching flag set and the lock not held. The first
+// fetch also starts watching the service.
+//-
+
+void lookupCache::fetch(const string & serviceName){
+    vector<serverEntity> servers;
+    bool ok = dir.searchServiceAll(serviceName, servers);
+
+    bool startWatch = false;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        entry & e = entries[serviceName];
+        auto now = chrono::steady_clock::now();
+        if (ok){
+            e.servers = std::move(servers);
+            e.valid = true;
+            if (e.watched){
+                e.expires = now + WATCHEDTTL;
+            } else {
+                e.expires = now + (e.servers.empty() ? NEGATIVETTL : CACHETTL);
+            }
+            startWatch = !e.watched;
+            e.watched = true;
+        } else if (!e.valid){
+            // no directory, remember that briefly rather than
+            // making every caller wait for the timeout.
+            e.servers.clear();
+            e.valid = true;
+            e.expires = now + NEGATIVETTL;
+        }
+        // a failed refresh keeps the stale servers until STALETTL is up
+        e.fetching = false;
+    }
+    fetched.notify_all();
+
+    if (startWatch){
+        dir.watchService(serviceName, [this](const string & name, watchEvent event, const serverEntity & server){
+            changed(name, event, server);
+        });
+    }
+}
+
+void lookupCache::refresher(){
+    std::unique_lock<std::mutex> guard(lock);
+    while (true){
+        refreshCond.wait(guard, [this]{ return !refreshQueue.empty(); });
+        string serviceName = refreshQueue.front();
+        refreshQueue.pop_front();
+        guard.unlock();
+        fetch(serviceName);
+        guard.lock();
+    }
+}
+
+//+
+// changed
+//
+// watch callback, keep the cached servers in step with the directory.
+//-
+
+void lookupCache::changed(const string & serviceName, watchEvent event, const serverEntity & server){
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = entries.find(serviceName);
+    if (it == entries.end() || !it->second.valid) return;
+    entry & e = it->second;
+
+    bool present = false;
+    for (size_t i = 0; i < e.servers.size(); i++){
+        if (e.servers[i].name == server.name && e.servers[i].port == server.port){
+            present = true;
+            if (event == watchEvent::removed){
+                e.servers[i] = e.servers.back();
+                e.servers.pop_back();
+            }
+            break;
+        }
+    }
+    if (event == watchEvent::added && !present){
+        e.servers.push_back(server);
+    }
+    e.expires = chrono::steady_clock::now() + WATCHEDTTL;
+}
+
 //+
 //**********************************************
 // implementation of serviceServer methods.
@@ -137,11 +491,18 @@ serviceServer::serviceServer(){
 serviceServer::~serviceServer(){
 }
 
-bool serviceServer::registerService(std::string serviceName, serverEntity &server){
-    return pImpl->registerService(serviceName,server);
+bool serviceServer::registerService(std::string serviceName, serverEntity &server, uint32_t leaseSeconds,
+                                    uint16_t weight){
+    lookupCache::forget(serviceName);
+    return pImpl->registerService(serviceName,server,leaseSeconds,weight);
+}
+
+bool serviceServer::reportLoad(std::string serviceName, serverEntity &server, uint16_t load){
+    return pImpl->reportLoad(serviceName,server,load);
 }
 
 bool serviceServer::removeService(std::string serviceName, serverEntity &server){
+    lookupCache::forget(serviceName);
     return pImpl->removeService(serviceName,server);
 }
 
@@ -149,10 +510,41 @@ serverEntity serviceServer::searchService(std::string serviceName){
     return pImpl->searchService(serviceName);
 }
 
+serverEntity serviceServer::lookupService(std::string serviceName){
+    if (serviceName.length() > MAXSERVICENAME){
+        errno = E_SERVICENAME;
+        return serverEntity{"None", 0};
+    }
+    return lookupCache::instance().lookup(serviceName);
+}
+
+std::vector<serverEntity> serviceServer::searchServiceAll(std::string serviceName){
+    std::vector<serverEntity> servers;
+    pImpl->searchServiceAll(serviceName, servers);
+    return servers;
+}
+
+bool serviceServer::searchServiceAll(std::string serviceName, std::vector<serverEntity> & servers){
+    return pImpl->searchServiceAll(serviceName, servers);
+}
+
+std::vector<serverEntity> serviceServer::searchServices(const std::vector<std::string> & serviceNames){
+    return pImpl->searchServices(serviceNames);
+}
+
 bool serviceServer::resetServiceServer(){
+    lookupCache::forgetAll();
     return pImpl->resetServiceServer();
 }
 
+bool serviceServer::watchService(std::string serviceName, watchCallback callback){
+    return pImpl->watchService(serviceName, callback);
+}
+
+void serviceServer::unwatchService(std::string serviceName){
+    pImpl->unwatchService(serviceName);
+}
+
 
 //+
 //**********************************************
@@ -169,10 +561,7 @@ bool serviceServer::resetServiceServer(){
 //-
 
 void serviceServer::serviceServerImpl::buildHeader(uint8_t *buff,opCode op, uint32_t ser){
-    *(uint32_t*)buff = htonl(magic);
-    *((uint16_t*)(buff+VERSIONOFFSET)) = htons(version);
-    *((uint16_t*)(buff+OPOFFSET)) = htons(op);
-    *((uint32_t*)(buff+SERIALOFFSET)) = htonl(ser);
+    writeHeader(buff, op, ser);
 }
 
 //+
@@ -182,26 +571,21 @@ void serviceServer::serviceServerImpl::buildHeader(uint8_t *buff,opCode op, uint
 //
 //-
 
-bool serviceServer::serviceServerImpl::parseHeader(uint8_t * buff, int32_t l, header & hdr ){
+bool serviceServer::serviceServerImpl::parseHeader(uint8_t * buff, int32_t l, packetHeader & hdr ){
     
-    if (l < 12) return false;
-    hdr.magic = ntohl(*((uint32_t*)buff));
-    if (hdr.magic != magic){
+    if (!readHeader(buff, l, hdr)) return false;
+    if (hdr.magic != PACKETMAGIC){
        cerr << "Magic on packet not correct" << endl;
        return false;
     }
-    hdr.version = ntohs(*(uint16_t*)(buff + VERSIONOFFSET));
-    if (hdr.version != version){
+    if (hdr.version != PACKETVERSION){
        cerr << "Version on packet not correct" << endl;
        return false;
     }
-    hdr.opCode = ntohs(*(uint16_t*)(buff + OPOFFSET));
-    if (hdr.opCode > 4 || hdr.opCode == 0) {
+    if ((hdr.opCode > ntfyService && hdr.opCode != busyService) || hdr.opCode == 0) {
        cerr << "opCode on packet not correct" << endl;
        return false;
     }
-    hdr.serial = ntohl(*(uint32_t*)(buff + SERIALOFFSET));
-
 
     return true;
 }
@@ -210,13 +594,149 @@ bool serviceServer::serviceServerImpl::parseHeader(uint8_t * buff, int32_t l, he
 //+
 // registerService client stub
 //
-// build a register packet, send it to the server and
-// wait for the reply.
+// send the registration and, if it has a lease, hand it to the
+// heartbeat thread to keep renewed.
+//-
+
+bool serviceServer::serviceServerImpl::registerService(string serviceName, serverEntity &server, uint32_t leaseSeconds,
+                                                       uint16_t weight){
+    if (!sendRegistration(regService, serviceName, server, leaseSeconds, weight, 0)){
+        return false;
+    }
+    if (leaseSeconds == 0){
+        return true;
+    }
+
+    std::lock_guard<std::mutex> lock(leaseLock);
+    // renew three times per lease so that one lost packet doesn't expire it.
+    auto next = chrono::steady_clock::now() + chrono::milliseconds(leaseSeconds * 1000 / 3);
+    bool found = false;
+    for (auto & l : leases){
+        if (l.serviceName == serviceName && l.server.name == server.name && l.server.port == server.port){
+            l.seconds = leaseSeconds;
+            l.weight = weight;
+            l.load = 0;
+            l.nextRenewal = next;
+            found = true;
+        }
+    }
+    if (!found){
+        leases.push_back(lease{serviceName, server, leaseSeconds, weight, 0, next});
+    }
+    if (!heartbeatThread.joinable()){
+        heartbeatThread = thread(&serviceServerImpl::heartbeat, this);
+    }
+    leaseCond.notify_one();
+    return true;
+}
+
+//+
+// reportLoad client stub
+//
+// the load is only kept here, the next renewal takes it to the
+// directory. Registrations without a lease are never renewed so
+// there is nothing to carry it. A load of 0 goes as 1, on the wire 0
+// means none has been reported.
+//-
+
+bool serviceServer::serviceServerImpl::reportLoad(string serviceName, serverEntity &server, uint16_t load){
+    std::lock_guard<std::mutex> lock(leaseLock);
+    for (auto & l : leases){
+        if (l.serviceName == serviceName && l.server.name == server.name && l.server.port == server.port){
+            l.load = load == 0 ? 1 : load;
+            return true;
+        }
+    }
+    errno = E_NOLEASE;
+    return false;
+}
+
+//+
+// heartbeat
 //
-// TODO - update to at least once semantics
+// background thread that sends a renew packet for each leased
+// registration every third of its lease. A failed renewal is
+// tried again a second later. The lock is let go while waiting for
+// the directory; if the leases changed meanwhile the scan starts
+// again, the ones already renewed aren't due so it only costs the
+// walk. Registering or removing a lease wakes the thread so it
+// works out when to wake again.
 //-
 
-bool serviceServer::serviceServerImpl::registerService(string serviceName, serverEntity &server){
+void serviceServer::serviceServerImpl::heartbeat(){
+    std::unique_lock<std::mutex> lock(leaseLock);
+    while (!stopping){
+        auto now = chrono::steady_clock::now();
+        auto wake = now + chrono::seconds(60);
+        size_t i = 0;
+        while (i < leases.size()){
+            if (leases[i].nextRenewal <= now){
+                lease l = leases[i];
+                // don't hold the lock while waiting for the directory
+                lock.unlock();
+                bool ok = sendRegistration(rnwService, l.serviceName, l.server, l.seconds, l.weight, l.load);
+                lock.lock();
+                now = chrono::steady_clock::now();
+                auto next = ok ? now + chrono::milliseconds(l.seconds * 1000 / 3) : now + chrono::seconds(1);
+                if (i >= leases.size() || !leases[i].same(l)){
+                    // moved or removed while unlocked
+                    for (auto & other : leases){
+                        if (other.same(l)) other.nextRenewal = next;
+                    }
+                    i = 0;
+                    continue;
+                }
+                leases[i].nextRenewal = next;
+            }
+            if (leases[i].nextRenewal < wake) wake = leases[i].nextRenewal;
+            i++;
+        }
+        leaseCond.wait_until(lock, wake);
+    }
+}
+
+serviceServer::serviceServerImpl::~serviceServerImpl(){
+    {
+        std::lock_guard<std::mutex> lock(leaseLock);
+        stopping = true;
+    }
+    leaseCond.notify_one();
+    if (heartbeatThread.joinable()){
+        heartbeatThread.join();
+    }
+
+    if (watchThread.joinable()){
+        {
+            std::lock_guard<std::mutex> lock(watchLock);
+            watchStopping = true;
+        }
+        watchCond.notify_one();
+        watchThread.join();
+        // tell the directory so it stops sending to a closed socket
+        for (auto & w : watches){
+            sendWatch(w.first, 0);
+        }
+    }
+
+    if (receiveThread.joinable()){
+        netStopping = true;
+        write(wakePipe[1], "", 1);
+        receiveThread.join();
+        close(sockfd);
+        close(wakePipe[0]);
+        close(wakePipe[1]);
+    }
+}
+
+//+
+// sendRegistration
+//
+// build a register or renew packet, send it to the server and
+// wait for the reply.
+//-
+
+bool serviceServer::serviceServerImpl::sendRegistration(opCode op, const string & serviceName, const serverEntity &server, uint32_t leaseSeconds,
+                                                        uint16_t weight, uint16_t load){
     uint32_t sendBuffAligned[SENDBUFFLEN/4+1];
     uint8_t * sendBuff = (uint8_t*)sendBuffAligned;
     uint32_t serialForThisRequest = serial++;
@@ -237,109 +757,40 @@ bool serviceServer::serviceServerImpl::registerService(string serviceName, serve
         errno = E_PORTNUM;
         return false;
     }
-    // verify aligned to 4 byte boundary (bottom two bits are zero
-    //   0b11111100
-    if ((long long)sendBuff & 3){
-        cerr << "buffer is not word aligned" << endl;
-        exit(1);
+    buildHeader(sendBuff, op, serialForThisRequest);
+
+    // add the rest of the message: service name, 4 byte aligned,
+    // then the server.
+    packetWriter wr(sendBuff, sizeof(sendBuffAligned));
+    wr.name(serviceName).align(4).server(server.name, server.port);
+
+    // lease, weight and load, only sent if they are needed so older
+    // directories still understand the packet.
+    bool weighted = (weight != 0 && weight != 1) || load != 0;
+    if (leaseSeconds != 0 || weighted){
+        wr.align(4).u32(leaseSeconds);
+    }
+    if (weighted){
+        wr.u16(weight).u16(load);
     }
-
-    buildHeader(sendBuff, regService, serialForThisRequest);
-
-    // add the rest of the message
-    uint8_t * curPos = ((uint8_t*)(sendBuff + DETAILOFFSET));
-
-    // add the service name
-    *curPos++ = svcNameLen;
-    memcpy(curPos,serviceName.data(), svcNameLen);
-    curPos += svcNameLen;
-
-    // align to 4 byte boundary
-    curPos = (uint8_t*)(((uint64_t)(curPos + 3)) & 0xFFFFFFFFFFFFFFFCllu);
-
-    // add the server details
-    // server Name
-    *curPos++ = servNameLen;
-    memcpy(curPos,server.name.data(), servNameLen);
-    curPos += servNameLen;
-
-    // align to 2 byte boundary
-    curPos = (uint8_t*)((uint64_t)(curPos + 1) & 0xFFFFFFFFFFFFFFFEllu);
-
-    // port
-    *((uint16_t*)curPos) = htons(server.port);
-    curPos += 2;
 
     // total msg length
-    uint32_t msgLen = curPos - sendBuff;
+    uint32_t msgLen = wr.pos();
 
 #ifdef DEBUG
     cout << " Send buffer ready to go = "<< endl << HexDump{sendBuff,msgLen};
 #endif
     
-
-    if (!setupNetwork()){
-        errno = E_NOSERVER;
-        cerr << "failed to setup Network" << endl;
+    uint32_t recvBuffAligned[RECVBUFFLEN/4];
+    uint8_t * recvBuffer = (uint8_t*)recvBuffAligned;
+    int32_t n = transact(sendBuff, msgLen, serialForThisRequest, recvBuffer);
+    if (n < 0){
         return false;
     }
-
-    int numTries = 0;
-    bool completed = false;
-    
-    // TODO need start loop here for at least once semantics
-    
-    // send the packet
-#ifdef DEBUG
-    cout << "  -------> sending " << endl;
-#endif
-    
-    int n = sendto(sockfd, (const char *) sendBuff, msgLen,
-	MSG_CONFIRM, (const struct sockaddr*)&servaddr, sizeof(servaddr));
-
-#ifdef DEBUG
-    cout << "  sendto returned " << dec << n << endl;
-#endif
-
-    bool gotMessage = true;
-    do {
-        uint32_t recvBuffAligned[1024];
-        uint8_t* recvBuffer = (uint8_t*)recvBuffAligned;
-        static struct sockaddr_in servaddrreply;
-        uint32_t len = sizeof(struct sockaddr_in);
-        memset(&servaddrreply, 0, sizeof(servaddrreply));
-
-        // wait for result from server
-        n = recvfrom(sockfd, (char *) recvBuffer, 1024, MSG_WAITALL,
-            (struct sockaddr*)&servaddrreply, & len);
-
-#ifdef DEBUG
-        cout << "  <------ got " << n << " bytes back from server" << endl;
-#endif
-        
-        if (n == -1){
-            // if timeout
-        } else {
-            // parse result message
-            header hdr;
-            if (parseHeader(recvBuffer, n, hdr)){
-            // check magic, serial and op
-            if (hdr.magic  == magic && hdr.serial == serialForThisRequest){
-                if (n > DETAILOFFSET){
-                    gotMessage = true;
-                    res = recvBuffer[DETAILOFFSET];
+    res = recvBuffer[DETAILOFFSET];
 #ifdef DEBUG
-                    cout << "  register Service returned " << res << endl;
+    cout << "  register Service returned " << res << endl;
 #endif
-                }
-            }
-	    }
-	    // go around again
-	}
-
-    } while(!gotMessage);
-
-    close(sockfd);
 
     errno = 0;
     return res;
@@ -351,8 +802,6 @@ bool serviceServer::serviceServerImpl::registerService(string serviceName, serve
 //
 // build a remove packet, send it to the server and
 // wait for the reply.
-//
-// TODO - update to at least once semantics
 //-
 
 bool serviceServer::serviceServerImpl::removeService(string serviceName, serverEntity &server){
@@ -361,6 +810,18 @@ bool serviceServer::serviceServerImpl::removeService(string serviceName, serverE
     uint32_t serialForThisRequest = serial++;
     bool res = false;
 
+    // stop renewing it first so the heartbeat doesn't add it back.
+    {
+        std::lock_guard<std::mutex> lock(leaseLock);
+        for (auto it = leases.begin(); it != leases.end(); it++){
+            if (it->serviceName == serviceName && it->server.name == server.name && it->server.port == server.port){
+                leases.erase(it);
+                break;
+            }
+        }
+    }
+    leaseCond.notify_one();
+
     uint32_t svcNameLen = serviceName.length();
     if (svcNameLen > MAXSERVICENAME){
         errno = E_SERVICENAME;
@@ -378,98 +839,28 @@ bool serviceServer::serviceServerImpl::removeService(string serviceName, serverE
 
     buildHeader(sendBuff, remService, serialForThisRequest);
 
-    // add the rest of the message
-    uint8_t * curPos = ((uint8_t*)(sendBuff + DETAILOFFSET));
-
-    // add the service name
-    *curPos++ = svcNameLen;
-    memcpy(curPos,serviceName.data(), svcNameLen);
-    curPos += svcNameLen;
-
-    // align to 4 byte boundary
-    curPos = (uint8_t*)(((uint64_t)(curPos + 3)) & 0xFFFFFFFFFFFFFFFCllu);
-
-    // add the details of the server to be removed
-    // server Name
-    *curPos++ = servNameLen;
-    memcpy(curPos,server.name.data(), servNameLen);
-    curPos += servNameLen;
-
-    // align to 2 byte boundary
-    curPos = (uint8_t*)((uint64_t)(curPos + 1) & 0xFFFFFFFFFFFFFFFEllu);
-
-    // port
-    *((uint16_t*)curPos) = htons(server.port);
-    curPos += 2;
+    // add the rest of the message: service name, 4 byte aligned,
+    // then the server to be removed.
+    packetWriter wr(sendBuff, sizeof(sendBuffAligned));
+    wr.name(serviceName).align(4).server(server.name, server.port);
 
     // total msg length
-    uint32_t msgLen = curPos - sendBuff;
+    uint32_t msgLen = wr.pos();
 
 #ifdef DEBUG
     //cout << "Send buffer ready to go = "<< endl << HexDump{sendBuff,msgLen};
 #endif
     
-    if (!setupNetwork()){
-        errno = E_NOSERVER;
-        cerr << "failed to setup Network" << endl;
+    uint32_t recvBuffAligned[RECVBUFFLEN/4];
+    uint8_t * recvBuffer = (uint8_t*)recvBuffAligned;
+    int32_t n = transact(sendBuff, msgLen, serialForThisRequest, recvBuffer);
+    if (n < 0){
         return false;
     }
-
-    int numTries = 0;
-    bool completed = false;
-    
-    // TODO need start loop here for at least once semantics
-
-    // send the packet
+    res = recvBuffer[DETAILOFFSET];
 #ifdef DEBUG
-    cout << " ----> sending " << endl;
+    cout << " remove Service returned " << res << endl;
 #endif
-    
-    int n = sendto(sockfd, (const char *) sendBuff, msgLen,
-        MSG_CONFIRM, (const struct sockaddr*)&servaddr, sizeof(servaddr));
-
-#ifdef DEBUG
-    cout << "  sendto returned " << dec << n << endl;
-#endif
-    
-    bool gotMessage = true;
-    do {
-        uint32_t recvBuffAligned[1024];
-        uint8_t* recvBuffer = (uint8_t*)recvBuffAligned;
-        static struct sockaddr_in servaddrreply;
-        uint32_t len = sizeof(struct sockaddr_in);
-        memset(&servaddrreply, 0, sizeof(servaddrreply));
-
-        // wait for result
-        n = recvfrom(sockfd, (char *) recvBuffer, 1024, MSG_WAITALL,
-            (struct sockaddr*)&servaddrreply, & len);
-
-#ifdef DEBUG
-        cout << " <------- got " << n << " bytes back from server" << endl;
-#endif
-        
-        if (n == -1){
-            // if timeout
-        } else {
-            // parse result message
-            header hdr;
-            if (parseHeader(recvBuffer, n, hdr)){
-                // check magic, serial and op
-                if (hdr.magic  == magic && hdr.serial == serialForThisRequest){
-                    if (n > DETAILOFFSET){
-                        gotMessage = true;
-                        res = recvBuffer[DETAILOFFSET];
-#ifdef DEBUG
-                        cout << " remove Service returned " << res << endl;
-#endif
-                    }
-                }
-            }
-            // go around again
-        }
-    } while(!gotMessage);
-
-    close(sockfd);
 
     errno = 0;
     return res;
@@ -483,8 +874,6 @@ bool serviceServer::serviceServerImpl::removeService(string serviceName, serverE
 // wait for the reply. Sender is smaller than the previous two
 // since server details not sent. Receive logic is larger
 // since server details are received.
-//
-// TODO - update to at least once semantics
 //-
 
 serverEntity serviceServer::serviceServerImpl::searchService(string serviceName){
@@ -500,114 +889,572 @@ serverEntity serviceServer::serviceServerImpl::searchService(string serviceName)
 
     buildHeader(sendBuff, srchService, serialForThisRequest);
 
-    // add the rest of the message
-    uint8_t * curPos = ((uint8_t*)(sendBuff + DETAILOFFSET));
-
-    // add the service name
-    *curPos++ = svcNameLen;
-    memcpy(curPos,serviceName.data(), svcNameLen);
-    curPos += svcNameLen;
-    // end of packet.
+    // add the service name, the end of the packet.
+    packetWriter wr(sendBuff, sizeof(sendBuff));
+    wr.name(serviceName);
     
     // total msg length
-    uint32_t msgLen = curPos - sendBuff;
+    uint32_t msgLen = wr.pos();
 
 #ifdef DEBUG
     //cout << "Send buffer ready to go = "<< endl << HexDump{sendBuff,msgLen};
 #endif
     
-    if (!setupNetwork()){
-        errno = E_NOSERVER;
-        cerr << "failed to setup Network" << endl;
+    uint32_t recvBuffAligned[RECVBUFFLEN/4];
+    uint8_t * recvBuffer = (uint8_t*)recvBuffAligned;
+    int32_t n = transact(sendBuff, msgLen, serialForThisRequest, recvBuffer);
+    if (n < 0){
         return res;
     }
 
-    int numTries = 0;
-    bool completed = false;
-    
-    // TODO need start loop here for at least once semantics
-
-    // send the packet
+    // parse the server in the reply
+    packetReader rd(recvBuffer, n);
+    if (!readServer(rd, res)){
+        cerr << "reply packet doesn't contain a server" << endl;
+        return res;
+    }
 #ifdef DEBUG
-    cout << " -------> sending " << endl;
+    cout << "  reply server is " << res << endl;
 #endif
-    
-    int n = sendto(sockfd, (const char *) sendBuff, msgLen,
-        MSG_CONFIRM, (const struct sockaddr*)&servaddr, sizeof(servaddr));
 
+    errno = 0;
+    return res;
+}
+
+
+
+//+
+// transact
+//
+// send a request that is already built and wait for the reply with
+// the same serial number. The request is sent again if no reply comes
+// in time, to the next directory node if there is more than one. If
+// the node answers busy the request is sent to it again after the
+// wait it gives.
+// Returns the length of the reply in recvBuffer (RECVBUFFLEN bytes)
+// or -1 if there was no reply (errno E_TIMEOUT), the node was still
+// busy (E_BUSY) or the request couldn't be sent at all (E_SOCKET).
+//-
+
+int32_t serviceServer::serviceServerImpl::transact(uint8_t * sendBuff, uint32_t msgLen, uint32_t ser, uint8_t * recvBuffer){
+    if (!setupNetwork()){
+        errno = E_NOSERVER;
+        cerr << "failed to setup Network" << endl;
+        return -1;
+    }
+
+    pendingReply reply;
+    reply.buffer = recvBuffer;
+    reply.n = -1;
+    reply.done = false;
+
+    std::unique_lock<std::mutex> lock(netLock);
+    pending[ser] = &reply;
+    bool sent = false;
+    for (int tries = 0; tries < MAXTRIES && !reply.done; tries++){
+        uint32_t target = current;
 #ifdef DEBUG
-    cout << "  sendto returned " << dec << n << endl;
+        cout << "  -------> sending " << opString[ntohs(*((uint16_t*)(sendBuff+OPOFFSET)))]
+             << " try " << tries << " to node " << target << endl;
 #endif
-    
-    bool gotMessage = true;
-    do {
-        uint32_t recvBuffAligned[1024];
-        uint8_t* recvBuffer = (uint8_t*)recvBuffAligned;
-        static struct sockaddr_in servaddrreply;
-        uint32_t len = sizeof(struct sockaddr_in);
-        memset(&servaddrreply, 0, sizeof(servaddrreply));
-
-        // wait for result
-        n = recvfrom(sockfd, (char *) recvBuffer, 1024, MSG_WAITALL, (struct sockaddr*)&servaddrreply, & len);
+        int n = sendto(sockfd, (const char *) sendBuff, msgLen,
+            MSG_CONFIRM, (const struct sockaddr*)&servaddrs[target], sizeof(servaddrs[target]));
 #ifdef DEBUG
-        cout << " <------ recieved " << dec <<  n << " bytes back from server" << endl;
+        cout << "  sendto returned " << dec << n << endl;
 #endif
-        if (n == -1){
-            // if timeout
-        } else {
-            // parse result message
+        if (n < 0){
+            // nothing went, so there's no reply to wait for
+            perror("sending to directory node failed");
+            failover(target);
+            continue;
+        }
+        sent = true;
+        if (!reply.cond.wait_for(lock, REPLYTIMEOUT, [&reply]{ return reply.done; })){
+            // no answer, the next try goes to another node
+            failover(target);
+        } else if (reply.busy() && tries + 1 < MAXTRIES){
+            // the node is there but has too much to do.
+            uint32_t wait = std::min(load32(recvBuffer + DETAILOFFSET), (uint32_t)MAXBUSYWAIT);
+            reply.done = false;
+            reply.cond.wait_for(lock, std::chrono::milliseconds(wait), [&reply]{ return reply.done; });
+        }
+    }
+    pending.erase(ser);
+
+    if (!sent){
+        errno = E_SOCKET;
+        return -1;
+    }
+    if (!reply.done){
+        errno = E_TIMEOUT;
+        return -1;
+    }
+    if (reply.busy()){
+        errno = E_BUSY;
+        return -1;
+    }
+    return reply.n;
+}
+
+//+
+// failover
+//
+// move on to the next directory node, unless another thread has
+// already moved on from the node that didn't answer.
+//-
+
+void serviceServer::serviceServerImpl::failover(uint32_t from){
+    if (servaddrs.size() < 2) return;
+    uint32_t next = (from + 1) % servaddrs.size();
+    if (current.compare_exchange_strong(from, next)){
 #ifdef DEBUG
-            //cout << " Recived:" << endl << HexDump{sendBuff,n};
+        cout << "  directory node " << from << " not answering, using " << next << endl;
 #endif
-            
-            header hdr;
-            if (parseHeader(recvBuffer, n, hdr)){
-                // check magic, serial and op
-                if (hdr.magic  == magic && hdr.serial == serialForThisRequest){
-                    if (n > DETAILOFFSET){
-                        gotMessage = true;
-                        // parse the
-                        //res = recvBuffer[DETAILOFFSET];
-                        uint32_t curPos = DETAILOFFSET;
-                        int nameLen = *((uint8_t*)(recvBuffer+curPos++));
-                        cout << "  reply server name length is " << nameLen << endl;
-                        
-                        if (n < curPos + nameLen){
-                           cerr << "reply packet doesn't contain server name data" << endl;
-                           return res;
-                        }
-                        res.name = string((char*)(recvBuffer+curPos),nameLen);
-                        curPos += nameLen;
-                        
+    }
+}
+
+//+
+// receiver
+//
+// the receive thread. Copies each reply into the buffer of the request
+// waiting for it and wakes that request. Replies nobody is waiting
+// for (duplicates from a resend, or after a timeout) are dropped.
+//-
+
+void serviceServer::serviceServerImpl::receiver(){
+    uint32_t recvBuffAligned[RECVBUFFLEN/4];
+    uint8_t * recvBuffer = (uint8_t*)recvBuffAligned;
+
+    while (!netStopping){
+        struct pollfd fds[2] = { { sockfd, POLLIN, 0 }, { wakePipe[0], POLLIN, 0 } };
+        if (poll(fds, 2, -1) <= 0) continue;
+        if (fds[1].revents & POLLIN) break;
+
+        struct sockaddr_in from;
+        socklen_t len = sizeof(from);
+        int32_t n = recvfrom(sockfd, (char *) recvBuffer, RECVBUFFLEN, 0, (struct sockaddr*)&from, &len);
 #ifdef DEBUG
-                        cout << "  reply server name is " << res.name << endl;
+        cout << "  <------ got " << n << " bytes back from server" << endl;
 #endif
-                        
-                        // align to 2 bytes
-                        curPos = ((curPos + 1) & 0xFFFFFFFE);
-                        
-                        if ((curPos + 2) > n) {
-                           cerr << "packet doesn't contain port" << endl;
-                           return res;
-                        }
-                        res.port = ntohs(*((uint16_t*)(recvBuffer+curPos)));
-                        return res;
-                    } else {
-                        // no results.. error
-                    }
-                }
+        packetHeader hdr;
+        if (n <= (int32_t)DETAILOFFSET || !parseHeader(recvBuffer, n, hdr)) continue;
+
+        if (hdr.opCode == wtchService || hdr.opCode == ntfyService){
+            // after a failover the old node may still be sending for a
+            // while, its versions mean nothing to us now.
+            const sockaddr_in & node = servaddrs[current];
+            if (from.sin_port != node.sin_port || from.sin_addr.s_addr != node.sin_addr.s_addr) continue;
+
+            std::lock_guard<std::mutex> lock(watchLock);
+            watchPackets.emplace_back(recvBuffer, recvBuffer + n);
+            watchCond.notify_one();
+            continue;
+        }
+
+        std::lock_guard<std::mutex> lock(netLock);
+        auto it = pending.find(hdr.serial);
+        if (it == pending.end() || it->second->done) continue;
+        memcpy(it->second->buffer, recvBuffer, n);
+        it->second->n = n;
+        it->second->done = true;
+        it->second->cond.notify_one();
+    }
+}
+
+//+
+// readServer
+//
+// read a serverEntity (length byte, name, pad to 2 bytes, port), the
+// name is copied out of the packet.
+//-
+
+bool serviceServer::serviceServerImpl::readServer(packetReader & rd, serverEntity & se){
+    se.name = rd.server(se.port);
+    return rd.ok();
+}
+
+//+
+// searchServiceAll client stub
+//
+// ask for the servers a packet at a time until all of them are in.
+// res has what was got even on failure, errno says why it stopped.
+//-
+
+bool serviceServer::serviceServerImpl::searchServiceAll(string serviceName, vector<serverEntity> & res){
+    res.clear();
+    uint32_t sendBuffAligned[SENDBUFFLEN/4+1];
+    uint8_t * sendBuff = (uint8_t*)sendBuffAligned;
+    uint32_t recvBuffAligned[RECVBUFFLEN/4];
+    uint8_t * recvBuffer = (uint8_t*)recvBuffAligned;
+
+    uint32_t svcNameLen = serviceName.length();
+    if (svcNameLen > MAXSERVICENAME){
+        errno = E_SERVICENAME;
+        return false;
+    }
+
+    uint32_t start = 0;
+    uint32_t total = 0;
+    do {
+        uint32_t serialForThisRequest = serial++;
+        buildHeader(sendBuff, srchAllService, serialForThisRequest);
+        packetWriter wr(sendBuff, sizeof(sendBuffAligned));
+        wr.name(serviceName).align(2).u16(start);
+
+        int32_t n = transact(sendBuff, wr.pos(), serialForThisRequest, recvBuffer);
+        if (n < 0){
+            return false;
+        }
+        packetReader rd(recvBuffer, n);
+        total = rd.u16();
+        rd.u16();
+        uint32_t count = rd.u16();
+        if (!rd.ok()){
+            errno = E_MALFORMED;
+            return false;
+        }
+        for (uint32_t i = 0; i < count; i++){
+            serverEntity se;
+            if (!readServer(rd, se)){
+                cerr << "search all reply is truncated" << endl;
+                errno = E_MALFORMED;
+                return false;
             }
-            // go around again
+            res.push_back(se);
         }
-    } while(!gotMessage);
+        // the service shrank or the reply was empty, nothing more to get.
+        if (count == 0) break;
+        start += count;
+    } while (start < total);
+
+    errno = 0;
+    return true;
+}
+
+//+
+// searchServices client stub
+//
+// look up several services, MAXBATCH names per packet.
+//-
+
+vector<serverEntity> serviceServer::serviceServerImpl::searchServices(const vector<string> & serviceNames){
+    vector<serverEntity> res;
+    uint32_t sendBuffAligned[BATCHBUFFLEN/4+1];
+    uint8_t * sendBuff = (uint8_t*)sendBuffAligned;
+    uint32_t recvBuffAligned[RECVBUFFLEN/4];
+    uint8_t * recvBuffer = (uint8_t*)recvBuffAligned;
+
+    for (auto & name : serviceNames){
+        if (name.length() > MAXSERVICENAME){
+            errno = E_SERVICENAME;
+            return res;
+        }
+    }
+
+    for (size_t first = 0; first < serviceNames.size(); first += MAXBATCH){
+        size_t count = min((size_t)MAXBATCH, serviceNames.size() - first);
+        uint32_t serialForThisRequest = serial++;
+        buildHeader(sendBuff, srchBatchService, serialForThisRequest);
+        packetWriter wr(sendBuff, sizeof(sendBuffAligned));
+        wr.u8(count);
+        for (size_t i = first; i < first + count; i++){
+            wr.name(serviceNames[i]);
+        }
+
+        int32_t n = transact(sendBuff, wr.pos(), serialForThisRequest, recvBuffer);
+        if (n < 0){
+            res.clear();
+            return res;
+        }
+        packetReader rd(recvBuffer, n);
+        if (rd.u8() != count){
+            res.clear();
+            return res;
+        }
+        for (size_t i = 0; i < count; i++){
+            serverEntity se;
+            if (!readServer(rd, se)){
+                cerr << "batch search reply is truncated" << endl;
+                res.clear();
+                return res;
+            }
+            res.push_back(se);
+        }
+    }
 
-    close(sockfd);
-    
     errno = 0;
     return res;
 }
 
+//+
+// watchService client stub
+//
+// remember the callback and let the watch thread send the watch.
+// The servers already registered arrive as added events once the
+// directory replies.
+//-
 
+bool serviceServer::serviceServerImpl::watchService(string serviceName, watchCallback callback){
+    if (serviceName.length() > MAXSERVICENAME){
+        errno = E_SERVICENAME;
+        return false;
+    }
+    if (!setupNetwork()){
+        errno = E_NOSERVER;
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(watchLock);
+    watch & w = watches[serviceName];
+    w.callback = callback;
+    w.epoch = 0;
+    w.version = 0;
+    w.synced = false;
+    w.awaitingReply = false;
+    w.servers.clear();
+    w.nextRenewal = chrono::steady_clock::now();
+    if (!watchThread.joinable()){
+        watchThread = thread(&serviceServerImpl::watcher, this);
+    }
+    watchAdded = true;
+    watchCond.notify_one();
+    errno = 0;
+    return true;
+}
+
+//+
+// unwatchService client stub
+//
+// forget the service and tell the directory. If the packet is lost
+// the directory drops the watch when its lease runs out.
+//-
+
+void serviceServer::serviceServerImpl::unwatchService(string serviceName){
+    {
+        std::lock_guard<std::mutex> lock(watchLock);
+        if (watches.erase(serviceName) == 0) return;
+    }
+    sendWatch(serviceName, 0);
+}
+
+//+
+// sendWatch
+//
+// send a watch request. The reply is not waited for here, the
+// receive thread passes it to the watch thread.
+//-
+
+bool serviceServer::serviceServerImpl::sendWatch(const string & serviceName, uint32_t leaseSeconds){
+    uint32_t sendBuffAligned[SENDBUFFLEN/4+1];
+    uint8_t * sendBuff = (uint8_t*)sendBuffAligned;
+
+    uint32_t serialForThisRequest = serial++;
+    buildHeader(sendBuff, wtchService, serialForThisRequest);
+    packetWriter wr(sendBuff, sizeof(sendBuffAligned));
+    wr.name(serviceName).align(4).u32(leaseSeconds);
+
+    if (leaseSeconds != 0){
+        std::lock_guard<std::mutex> lock(watchLock);
+        watchRequests[serialForThisRequest] = serviceName;
+    }
+    const sockaddr_in & node = servaddrs[current];
+    int n = sendto(sockfd, (const char *) sendBuff, wr.pos(),
+        MSG_CONFIRM, (const struct sockaddr*)&node, sizeof(node));
+    return n >= 0;
+}
+
+//+
+// watcher
+//
+// the watch thread. Sends the watch for each service when it is due
+// (a third of the lease after the last reply, or a second after an
+// unanswered request) and handles the replies and notifications.
+//-
+
+void serviceServer::serviceServerImpl::watcher(){
+    std::unique_lock<std::mutex> lock(watchLock);
+    while (!watchStopping){
+        auto now = chrono::steady_clock::now();
+        auto wake = now + chrono::seconds(WATCHLEASE);
+        vector<string> due;
+        bool noAnswer = false;
+        for (auto & [name, w] : watches){
+            if (w.nextRenewal <= now){
+                due.push_back(name);
+                noAnswer |= w.awaitingReply;
+                w.awaitingReply = true;
+                w.nextRenewal = now + chrono::seconds(1);
+            }
+            if (w.nextRenewal < wake) wake = w.nextRenewal;
+        }
+        if (noAnswer){
+            // the watches move with everything else, the new node has
+            // a different epoch so each service is fetched again.
+            failover(current);
+        }
+        // replies that never came
+        if (watchRequests.size() > 4 * watches.size() + 16){
+            watchRequests.clear();
+        }
+        watchAdded = false;
+
+        // don't hold the lock while talking to the directory,
+        // receiveWatch and the callbacks take it as needed.
+        if (!due.empty()){
+            lock.unlock();
+            for (auto & name : due){
+                sendWatch(name, WATCHLEASE);
+            }
+            lock.lock();
+        }
+
+        watchCond.wait_until(lock, wake, [this]{
+            return watchStopping || watchAdded || !watchPackets.empty();
+        });
+
+        deque<vector<uint8_t>> packets;
+        packets.swap(watchPackets);
+        lock.unlock();
+        for (auto & pkt : packets){
+            receiveWatch(pkt.data(), pkt.size());
+        }
+        lock.lock();
+    }
+}
+
+//+
+// receiveWatch
+//
+// a watch reply or a notification arrived. Either gives the epoch and
+// version the service is at. If it follows on from what we have the
+// change is applied, otherwise the whole service is fetched again.
+//-
+
+void serviceServer::serviceServerImpl::receiveWatch(uint8_t * buff, int32_t n){
+    packetHeader hdr;
+    if (!parseHeader(buff, n, hdr)) return;
+
+    string name;
+    uint32_t epoch, ver;
+    uint8_t change = 0;
+    serverEntity se;
+
+    packetReader rd(buff, n);
+    if (hdr.opCode == wtchService){
+        epoch = rd.u32();
+        ver = rd.u32();
+        if (!rd.ok()) return;
+        {
+            std::lock_guard<std::mutex> lock(watchLock);
+            auto it = watchRequests.find(hdr.serial);
+            if (it == watchRequests.end()) return;
+            name = it->second;
+            watchRequests.erase(it);
+        }
+    } else if (hdr.opCode == ntfyService){
+        name = rd.name();
+        epoch = rd.align(4).u32();
+        ver = rd.u32();
+        change = rd.u8();
+        if (change != 3) readServer(rd, se);
+        if (!rd.ok()) return;
+    } else {
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(watchLock);
+    auto it = watches.find(name);
+    if (it == watches.end()) return;
+    watch & w = it->second;
+
+    if (hdr.opCode == wtchService){
+        w.nextRenewal = chrono::steady_clock::now() + chrono::milliseconds(WATCHLEASE * 1000 / 3);
+        w.awaitingReply = false;
+    }
+    if (w.synced && epoch == w.epoch && ver <= w.version){
+        // nothing new, or a notification that was overtaken
+        return;
+    }
+    if (!w.synced || epoch != w.epoch || ver != w.version + 1 || change == 0 || change == 3){
+        lock.unlock();
+        resync(name, epoch, ver);
+        return;
+    }
+
+    // the next change in sequence
+    w.version = ver;
+    bool present = false;
+    for (size_t i = 0; i < w.servers.size(); i++){
+        if (w.servers[i].name == se.name && w.servers[i].port == se.port){
+            present = true;
+            if (change == 2){
+                w.servers[i] = w.servers.back();
+                w.servers.pop_back();
+            }
+            break;
+        }
+    }
+    if (change == 1 && !present){
+        w.servers.push_back(se);
+    } else if (!(change == 2 && present)){
+        // already knew, a fetch got there first
+        return;
+    }
+    watchCallback cb = w.callback;
+    lock.unlock();
+    cb(name, change == 1 ? watchEvent::added : watchEvent::removed, se);
+}
+
+//+
+// resync
+//
+// fetch every server for the service and report the differences from
+// what we had. Changes made after the fetch still arrive as
+// notifications and are ignored if the fetch already has them.
+//-
+
+void serviceServer::serviceServerImpl::resync(const string & serviceName, uint32_t epoch, uint32_t ver){
+    vector<serverEntity> current;
+    if (!searchServiceAll(serviceName, current)){
+        // try again soon with another watch request
+        std::lock_guard<std::mutex> lock(watchLock);
+        auto it = watches.find(serviceName);
+        if (it != watches.end()){
+            it->second.nextRenewal = chrono::steady_clock::now() + chrono::seconds(1);
+        }
+        return;
+    }
+
+    vector<pair<watchEvent, serverEntity>> events;
+    watchCallback cb;
+    {
+        std::lock_guard<std::mutex> lock(watchLock);
+        auto it = watches.find(serviceName);
+        if (it == watches.end()) return;
+        watch & w = it->second;
+
+        auto contains = [](const vector<serverEntity> & v, const serverEntity & se){
+            for (auto & s : v){
+                if (s.name == se.name && s.port == se.port) return true;
+            }
+            return false;
+        };
+        for (auto & se : w.servers){
+            if (!contains(current, se)) events.push_back({watchEvent::removed, se});
+        }
+        for (auto & se : current){
+            if (!contains(w.servers, se)) events.push_back({watchEvent::added, se});
+        }
+        w.servers = std::move(current);
+        w.epoch = epoch;
+        w.version = ver;
+        w.synced = true;
+        cb = w.callback;
+    }
+    for (auto & e : events){
+        cb(serviceName, e.first, e.second);
+    }
+}
 
 //+
 // resetServiceServer client stub
@@ -616,7 +1463,6 @@ serverEntity serviceServer::serviceServerImpl::searchService(string serviceName)
 // this packet doesn't have a body, no supplemental data
 //
 // TODO - not implemented yet (mplemented on server side)
-// TODO - update to at least once semantics
 //-
 
 bool serviceServer::serviceServerImpl::resetServiceServer(){
@@ -628,69 +1474,16 @@ bool serviceServer::serviceServerImpl::resetServiceServer(){
     // this message has only a header with the op in it.
     // no other dat.
     
-    if (!setupNetwork()){
-        errno = E_NOSERVER;
-        cerr << "failed to setup Network" << endl;
+    uint32_t recvBuffAligned[RECVBUFFLEN/4];
+    uint8_t * recvBuffer = (uint8_t*)recvBuffAligned;
+    int32_t n = transact(sendBuff, DETAILOFFSET, serialForThisRequest, recvBuffer);
+    if (n < 0){
         return false;
     }
-
-    int numTries = 0;
-    bool completed = false;
-    
-    // TODO need start loop here for at least once semantics
-    
-    // send the packet
-#ifdef DEBUG
-    cout << " -----> sending " << endl;
-#endif
-    
-    int n = sendto(sockfd, (const char *) sendBuff, sizeof(header),
-    MSG_CONFIRM, (const struct sockaddr*)&servaddr, sizeof(servaddr));
-
-#ifdef DEBUG
-    cout << "  sendto returned " << dec << n << endl;
-#endif
-
-    bool gotMessage = true;
-    bool res = false;
-    do {
-        uint32_t recvBuffAligned[1024];
-        uint8_t* recvBuffer = (uint8_t*)recvBuffAligned;
-        static struct sockaddr_in servaddrreply;
-        uint32_t len = sizeof(struct sockaddr_in);
-        memset(&servaddrreply, 0, sizeof(servaddrreply));
-
-        // wait for result from server
-        n = recvfrom(sockfd, (char *) recvBuffer, 1024, MSG_WAITALL,
-            (struct sockaddr*)&servaddrreply, & len);
-
-#ifdef DEBUG
-        cout << " <----- recieved " << n << " bytes back from server" << endl;
-#endif
-        
-        if (n == -1){
-            // if timeout
-        } else {
-            // parse result message
-            header hdr;
-            if (parseHeader(recvBuffer, n, hdr)){
-                // check magic, serial and op
-                if (hdr.magic  == magic && hdr.serial == serialForThisRequest){
-                    if (n > DETAILOFFSET){
-                        gotMessage = true;
-                        res = recvBuffer[DETAILOFFSET];
+    bool res = recvBuffer[DETAILOFFSET];
 #ifdef DEBUG
-                        cout << "  reset Service Server returned " << res << endl;
+    cout << "  reset Service Server returned " << res << endl;
 #endif
-                    }
-                }
-            }
-            // go around again
-        }
-
-    } while(!gotMessage);
-
-    close(sockfd);
 
     errno = 0;
     return res;
@@ -700,16 +1493,22 @@ bool serviceServer::serviceServerImpl::resetServiceServer(){
 // setupNetwork()
 // the evironment variable SERVICEADDR has the form addr::port
 //  example: "localhost:3001"
-// fetch the address and setup the network data structures
+// fetch the address and setup the network data structures.
+// Only the first call does anything, after that the socket is ready.
 //-
 
 bool serviceServer::serviceServerImpl::setupNetwork(){
-    // since we are running on a single node, just need the port
-    // number from the environment.
+    std::lock_guard<std::mutex> lock(netLock);
+    if (addressInitialized){
+        return true;
+    }
+
+    // the directory may be several nodes, any of them will do.
     char* addrStr = getenv("SERVICEADDR");
     if (addrStr == NULL){
         std::cerr << "Must set service server in environment" << std::endl;
         std::cerr << "Example:: export SERVICEADDR=localhost:3001" << std::endl;
+        std::cerr << "     or:: export SERVICEADDR=localhost:3001,localhost:3002" << std::endl;
         return false;
     }
     std::string addrString = string(addrStr);
@@ -718,73 +1517,73 @@ bool serviceServer::serviceServerImpl::setupNetwork(){
     std::cout << "SERVICEADDR environment variable is '" << addrStr << "'" << std::endl;
 #endif
     
-    std::smatch matches;
     std::regex addressPattern("([a-zA-Z0-9]+):([0-9]+)");
-    
-    if (!std::regex_search(addrString, matches, addressPattern)) {
+    auto first = std::sregex_iterator(addrString.begin(), addrString.end(), addressPattern);
+    auto last = std::sregex_iterator();
+    if (first == last) {
         std::cerr << "Server Address must have the form 'serverName:portnum'" << std::endl;
         return false;
     }
-    
+
+    servaddrs.clear();
+    for (auto m = first; m != last; m++){
+        std::smatch matches = *m;
+
 #ifdef DEBUG
-    std::cout << "Server Name: " << matches[1].str() << std::endl;
-    std::cout << "Server Port: " << matches[2].str() << std::endl;
+        std::cout << "Server Name: " << matches[1].str() << std::endl;
+        std::cout << "Server Port: " << matches[2].str() << std::endl;
 #endif
 
-    // use localhost as the server address.
-    serverAddressName = string(matches[1].str());
-    port = std::stoi(matches[2].str());
-    
-    
-    memset(&servaddr, 0, sizeof(servaddr));
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_port = htons(port);
-
-    struct addrinfo * addr_result;
-    struct addrinfo hints;
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_DGRAM;
-    hints.ai_protocol = 0;
-    hints.ai_flags = 0;
-    int errcode = getaddrinfo (serverAddressName.c_str(), nullptr, &hints, &addr_result);
-    if (errcode != 0){
-        cout << "error finding address of " <<   serverAddressName << gai_strerror(errcode) << endl;
+        serverAddressName = string(matches[1].str());
+        port = std::stoi(matches[2].str());
+
+        struct sockaddr_in servaddr;
+        memset(&servaddr, 0, sizeof(servaddr));
+        servaddr.sin_family = AF_INET;
+        servaddr.sin_port = htons(port);
+
+        struct addrinfo * addr_result;
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_DGRAM;
+        int errcode = getaddrinfo (serverAddressName.c_str(), nullptr, &hints, &addr_result);
+        if (errcode != 0){
+            cout << "error finding address of " <<   serverAddressName << gai_strerror(errcode) << endl;
+            continue;
+        }
+        // use the first if there is more than one
+        servaddr.sin_addr = ((sockaddr_in*)addr_result->ai_addr)->sin_addr;
+        freeaddrinfo(addr_result);
+#ifdef DEBUG
+        cout << " address of service dir server is: " << inet_ntoa(servaddr.sin_addr) << ":" << port << endl;
+#endif
+        servaddrs.push_back(servaddr);
+    }
+    if (servaddrs.empty()){
         errno=E_NOSERVER;
         return false;
-    } else {
-	if (addr_result -> ai_next != nullptr){
-	    cout << "More than one result:" << endl;
-	    int count = 0;
-	    addrinfo * rover = addr_result;
-	    while (rover != nullptr){
-		cout << "  " << count++ <<  ": " << inet_ntoa(((sockaddr_in*)rover->ai_addr)->sin_addr)
-		    << endl;
-		rover = rover -> ai_next;
-	    }
-	} 
-	// use the first if there is more than one
-	cout << " address of service dir server is: " << inet_ntoa(((sockaddr_in*)addr_result->ai_addr)->sin_addr) <<endl;
-	servaddr.sin_addr = ((sockaddr_in*)addr_result->ai_addr)->sin_addr;
-	freeaddrinfo(addr_result);
     }
+    // start at a random node so the clients spread out over the nodes.
+    current = std::random_device{}() % servaddrs.size();
     
-    // create socket and set timeout.
+    // create the socket, it is used for every request from now on.
+    // The pipe wakes the receive thread when it is time to stop.
     sockfd = socket(AF_INET, SOCK_DGRAM, 0);
     if (sockfd < 0){
         perror("socket creation failed");
         errno = E_SOCKET;
         return false;
     }
-
-    struct timeval tv;
-    tv.tv_sec = 1;
-    tv.tv_usec = 0;
-    if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv,sizeof(tv)) < 0) {
-        perror("proboem setting timeout");
+    if (pipe(wakePipe) < 0){
+        perror("pipe creation failed");
+        close(sockfd);
         errno = E_SOCKET;
         return false;
     }
 
+    receiveThread = thread(&serviceServerImpl::receiver, this);
+    addressInitialized = true;
     return true;
 }
 
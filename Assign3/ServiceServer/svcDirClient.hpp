@@ -8,6 +8,7 @@
 #include <vector>
 #include <errno.h>
 #include <cstdint>
+#include <functional>
 #include <iostream>
 #include <memory>
 
@@ -19,6 +20,9 @@ namespace svcDir {
 #define E_TIMEOUT 4
 #define E_NOSERVER 5
 #define E_SOCKET 6
+#define E_NOLEASE 7
+#define E_BUSY 8
+#define E_MALFORMED 9
 
 //+
 // a serverEntity is a serverName and a port on that server
@@ -30,14 +34,74 @@ struct serverEntity {
 };
 std::ostream &operator << (std::ostream&s,serverEntity se);
 
+// what happened to a watched service
+enum class watchEvent { added, removed };
+typedef std::function<void(const std::string & serviceName, watchEvent event, const serverEntity & server)> watchCallback;
+
+//+
+// serviceServer
+//
+// registerService can be given a lease in seconds. The directory drops
+// the registration if the lease isn't renewed, this object renews it in
+// the background until removeService is called or it is destroyed.
+// A lease of 0 (the default) never expires.
+//
+// registerService can also be given a weight, a server with weight 2
+// is sent twice as many clients as one with weight 1 (the default).
+// reportLoad gives the directory a figure for how busy the server is
+// (anything the servers of a service agree on, such as requests in
+// progress), searches then favour servers with less load for their
+// weight. The load goes with the next lease renewal, so it can only be
+// reported for a registration with a lease, and a shorter lease
+// reports it sooner.
+//
+// searchServiceAll returns every server for a service and
+// searchServices returns one server for each name given, in the
+// same order, with {None, 0} for services that have no servers.
+// searchServiceAll can't tell a failure from a service with no servers
+// (or, if a later reply is lost, some of them) except by errno; the
+// form that fills in a vector returns false unless it got them all.
+//
+// watchService asks the directory to tell this object about every
+// server added to or removed from a service, so there is no need to
+// poll with searchService. The callback is run on a background thread,
+// first with an added event for each server already registered, and
+// then as changes happen. If a change notification is lost the service
+// is fetched again and only the differences are passed to the callback.
+// The callback must not call watchService or unwatchService.
+//
+// lookupService is searchService through a cache shared by every
+// serviceServer in the process. Services are kept for a few seconds
+// (watched, so changes show up straight away), services with no
+// servers for a second. Use it when a service is looked up often,
+// searchService always asks the directory.
+//
+// SERVICEADDR can list several directory nodes (host:port,host:port).
+// Requests go to one of them and move to the next when it stops
+// answering.
+//
+// A directory with too much to do (or a client searching faster than
+// it allows) answers busy. The request is then sent again after the
+// wait the directory asks for, and fails with errno E_BUSY if it is
+// still busy at the last try.
+//-
+
 class serviceServer{
 public:
     serviceServer();
     ~serviceServer();
-    bool registerService(std::string serviceName, serverEntity &server);
+    bool registerService(std::string serviceName, serverEntity &server, uint32_t leaseSeconds = 0,
+                         uint16_t weight = 1);
+    bool reportLoad(std::string serviceName, serverEntity &server, uint16_t load);
     bool removeService(std::string serviceName, serverEntity &server);
     serverEntity searchService(std::string serviceName);
+    serverEntity lookupService(std::string serviceName);
+    std::vector<serverEntity> searchServiceAll(std::string serviceName);
+    bool searchServiceAll(std::string serviceName, std::vector<serverEntity> & servers);
+    std::vector<serverEntity> searchServices(const std::vector<std::string> & serviceNames);
     bool resetServiceServer();
+    bool watchService(std::string serviceName, watchCallback callback);
+    void unwatchService(std::string serviceName);
 private:
     class serviceServerImpl;
     std::unique_ptr<serviceServerImpl> pImpl;
@@ -0,0 +1,262 @@
+//+
+// File:   svcDirCodec.hpp
+//
+// Reading and writing service directory packets. Used by both the
+// directory server and svcDirClient so the two can't drift apart.
+//
+// packetReader reads the fields of a received packet in order without
+// copying anything: names come back as string_views into the packet,
+// so they are only good while the buffer is. Every read is checked
+// against the length of the packet. A read that would go past the end
+// returns 0 (or an empty name) and fails the reader, and every read
+// after it fails too, so a handler can read all of its fields and then
+// test ok() once. Multi-byte fields are loaded with memcpy, which works
+// on any alignment and compiles to a single load.
+//
+// packetWriter is the same for building packets, a write that doesn't
+// fit in the buffer is dropped and fails the writer. Padding is zeroed.
+//
+// Names are a length byte and the data with no null. A serverEntity is
+// a name, padded to 2 bytes, then the port. All numbers are big endian.
+//
+// Everything here is inline, with no state outside the reader or
+// writer, so any bytes at all can be handed to a reader (see the fuzz
+// mode of codecBench.cpp).
+//-
+
+#ifndef __SVCDIRCODEC_H__
+#define __SVCDIRCODEC_H__
+
+#include <arpa/inet.h>
+
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+namespace svcCodec {
+
+// packet header
+constexpr uint32_t PACKETMAGIC    = 'S' << 24 | 'R' << 16 | 'V' << 8 | 'C';
+constexpr uint16_t PACKETVERSION  = 0x1000;
+constexpr uint32_t VERSIONOFFSET  = 4;
+constexpr uint32_t OPOFFSET       = 6;
+constexpr uint32_t SERIALOFFSET   = 8;
+constexpr uint32_t DETAILOFFSET   = 12;
+
+// longest names
+constexpr uint32_t MAXSERVICENAME = 63;
+constexpr uint32_t MAXSERVERNAME  = 63;
+// a serverEntity at its longest: length, name, pad and port
+constexpr uint32_t MAXSERVERLEN   = 1 + MAXSERVERNAME + 2;
+
+// round pos up to a multiple of to (a power of 2)
+constexpr uint32_t alignTo(uint32_t pos, uint32_t to){
+    return (pos + to - 1) & ~(to - 1);
+}
+
+static_assert(alignTo(DETAILOFFSET + 1 + MAXSERVICENAME, 4) == DETAILOFFSET + 64, "service name pads to 64");
+
+inline uint16_t load16(const uint8_t * p){
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return ntohs(v);
+}
+
+inline uint32_t load32(const uint8_t * p){
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return ntohl(v);
+}
+
+inline void store16(uint8_t * p, uint16_t v){
+    v = htons(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+inline void store32(uint8_t * p, uint32_t v){
+    v = htonl(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+// the header fields, as numbers
+struct packetHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t opCode;
+    uint32_t serial;
+};
+
+// false if the packet is too short for a header, magic and version are
+// left to the caller to check.
+inline bool readHeader(const uint8_t * buffer, uint32_t len, packetHeader & hdr){
+    if (len < DETAILOFFSET) return false;
+    hdr.magic = load32(buffer);
+    hdr.version = load16(buffer + VERSIONOFFSET);
+    hdr.opCode = load16(buffer + OPOFFSET);
+    hdr.serial = load32(buffer + SERIALOFFSET);
+    return true;
+}
+
+inline void writeHeader(uint8_t * buffer, uint16_t opCode, uint32_t serial){
+    store32(buffer, PACKETMAGIC);
+    store16(buffer + VERSIONOFFSET, PACKETVERSION);
+    store16(buffer + OPOFFSET, opCode);
+    store32(buffer + SERIALOFFSET, serial);
+}
+
+class packetReader {
+public:
+    // read from pos, which is normally just after the header.
+    packetReader(const uint8_t * buffer, uint32_t len, uint32_t pos = DETAILOFFSET)
+        : buffer(buffer), len(len), at(pos) {}
+
+    bool ok() const { return good; }
+    uint32_t pos() const { return at; }
+    // true if n more bytes are there, for optional fields at the end.
+    // Doesn't fail the reader.
+    bool has(uint32_t n) const { return good && at <= len && n <= len - at; }
+
+    // skip the padding up to a multiple of to. May go past the end,
+    // the next read then fails.
+    packetReader & align(uint32_t to){
+        at = alignTo(at, to);
+        return *this;
+    }
+
+    uint8_t u8(){
+        if (!need(1)) return 0;
+        return buffer[at++];
+    }
+
+    uint16_t u16(){
+        if (!need(2)) return 0;
+        uint16_t v = load16(buffer + at);
+        at += 2;
+        return v;
+    }
+
+    uint32_t u32(){
+        if (!need(4)) return 0;
+        uint32_t v = load32(buffer + at);
+        at += 4;
+        return v;
+    }
+
+    uint64_t u64(){
+        uint64_t high = u32();
+        return (high << 32) | u32();
+    }
+
+    // length byte and data
+    std::string_view name(){
+        uint8_t nameLen = u8();
+        if (!need(nameLen)) return std::string_view();
+        std::string_view v((const char*)(buffer + at), nameLen);
+        at += nameLen;
+        return v;
+    }
+
+    // a serverEntity
+    std::string_view server(uint16_t & port){
+        std::string_view serverName = name();
+        align(2);
+        port = u16();
+        return serverName;
+    }
+
+private:
+    const uint8_t * buffer;
+    uint32_t len;
+    uint32_t at;
+    bool good = true;
+
+    bool need(uint32_t n){
+        if (good && at <= len && n <= len - at) return true;
+        good = false;
+        return false;
+    }
+};
+
+class packetWriter {
+public:
+    // write from pos, which is normally just after the header.
+    packetWriter(uint8_t * buffer, uint32_t capacity, uint32_t pos = DETAILOFFSET)
+        : buffer(buffer), capacity(capacity), at(pos) {}
+
+    bool ok() const { return good; }
+    // where the next field goes, the packet length when done.
+    uint32_t pos() const { return at; }
+    // true if n more bytes fit. Doesn't fail the writer.
+    bool fits(uint32_t n) const { return good && at <= capacity && n <= capacity - at; }
+
+    // zero pad to a multiple of to
+    packetWriter & align(uint32_t to){
+        uint32_t end = alignTo(at, to);
+        if (need(end - at)){
+            while (at < end){
+                buffer[at++] = 0;
+            }
+        }
+        return *this;
+    }
+
+    packetWriter & u8(uint8_t v){
+        if (need(1)) buffer[at++] = v;
+        return *this;
+    }
+
+    packetWriter & u16(uint16_t v){
+        if (need(2)){
+            store16(buffer + at, v);
+            at += 2;
+        }
+        return *this;
+    }
+
+    packetWriter & u32(uint32_t v){
+        if (need(4)){
+            store32(buffer + at, v);
+            at += 4;
+        }
+        return *this;
+    }
+
+    packetWriter & u64(uint64_t v){
+        return u32(v >> 32).u32(v & 0xFFFFFFFF);
+    }
+
+    // names longer than 255 can't be written
+    packetWriter & name(std::string_view v){
+        if (v.length() > 0xFF){
+            good = false;
+            return *this;
+        }
+        if (need(1 + v.length())){
+            buffer[at++] = v.length();
+            memcpy(buffer + at, v.data(), v.length());
+            at += v.length();
+        }
+        return *this;
+    }
+
+    // a serverEntity
+    packetWriter & server(std::string_view serverName, uint16_t port){
+        return name(serverName).align(2).u16(port);
+    }
+
+private:
+    uint8_t * buffer;
+    uint32_t capacity;
+    uint32_t at;
+    bool good = true;
+
+    bool need(uint32_t n){
+        if (good && at <= capacity && n <= capacity - at) return true;
+        good = false;
+        return false;
+    }
+};
+
+}
+
+#endif
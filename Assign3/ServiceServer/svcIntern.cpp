@@ -0,0 +1,147 @@
+//+
+// File:   svcIntern.cpp
+//
+// Implementation of the interned name table.
+//-
+
+#include <iostream>
+
+#include "svcIntern.hpp"
+
+using namespace std;
+
+nameTable::nameTable(uint32_t numShards)
+    : numShards(numShards), shards(new shard[numShards]) {
+}
+
+nameTable::shard & nameTable::shardFor(string_view name) const {
+    return shards[hash<string_view>()(name) % numShards];
+}
+
+//+
+// intern
+//
+// most calls find the name already there and only take the shard's
+// read lock. A new name takes the write lock, looks again in case
+// another thread added it meanwhile, and gets an id.
+//-
+
+uint32_t nameTable::intern(string_view name){
+    shard & s = shardFor(name);
+    {
+        shared_lock<shared_mutex> lock(s.lock);
+        auto it = s.ids.find(name);
+        if (it != s.ids.end()){
+            // sweep can't free it, that needs the write lock.
+            at(it->second).refs.fetch_add(1, memory_order_relaxed);
+            return it->second;
+        }
+    }
+    unique_lock<shared_mutex> lock(s.lock);
+    auto it = s.ids.find(name);
+    if (it != s.ids.end()){
+        at(it->second).refs.fetch_add(1, memory_order_relaxed);
+        return it->second;
+    }
+    uint32_t id = allocate(name);
+    if (id == NONAME){
+        cerr << "name table full" << endl;
+        abort();
+    }
+    // the key is the table's own copy of the name
+    s.ids.emplace(at(id).text, id);
+    return id;
+}
+
+// an id for a new name with one reference, called with the name's
+// shard write locked.
+uint32_t nameTable::allocate(string_view name){
+    lock_guard<mutex> guard(allocLock);
+    uint32_t id;
+    if (!freeIds.empty()){
+        id = freeIds.back();
+        freeIds.pop_back();
+    } else {
+        if (nextId == MAXCHUNKS * CHUNKSIZE) return NONAME;
+        id = nextId++;
+        if (!chunks[id / CHUNKSIZE]){
+            chunks[id / CHUNKSIZE].reset(new entry[CHUNKSIZE]);
+        }
+    }
+    entry & e = at(id);
+    e.text.assign(name);
+    e.refs.store(1, memory_order_relaxed);
+    live++;
+    return id;
+}
+
+uint32_t nameTable::find(string_view name) const {
+    shard & s = shardFor(name);
+    shared_lock<shared_mutex> lock(s.lock);
+    auto it = s.ids.find(name);
+    return it == s.ids.end() ? NONAME : it->second;
+}
+
+void nameTable::hold(uint32_t id){
+    at(id).refs.fetch_add(1, memory_order_relaxed);
+}
+
+void nameTable::release(uint32_t id){
+    if (at(id).refs.fetch_sub(1, memory_order_acq_rel) == 1){
+        lock_guard<mutex> guard(pendingLock);
+        pending.push_back(id);
+    }
+}
+
+//+
+// sweep
+//
+// an id can be taken again between its count reaching 0 and sweep
+// getting to it, or appear twice in pending, so each is checked again
+// with its shard write locked before it is freed.
+//-
+
+void nameTable::sweep(){
+    vector<uint32_t> check;
+    {
+        lock_guard<mutex> guard(pendingLock);
+        check.swap(pending);
+    }
+    for (uint32_t id : check){
+        entry & e = at(id);
+        // nobody holds it so the text can't change under us
+        shard & s = shardFor(e.text);
+        unique_lock<shared_mutex> lock(s.lock);
+        if (e.refs.load(memory_order_acquire) != 0) continue;
+        auto it = s.ids.find(e.text);
+        if (it == s.ids.end() || it->second != id) continue;
+        s.ids.erase(it);
+
+        lock_guard<mutex> guard(allocLock);
+        e.text.clear();
+        e.text.shrink_to_fit();
+        freeIds.push_back(id);
+        live--;
+    }
+}
+
+uint32_t nameTable::size() const {
+    return live;
+}
+
+uint64_t nameTable::bytes() const {
+    uint64_t total = numShards * sizeof(shard) + sizeof(chunks);
+    for (uint32_t i = 0; i < numShards; i++){
+        shared_lock<shared_mutex> lock(shards[i].lock);
+        const auto & ids = shards[i].ids;
+        total += ids.bucket_count() * sizeof(void*) + ids.size() * (sizeof(*ids.begin()) + 2 * sizeof(void*));
+        for (auto & [text, id] : ids){
+            total += heapBytes(at(id).text);
+        }
+    }
+    lock_guard<mutex> guard(allocLock);
+    for (uint32_t c = 0; c < MAXCHUNKS && chunks[c]; c++){
+        total += CHUNKSIZE * sizeof(entry);
+    }
+    return total;
+}
@@ -0,0 +1,101 @@
+//+
+// File:   svcIntern.hpp
+//
+// Interned names for the service registry.
+//
+// Every service and server name the registry holds is kept once here
+// and referred to everywhere else by a 32 bit id, so a host that serves
+// fifty services has its name stored once rather than fifty times, and
+// the registry compares ids instead of strings.
+//
+// Ids are counted references. Whatever holds an id (a server entry, a
+// lease timer, a tombstone) took a reference when it got it and gives
+// it back when it is dropped. Names nobody holds are freed by sweep
+// (called once a second with the lease expiry) and their ids reused.
+//
+// The names are in fixed size chunks that never move, so name(id) is a
+// plain array lookup with no locking. It is only safe for an id the
+// caller (or something it has locked) holds a reference to. Finding the
+// id for a name goes through a hash index split into shards, each with
+// its own reader/writer lock.
+//-
+
+#ifndef __SVCINTERN_H__
+#define __SVCINTERN_H__
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+class nameTable {
+public:
+    static constexpr uint32_t NONAME = UINT32_MAX;
+
+    explicit nameTable(uint32_t numShards = 16);
+
+    // the id for name, adding it if it is new, with a reference taken.
+    uint32_t intern(std::string_view name);
+    // the id for name without taking a reference, NONAME if there
+    // isn't one. Only useful while something else holds it.
+    uint32_t find(std::string_view name) const;
+    // another reference to an id the caller already holds.
+    void hold(uint32_t id);
+    // give a reference back.
+    void release(uint32_t id);
+
+    std::string_view name(uint32_t id) const {
+        return chunks[id / CHUNKSIZE][id % CHUNKSIZE].text;
+    }
+
+    // free the names nobody holds any more.
+    void sweep();
+
+    // names held, and an estimate of the memory used.
+    uint32_t size() const;
+    uint64_t bytes() const;
+
+    // heap used by a string, nothing if it is short enough to be kept
+    // inside the string itself.
+    static size_t heapBytes(const std::string & str){
+        const char * self = (const char*)&str;
+        if (str.data() >= self && str.data() < self + sizeof(str)) return 0;
+        return str.capacity() + 1;
+    }
+
+private:
+    static constexpr uint32_t CHUNKSIZE = 4096;
+    static constexpr uint32_t MAXCHUNKS = 4096;
+
+    struct entry {
+        std::string text;
+        std::atomic<uint32_t> refs{0};
+    };
+    struct shard {
+        mutable std::shared_mutex lock;
+        std::unordered_map<std::string_view, uint32_t> ids;
+    };
+
+    uint32_t numShards;
+    std::unique_ptr<shard[]> shards;
+    // chunks are only ever added, under allocLock
+    std::unique_ptr<entry[]> chunks[MAXCHUNKS];
+    mutable std::mutex allocLock;
+    uint32_t nextId = 0;
+    std::vector<uint32_t> freeIds;
+    std::atomic<uint32_t> live{0};
+    // ids whose count reached 0, for sweep to look at
+    std::mutex pendingLock;
+    std::vector<uint32_t> pending;
+
+    shard & shardFor(std::string_view name) const;
+    entry & at(uint32_t id) const { return chunks[id / CHUNKSIZE][id % CHUNKSIZE]; }
+    uint32_t allocate(std::string_view name);
+};
+
+#endif
@@ -0,0 +1,326 @@
+//+
+// File:   svcLog.cpp
+//
+// Ring buffers and the drain thread for the asynchronous logger.
+//
+// Approach:
+//   Every thread that logs gets its own ring the first time it calls
+//   claim. The ring is added to a global list (the only place a lock is
+//   taken). The drain thread walks the list, formats any committed
+//   records and writes them with one fwrite per pass. When a thread
+//   exits its ring is marked closed and the drain thread removes it
+//   once it is empty.
+//-
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <time.h>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "svcLog.hpp"
+
+using namespace std;
+
+namespace svcLog {
+
+// number of records in each ring, must be a power of 2
+#define RINGSIZE 1024
+
+std::atomic<uint8_t> currentLevel{lvlInfo};
+
+static const char * levelNames[] = { "TRACE", "DEBUG", "INFO", "WARN", "ERROR", "OFF" };
+
+//+
+// ring
+//
+// single producer, single consumer. head is only written by the
+// producer and tail only by the consumer. They are kept on separate
+// cache lines so the two threads don't fight over them.
+//-
+
+struct ring {
+    alignas(64) std::atomic<uint64_t> head{0};
+    alignas(64) std::atomic<uint64_t> tail{0};
+    alignas(64) std::atomic<bool> closed{false};
+    record records[RINGSIZE];
+};
+
+static std::mutex ringsMutex;
+static std::vector<std::shared_ptr<ring>> rings;
+static std::atomic<uint64_t> droppedCount{0};
+static std::atomic<bool> running{false};
+static std::thread drainThread;
+
+// per thread handle on the ring. The destructor runs at thread exit.
+struct ringHolder {
+    std::shared_ptr<ring> r;
+    ~ringHolder(){
+        if (r) r->closed.store(true, std::memory_order_release);
+    }
+};
+static thread_local ringHolder myRing;
+
+static ring * getRing(){
+    if (!myRing.r){
+        myRing.r = make_shared<ring>();
+        std::lock_guard<std::mutex> lock(ringsMutex);
+        rings.push_back(myRing.r);
+    }
+    return myRing.r.get();
+}
+
+record * claim(){
+    ring * r = getRing();
+    uint64_t head = r->head.load(std::memory_order_relaxed);
+    if (head - r->tail.load(std::memory_order_acquire) >= RINGSIZE){
+        droppedCount.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    record * rec = &r->records[head & (RINGSIZE - 1)];
+    rec->timestamp = chrono::duration_cast<chrono::nanoseconds>(
+        chrono::system_clock::now().time_since_epoch()).count();
+    return rec;
+}
+
+void commit(){
+    ring * r = myRing.r.get();
+    r->head.store(r->head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+//+
+// level control
+//-
+
+void setLevel(level l){
+    currentLevel.store(l, std::memory_order_relaxed);
+}
+
+level getLevel(){
+    return (level)currentLevel.load(std::memory_order_relaxed);
+}
+
+bool setLevel(const std::string & name){
+    for (int i = lvlTrace; i <= lvlOff; i++){
+        if (strcasecmp(name.c_str(), levelNames[i]) == 0){
+            setLevel((level)i);
+            return true;
+        }
+    }
+    if (strcasecmp(name.c_str(), "warning") == 0){
+        setLevel(lvlWarn);
+        return true;
+    }
+    return false;
+}
+
+void moreVerbose(){
+    uint8_t l = currentLevel.load(std::memory_order_relaxed);
+    if (l > lvlTrace) currentLevel.store(l - 1, std::memory_order_relaxed);
+}
+
+void lessVerbose(){
+    uint8_t l = currentLevel.load(std::memory_order_relaxed);
+    if (l < lvlOff) currentLevel.store(l + 1, std::memory_order_relaxed);
+}
+
+uint64_t dropped(){
+    return droppedCount.load(std::memory_order_relaxed);
+}
+
+//+
+// format
+//
+// append one formatted line for the record to out.
+// each {} in the format string is replaced by the next argument, or
+// by {?} if the argument was cut off because the record filled up.
+//-
+
+static void format(const record & r, string & out){
+    char tbuf[64];
+    time_t secs = r.timestamp / 1000000000ull;
+    struct tm tm;
+    localtime_r(&secs, &tm);
+    size_t tl = strftime(tbuf, sizeof(tbuf), "%H:%M:%S", &tm);
+    snprintf(tbuf + tl, sizeof(tbuf) - tl, ".%06u %-5s ",
+        (unsigned)((r.timestamp / 1000) % 1000000), levelNames[r.lvl < lvlOff ? r.lvl : lvlOff]);
+    out += tbuf;
+
+    uint32_t pos = 0;
+    int arg = 0;
+    for (const char * f = r.fmt; *f; f++){
+        if (f[0] != '{' || f[1] != '}' || arg >= r.nargs){
+            out += *f;
+            continue;
+        }
+        f++;
+        char nbuf[32];
+        switch (r.types[arg++]){
+            case argInt: {
+                int64_t i;
+                if (pos + sizeof(i) > r.used){
+                    out += "{?}";
+                    break;
+                }
+                memcpy(&i, r.payload + pos, sizeof(i));
+                pos += sizeof(i);
+                snprintf(nbuf, sizeof(nbuf), "%lld", (long long)i);
+                out += nbuf;
+                break;
+            }
+            case argUint: {
+                uint64_t u;
+                if (pos + sizeof(u) > r.used){
+                    out += "{?}";
+                    break;
+                }
+                memcpy(&u, r.payload + pos, sizeof(u));
+                pos += sizeof(u);
+                snprintf(nbuf, sizeof(nbuf), "%llu", (unsigned long long)u);
+                out += nbuf;
+                break;
+            }
+            case argDouble: {
+                double d;
+                if (pos + sizeof(d) > r.used){
+                    out += "{?}";
+                    break;
+                }
+                memcpy(&d, r.payload + pos, sizeof(d));
+                pos += sizeof(d);
+                snprintf(nbuf, sizeof(nbuf), "%g", d);
+                out += nbuf;
+                break;
+            }
+            case argString: {
+                if (pos >= r.used){
+                    out += "{?}";
+                    break;
+                }
+                uint32_t len = r.payload[pos++];
+                if (pos + len > r.used) len = r.used - pos;
+                out.append((const char *)r.payload + pos, len);
+                pos += len;
+                break;
+            }
+            case argChar:
+                if (pos >= r.used){
+                    out += "{?}";
+                    break;
+                }
+                out += (char)r.payload[pos++];
+                break;
+        }
+    }
+    out += '\n';
+}
+
+//+
+// drainOnce
+//
+// format everything that has been committed in all rings and write it.
+// returns the number of records written.
+//-
+
+static size_t drainOnce(string & out){
+    vector<std::shared_ptr<ring>> current;
+    {
+        std::lock_guard<std::mutex> lock(ringsMutex);
+        current = rings;
+    }
+
+    // collect the committed records from every ring and put them
+    // in time order so lines from different threads interleave properly.
+    static vector<const record *> pending;
+    vector<uint64_t> heads(current.size());
+    pending.clear();
+    for (size_t i = 0; i < current.size(); i++){
+        ring * r = current[i].get();
+        uint64_t tail = r->tail.load(std::memory_order_relaxed);
+        heads[i] = r->head.load(std::memory_order_acquire);
+        for (; tail != heads[i]; tail++){
+            pending.push_back(&r->records[tail & (RINGSIZE - 1)]);
+        }
+    }
+    sort(pending.begin(), pending.end(), [](const record * a, const record * b){
+        return a->timestamp < b->timestamp;
+    });
+
+    size_t count = pending.size();
+    out.clear();
+    for (const record * rec : pending){
+        format(*rec, out);
+    }
+    // only now can the producers reuse the slots.
+    for (size_t i = 0; i < current.size(); i++){
+        current[i]->tail.store(heads[i], std::memory_order_release);
+    }
+
+    if (!out.empty()){
+        fwrite(out.data(), 1, out.length(), stderr);
+        fflush(stderr);
+    }
+
+    // forget rings whose threads have gone and that are now empty.
+    std::lock_guard<std::mutex> lock(ringsMutex);
+    for (auto it = rings.begin(); it != rings.end();){
+        ring * r = it->get();
+        if (r->closed.load(std::memory_order_acquire)
+            && r->tail.load(std::memory_order_relaxed) == r->head.load(std::memory_order_acquire)){
+            it = rings.erase(it);
+        } else {
+            it++;
+        }
+    }
+    return count;
+}
+
+static void drainLoop(){
+    string out;
+    int idle = 0;
+    while (running.load(std::memory_order_acquire)){
+        if (drainOnce(out) > 0){
+            idle = 0;
+        } else {
+            // back off while nothing is being logged.
+            if (idle < 10) idle++;
+            this_thread::sleep_for(chrono::milliseconds(idle));
+        }
+    }
+    drainOnce(out);
+}
+
+void start(){
+    char * lvl = getenv("SVCLOG_LEVEL");
+    if (lvl != NULL && !setLevel(string(lvl))){
+        fprintf(stderr, "SVCLOG_LEVEL '%s' not recognized, using %s\n",
+            lvl, levelNames[getLevel()]);
+    }
+    if (running.exchange(true)) return;
+    drainThread = thread(drainLoop);
+
+    // make sure the last records get out if main returns without calling stop.
+    static bool registered = false;
+    if (!registered){
+        registered = true;
+        atexit(stop);
+    }
+}
+
+void stop(){
+    if (!running.exchange(false)) return;
+    drainThread.join();
+    uint64_t d = dropped();
+    if (d > 0){
+        fprintf(stderr, "svcLog: %llu records dropped\n", (unsigned long long)d);
+    }
+}
+
+}
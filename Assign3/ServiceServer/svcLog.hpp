@@ -0,0 +1,171 @@
+//+
+// File:   svcLog.hpp
+//
+// Asynchronous logging for the service directory and the servers that
+// use it.
+//
+// A log call does not format anything. It copies the format string
+// pointer and the raw argument values into a fixed size record in a
+// ring buffer owned by the calling thread. A background thread drains
+// all of the rings, does the formatting and writes the lines to stderr.
+//
+// Each ring has a single producer (its thread) and a single consumer
+// (the drain thread) so no locks are needed on the logging path. If a
+// ring is full the record is dropped and counted rather than blocking
+// the caller.
+//
+// Use the SVCLOG macro rather than calling write directly, the level
+// test is done before any of the arguments are evaluated:
+//
+//    SVCLOG(svcLog::lvlDebug, "Adding {} -> ({},{})", svcName, name, port);
+//
+// Format strings must be string literals (only the pointer is stored)
+// and use {} for each argument.
+//-
+
+#ifndef __SVCLOG_H__
+#define __SVCLOG_H__
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+namespace svcLog {
+
+// log levels, a record is kept if its level is >= the current level.
+enum level : uint8_t { lvlTrace = 0, lvlDebug, lvlInfo, lvlWarn, lvlError, lvlOff };
+
+// current level, relaxed reads are enough. It is a global
+// so that the enabled test can be inlined into the caller.
+extern std::atomic<uint8_t> currentLevel;
+
+inline bool enabled(level l){
+    return l >= currentLevel.load(std::memory_order_relaxed);
+}
+
+void setLevel(level l);
+level getLevel();
+// parse "trace", "debug", "info", "warn", "error" or "off".
+bool setLevel(const std::string & name);
+// move one step more (or less) verbose, safe to call from a signal handler.
+void moreVerbose();
+void lessVerbose();
+
+// start the drain thread. The level is taken from the SVCLOG_LEVEL
+// environment variable if it is set. stop flushes everything that
+// has been logged and joins the drain thread.
+void start();
+void stop();
+
+// number of records dropped because a ring was full.
+uint64_t dropped();
+
+//+
+// record layout
+//
+// Records are fixed size so that the ring is a simple array. The
+// payload holds the arguments back to back, numbers as 8 bytes
+// and strings as a length byte followed by the characters.
+// Strings that do not fit are truncated.
+//-
+
+#define SVCLOG_RECORDSIZE  256
+#define SVCLOG_MAXARGS     8
+
+enum argType : uint8_t { argInt = 1, argUint, argDouble, argString, argChar };
+
+struct record {
+    uint64_t timestamp;            // nanoseconds since the epoch
+    const char * fmt;              // format string (string literal)
+    uint8_t lvl;
+    uint8_t nargs;
+    uint8_t types[SVCLOG_MAXARGS];
+    uint16_t used;                 // bytes used in payload
+    uint8_t payload[SVCLOG_RECORDSIZE - 28];
+};
+static_assert(sizeof(record) == SVCLOG_RECORDSIZE, "log record size");
+
+//+
+// argument encoding
+//
+// encodeArg picks the encoding from the argument type at compile
+// time. All of them just copy bytes into the record payload.
+//-
+
+// a number that doesn't fit is left out whole, so the ones after it
+// still line up; format prints {?} for it.
+inline void putBytes(record & r, const void * p, size_t len){
+    if (r.used + len > sizeof(r.payload)) return;
+    memcpy(r.payload + r.used, p, len);
+    r.used += len;
+}
+
+inline void putString(record & r, const char * s, size_t len){
+    size_t room = sizeof(r.payload) - r.used;
+    if (room == 0) return;
+    if (len > 255) len = 255;
+    if (len > room - 1) len = room - 1;
+    r.payload[r.used++] = (uint8_t)len;
+    memcpy(r.payload + r.used, s, len);
+    r.used += len;
+}
+
+template <typename T>
+inline void encodeArg(record & r, const T & v){
+    if (r.nargs >= SVCLOG_MAXARGS) return;
+    if constexpr (std::is_same_v<T, char>){
+        r.types[r.nargs++] = argChar;
+        putBytes(r, &v, 1);
+    } else if constexpr (std::is_same_v<T, bool>){
+        uint64_t u = v;
+        r.types[r.nargs++] = argUint;
+        putBytes(r, &u, sizeof(u));
+    } else if constexpr (std::is_integral_v<T> || std::is_enum_v<T>){
+        if constexpr (std::is_signed_v<T>){
+            int64_t i = (int64_t)v;
+            r.types[r.nargs++] = argInt;
+            putBytes(r, &i, sizeof(i));
+        } else {
+            uint64_t u = (uint64_t)v;
+            r.types[r.nargs++] = argUint;
+            putBytes(r, &u, sizeof(u));
+        }
+    } else if constexpr (std::is_floating_point_v<T>){
+        double d = v;
+        r.types[r.nargs++] = argDouble;
+        putBytes(r, &d, sizeof(d));
+    } else if constexpr (std::is_convertible_v<T, std::string_view>){
+        std::string_view sv = v;
+        r.types[r.nargs++] = argString;
+        putString(r, sv.data(), sv.length());
+    } else {
+        static_assert(sizeof(T) == 0, "unsupported svcLog argument type");
+    }
+}
+
+// get a free record in this threads ring, nullptr if the ring is full.
+record * claim();
+// publish the record returned by claim.
+void commit();
+
+template <typename... Args>
+void write(level l, const char * fmt, const Args &... args){
+    record * r = claim();
+    if (r == nullptr) return;
+    r->lvl = l;
+    r->fmt = fmt;
+    r->nargs = 0;
+    r->used = 0;
+    (encodeArg(*r, args), ...);
+    commit();
+}
+
+}
+
+#define SVCLOG(lvl, ...) \
+    do { if (svcLog::enabled(lvl)) svcLog::write(lvl, __VA_ARGS__); } while (0)
+
+#endif
@@ -0,0 +1,482 @@
+//+
+// File:   svcRegistry.cpp
+//
+// Implementation of the sharded service dictionary.
+//-
+
+#include <iterator>
+#include <mutex>
+#include <random>
+
+#include "svcRegistry.hpp"
+
+using namespace std;
+
+// The generator is per thread since the registry is used by
+// several threads at once.
+static uint64_t randomBits(){
+    static thread_local std::mt19937_64 gen(std::random_device{}());
+    return gen();
+}
+
+serviceRegistry::serviceRegistry(uint32_t numShards)
+    : numShards(numShards), shards(new shard[numShards]),
+      startTime(chrono::steady_clock::now()) {
+}
+
+serviceRegistry::shard & serviceRegistry::shardFor(string_view svcName) const {
+    return shards[hash<string_view>()(svcName) % numShards];
+}
+
+// the lease clock starts at 1 so that an expiry of 0 can mean no lease.
+uint32_t serviceRegistry::now() const {
+    return chrono::duration_cast<chrono::seconds>(chrono::steady_clock::now() - startTime).count() + 1;
+}
+
+//+
+// add
+//
+// append the server to the service vector and remember where it is.
+// If the server is already there only its lease is updated. A new
+// wheel entry is only needed when the server had no lease before or
+// the lease got shorter, otherwise the existing entry will find the
+// new expiry time when it comes due.
+//
+// A renewal is the common case, it finds the server's name id without
+// taking a reference (the server entry already holds one, and can't
+// go while the shard is locked). Only a new server interns its name.
+//-
+
+bool serviceRegistry::add(const string & svcName, const serverEntity & server, uint32_t leaseSeconds,
+                          uint64_t stamp, uint16_t weight, uint16_t load, bool * passOn){
+    if (passOn != nullptr) *passOn = false;
+    uint32_t tick = now();
+    // one extra tick since now() is rounded down, a lease is never cut short.
+    uint32_t expiry = leaseSeconds == 0 ? 0 : tick + leaseSeconds + 1;
+    shard & s = shardFor(svcName);
+    unique_lock<shared_mutex> lock(s.lock);
+
+    auto svcIt = s.services.find(svcName);
+    uint32_t nameId = names.find(server.name);
+    if (stamp != 0 && !s.tombstones.empty() && nameId != nameTable::NONAME){
+        // a tombstone holds both names, so if there is one the ids are found.
+        uint32_t svcId = svcIt != s.services.end() ? svcIt->second.svcId : names.find(svcName);
+        if (olderThanTombstone(s, regKey{svcId, nameId, server.port}, stamp)) return false;
+    }
+
+    if (svcIt == s.services.end()){
+        svcIt = s.services.try_emplace(svcName).first;
+        svcIt->second.svcId = names.intern(svcName);
+    }
+    endpointSet & set = svcIt->second;
+
+    auto it = nameId == nameTable::NONAME ? set.index.end() : set.index.find(serverKey(nameId, server.port));
+    bool inserted = it == set.index.end();
+    uint32_t pos;
+    if (inserted){
+        // the server entry's reference
+        nameId = names.intern(server.name);
+        pos = set.servers.size();
+        set.index.emplace(serverKey(nameId, server.port), pos);
+        set.servers.push_back(endpoint{nameId, server.port, 0});
+        set.info.push_back(endpointInfo{stamp, 0, 0, 0, DEFAULTWEIGHT});
+        if (observer) observer(svcName, true, server);
+    } else {
+        pos = it->second;
+        if (stamp != 0 && set.info[pos].stamp >= stamp) return false;
+    }
+    endpointInfo & info = set.info[pos];
+    info.stamp = stamp;
+    uint16_t oldLoad = set.servers[pos].load;
+    bool reweighted = setLoad(set, pos, weight, load);
+    if (set.weighted != 0 && (inserted || reweighted)){
+        buildAlias(set);
+    } else if (set.weighted == 0 && !set.alias.empty()){
+        set.alias.clear();
+    }
+    if (!s.tombstones.empty()){
+        unbury(s, regKey{set.svcId, nameId, server.port});
+    }
+    if (expiry != 0 && (info.expiry == 0 || expiry < info.expiry)){
+        info.leaseGen = s.nextGen++;
+        names.hold(set.svcId);
+        names.hold(nameId);
+        s.wheel.schedule(expiry, leaseEntry{set.svcId, nameId, info.leaseGen, server.port});
+    }
+    info.expiry = expiry;
+
+    // what the others hold must not run out before the lease here does
+    bool share = passOn == nullptr || inserted || reweighted || load != oldLoad
+        || (expiry == 0) != (info.sharedExpiry == 0) || expiry < info.sharedExpiry
+        || (expiry != 0 && info.sharedExpiry <= tick + leaseSeconds / 2);
+    if (share){
+        info.sharedExpiry = expiry;
+        if (passOn != nullptr) *passOn = true;
+    }
+    return inserted;
+}
+
+//+
+// removeAt
+//
+// move the last server into the slot of the one being removed so
+// the vector never has holes. Services with no servers left are
+// dropped so the map doesn't grow forever. Any wheel entry for the
+// server is left behind, it is ignored when it comes due because
+// the server can't be found.
+//-
+
+void serviceRegistry::removeAt(shard & s, serviceMap::iterator svcIt, uint32_t pos){
+    endpointSet & set = svcIt->second;
+    endpoint ep = set.servers[pos];
+    if (observer) observer(svcIt->first, false, serverEntity{string(names.name(ep.name)), ep.port});
+    setLoad(set, pos, DEFAULTWEIGHT, 0);
+    set.index.erase(serverKey(ep.name, ep.port));
+    uint32_t last = set.servers.size() - 1;
+    if (pos != last){
+        set.servers[pos] = set.servers[last];
+        set.info[pos] = set.info[last];
+        set.index[serverKey(set.servers[pos].name, set.servers[pos].port)] = pos;
+    }
+    set.servers.pop_back();
+    set.info.pop_back();
+    names.release(ep.name);
+
+    if (set.servers.empty()){
+        names.release(set.svcId);
+        s.services.erase(svcIt);
+    } else if (set.weighted != 0){
+        // the positions have changed
+        buildAlias(set);
+    } else {
+        set.alias.clear();
+    }
+}
+
+// set a server's weight and load, keeping the counts for the service
+// right. Returns true if the weight changed.
+bool serviceRegistry::setLoad(endpointSet & set, uint32_t pos, uint16_t weight, uint16_t load){
+    endpoint & ep = set.servers[pos];
+    endpointInfo & info = set.info[pos];
+    if (weight == 0) weight = DEFAULTWEIGHT;
+    if ((ep.load != 0) != (load != 0)){
+        load != 0 ? set.loaded++ : set.loaded--;
+    }
+    ep.load = load;
+    if (info.weight == weight) return false;
+    if ((info.weight != DEFAULTWEIGHT) != (weight != DEFAULTWEIGHT)){
+        weight != DEFAULTWEIGHT ? set.weighted++ : set.weighted--;
+    }
+    info.weight = weight;
+    return true;
+}
+
+//+
+// buildAlias
+//
+// Vose's alias method. Each server's share is scaled so the average is
+// 1, slots with less than 1 are topped up from one with more than 1,
+// which is then left with less. O(n), and only done when a server
+// comes, goes or changes weight, not on every renewal.
+//-
+
+void serviceRegistry::buildAlias(endpointSet & set){
+    uint32_t n = set.servers.size();
+    set.alias.resize(n);
+
+    uint64_t total = 0;
+    for (auto & info : set.info){
+        total += info.weight;
+    }
+    vector<double> share(n);
+    vector<uint32_t> small, large;
+    for (uint32_t i = 0; i < n; i++){
+        share[i] = (double)set.info[i].weight * n / total;
+        (share[i] < 1.0 ? small : large).push_back(i);
+    }
+    while (!small.empty() && !large.empty()){
+        uint32_t l = small.back();
+        small.pop_back();
+        uint32_t g = large.back();
+        set.alias[l] = aliasSlot{(uint32_t)(share[l] * 4294967296.0), g};
+        share[g] -= 1.0 - share[l];
+        if (share[g] < 1.0){
+            large.pop_back();
+            small.push_back(g);
+        }
+    }
+    // what is left is 1 give or take rounding, these slots are never aliased
+    for (uint32_t i : small){
+        set.alias[i] = aliasSlot{UINT32_MAX, i};
+    }
+    for (uint32_t i : large){
+        set.alias[i] = aliasSlot{UINT32_MAX, i};
+    }
+}
+
+// one random server by weight, the low half of the random bits picks
+// the slot and the high half decides between it and its alias.
+uint32_t serviceRegistry::draw(const endpointSet & set){
+    uint64_t bits = randomBits();
+    uint32_t slot = ((bits & 0xFFFFFFFF) * set.servers.size()) >> 32;
+    if (set.alias.empty()) return slot;
+    const aliasSlot & a = set.alias[slot];
+    return (uint32_t)(bits >> 32) < a.threshold ? slot : a.alias;
+}
+
+//+
+// remove
+//
+// with a stamp the removal is remembered even if the server isn't
+// there, in case the add it removes hasn't arrived yet, so the names
+// are interned for the tombstone. A removal without a stamp just looks
+// them up.
+//-
+
+bool serviceRegistry::remove(const string & svcName, const serverEntity & server, uint64_t stamp){
+    shard & s = shardFor(svcName);
+    unique_lock<shared_mutex> lock(s.lock);
+
+    auto svcIt = s.services.find(svcName);
+    uint32_t nameId;
+    if (stamp != 0){
+        regKey reg{names.intern(svcName), names.intern(server.name), server.port};
+        bool older = olderThanTombstone(s, reg, stamp);
+        if (!older){
+            bury(s, reg, stamp);
+        }
+        // the tombstone holds its own references
+        names.release(reg.svc);
+        names.release(reg.name);
+        if (older) return false;
+        nameId = reg.name;
+    } else {
+        nameId = names.find(server.name);
+    }
+    if (svcIt == s.services.end() || nameId == nameTable::NONAME) return false;
+
+    auto it = svcIt->second.index.find(serverKey(nameId, server.port));
+    if (it == svcIt->second.index.end()) return false;
+    if (stamp != 0 && svcIt->second.info[it->second].stamp >= stamp) return false;
+
+    removeAt(s, svcIt, it->second);
+    return true;
+}
+
+bool serviceRegistry::olderThanTombstone(shard & s, const regKey & reg, uint64_t stamp){
+    if (stamp == 0 || s.tombstones.empty()) return false;
+    auto it = s.tombstones.find(reg);
+    return it != s.tombstones.end() && it->second.stamp >= stamp;
+}
+
+void serviceRegistry::bury(shard & s, const regKey & reg, uint64_t stamp){
+    if (stamp == 0 || tombstoneSeconds == 0) return;
+    auto [it, inserted] = s.tombstones.try_emplace(reg, tombstone{stamp, now() + tombstoneSeconds});
+    if (inserted){
+        names.hold(reg.svc);
+        names.hold(reg.name);
+    } else {
+        it->second = tombstone{stamp, now() + tombstoneSeconds};
+    }
+}
+
+void serviceRegistry::unbury(shard & s, const regKey & reg){
+    auto it = s.tombstones.find(reg);
+    if (it == s.tombstones.end()) return;
+    s.tombstones.erase(it);
+    names.release(reg.svc);
+    names.release(reg.name);
+}
+
+bool serviceRegistry::pickRandom(string_view svcName, serverEntity & server) const {
+    shard & s = shardFor(svcName);
+    shared_lock<shared_mutex> lock(s.lock);
+
+    auto svcIt = s.services.find(svcName);
+    if (svcIt == s.services.end() || svcIt->second.servers.empty()) return false;
+
+    const endpointSet & set = svcIt->second;
+    uint32_t pos = draw(set);
+    if (set.loaded != 0 && set.servers.size() > 1){
+        // the one with less load for its weight, compared without
+        // dividing. A server that hasn't reported isn't idle, just
+        // unknown, so the first draw stands unless both have.
+        uint32_t other = draw(set);
+        uint16_t aReported = set.servers[pos].load;
+        uint16_t bReported = set.servers[other].load;
+        if (aReported != 0 && bReported != 0){
+            uint32_t aLoad = (uint32_t)aReported * set.info[other].weight;
+            uint32_t bLoad = (uint32_t)bReported * set.info[pos].weight;
+            if (bLoad < aLoad){
+                pos = other;
+            }
+        }
+    }
+    const endpoint & ep = set.servers[pos];
+    server.name.assign(names.name(ep.name));
+    server.port = ep.port;
+    return true;
+}
+
+uint32_t serviceRegistry::list(string_view svcName, uint32_t start, uint32_t max,
+                               vector<serverEntity> & servers) const {
+    shard & s = shardFor(svcName);
+    shared_lock<shared_mutex> lock(s.lock);
+
+    auto svcIt = s.services.find(svcName);
+    if (svcIt == s.services.end()) return 0;
+
+    const vector<endpoint> & eps = svcIt->second.servers;
+    for (uint32_t i = start; i < eps.size() && i - start < max; i++){
+        servers.push_back(serverEntity{string(names.name(eps[i].name)), eps[i].port});
+    }
+    return eps.size();
+}
+
+// give back every name reference the shard holds, before it is cleared.
+void serviceRegistry::releaseAll(shard & s){
+    for (auto & [svcName, set] : s.services){
+        for (auto & ep : set.servers){
+            names.release(ep.name);
+        }
+        names.release(set.svcId);
+    }
+    for (auto & [reg, ts] : s.tombstones){
+        names.release(reg.svc);
+        names.release(reg.name);
+    }
+    s.wheel.forEach([this](const leaseEntry & le){
+        names.release(le.svc);
+        names.release(le.name);
+    });
+}
+
+void serviceRegistry::clear(){
+    for (uint32_t i = 0; i < numShards; i++){
+        unique_lock<shared_mutex> lock(shards[i].lock);
+        releaseAll(shards[i]);
+        shards[i].services.clear();
+        shards[i].wheel.clear();
+        shards[i].tombstones.clear();
+    }
+    names.sweep();
+}
+
+void serviceRegistry::dump(vector<replica> & out) const {
+    uint32_t tick = now();
+    for (uint32_t i = 0; i < numShards; i++){
+        shared_lock<shared_mutex> lock(shards[i].lock);
+        for (auto & [svcName, set] : shards[i].services){
+            for (uint32_t pos = 0; pos < set.servers.size(); pos++){
+                const endpoint & ep = set.servers[pos];
+                const endpointInfo & info = set.info[pos];
+                uint32_t lease = info.expiry == 0 ? 0 : (info.expiry > tick ? info.expiry - tick : 1);
+                out.push_back(replica{svcName, serverEntity{string(names.name(ep.name)), ep.port},
+                                      info.stamp, lease, true, info.weight, ep.load});
+            }
+        }
+        for (auto & [reg, ts] : shards[i].tombstones){
+            out.push_back(replica{string(names.name(reg.svc)), serverEntity{string(names.name(reg.name)), reg.port},
+                                  ts.stamp, 0, false});
+        }
+    }
+}
+
+// the buckets of a hash table and a node for each entry
+template <typename M>
+static size_t tableBytes(const M & m){
+    return m.bucket_count() * sizeof(void*) + m.size() * (sizeof(typename M::value_type) + 2 * sizeof(void*));
+}
+
+void serviceRegistry::measure(registrySize & size) const {
+    size = registrySize();
+    size.bytes = numShards * sizeof(shard);
+    for (uint32_t i = 0; i < numShards; i++){
+        shared_lock<shared_mutex> lock(shards[i].lock);
+        const shard & s = shards[i];
+        size.services += s.services.size();
+        size.tombstones += s.tombstones.size();
+        size.leases += s.wheel.size();
+
+        size.bytes += tableBytes(s.services);
+        for (auto & [svcName, set] : s.services){
+            size.servers += set.servers.size();
+            size.bytes += nameTable::heapBytes(svcName);
+            size.bytes += set.servers.capacity() * sizeof(endpoint) + set.info.capacity() * sizeof(endpointInfo);
+            size.bytes += set.alias.capacity() * sizeof(aliasSlot) + tableBytes(set.index);
+        }
+        size.bytes += tableBytes(s.tombstones);
+        size.bytes += s.wheel.bytes([](const leaseEntry &){ return 0; });
+    }
+    size.names = names.size();
+    size.bytes += names.bytes();
+}
+
+void serviceRegistry::observe(changeObserver obs){
+    observer = std::move(obs);
+}
+
+//+
+// expireLeases
+//
+// advance every shard's wheel up to the current tick. A wheel entry
+// that comes due is dropped if the server has gone or has been
+// registered again since (generation doesn't match), expired if the
+// lease really has run out, and otherwise moved to the new expiry
+// time because the lease was renewed.
+//-
+
+void serviceRegistry::expireLeases(vector<registration> & expired){
+    uint32_t tick = now();
+    if (lastTick == 0) lastTick = tick - 1;
+
+    for (uint32_t i = 0; i < numShards; i++){
+        shard & s = shards[i];
+        unique_lock<shared_mutex> lock(s.lock);
+        for (uint32_t t = lastTick + 1; t <= tick; t++){
+            s.wheel.expire(t, [&](uint32_t due, leaseEntry & le){
+                // the entry's references keep both ids valid until released
+                auto svcIt = s.services.find(names.name(le.svc));
+                if (svcIt != s.services.end()){
+                    endpointSet & set = svcIt->second;
+                    auto it = set.index.find(serverKey(le.name, le.port));
+                    if (it != set.index.end()){
+                        endpointInfo & info = set.info[it->second];
+                        if (info.leaseGen == le.leaseGen && info.expiry != 0){
+                            if (info.expiry > t){
+                                s.wheel.schedule(info.expiry, std::move(le));
+                                return;
+                            }
+                            expired.push_back(registration{svcIt->first,
+                                serverEntity{string(names.name(le.name)), le.port}});
+                            // every node expires the lease itself, the tombstone
+                            // stops a copy of the same registration coming back.
+                            bury(s, regKey{le.svc, le.name, le.port}, info.stamp);
+                            removeAt(s, svcIt, it->second);
+                        }
+                    }
+                }
+                names.release(le.svc);
+                names.release(le.name);
+            });
+        }
+        for (auto it = s.tombstones.begin(); it != s.tombstones.end();){
+            if (it->second.expiry <= tick){
+                names.release(it->first.svc);
+                names.release(it->first.name);
+                it = s.tombstones.erase(it);
+            } else {
+                it++;
+            }
+        }
+    }
+    lastTick = tick;
+    // names whose last holder went, here or since the last tick
+    names.sweep();
+}
+
+// stream formatter for debugging
+ostream &operator << (ostream&s,serverEntity se){
+    s << "{"<< se.name << ", " << dec << se.port << "}";
+    return s;
+}
@@ -0,0 +1,292 @@
+//+
+// File:   svcRegistry.hpp
+//
+// The dictionary used by the service directory server.
+//
+// Service names are hashed onto a fixed number of shards, each with
+// its own reader/writer lock, so requests for different services
+// running on different threads don't wait for each other.
+//
+// Within a service the servers are kept in a vector with a hash index
+// from server to position in the vector. Add, remove (swap with the
+// last entry) and picking a random server are all O(1) no matter how
+// many servers are registered.
+//
+// Names are interned (svcIntern.hpp): inside the registry a server is
+// the 32 bit id of its name and its port, so each host name is stored
+// once however many services it serves, and the index, lease timers
+// and tombstones compare integers. The vector a pick draws from holds
+// just the id, port and load (8 bytes a server), the lease, stamp and
+// weight are in a second vector at the same positions. The services
+// themselves are still found by name, as that is what a request has.
+//
+// Servers can register with a weight (their share of the requests
+// compared with the other servers for the service, 1 by default) and
+// report their load when they renew. A service where the weights are
+// not all 1 keeps an alias table (Vose's method) so a weighted pick is
+// still O(1), the table is rebuilt when a server comes, goes or changes
+// its weight. When any server of a service has reported a load two
+// servers are drawn and the one with less load for its weight is used
+// (power of two choices), which moves work off busy servers without
+// herding every client onto the one that looks idlest. The loads are
+// only compared when both servers drawn have reported one: a server
+// that never has (load 0) is not taken to be idle, the first draw is
+// used as it would be with no loads at all.
+//
+// A registration can carry a lease. Leased servers are removed when
+// the lease runs out unless it is renewed first. Each shard has a
+// timer wheel holding one entry per leased server. Renewing only
+// updates the expiry time in the server entry, when the wheel entry
+// comes due it is either expired or moved to the new expiry time.
+//
+// When the directory is replicated every change carries a stamp (a
+// Lamport clock and the node it came from) and the latest stamp for a
+// registration wins, so nodes that see the same changes in a different
+// order still end up the same. Removed registrations are remembered
+// for a while (tombstones) so an older add arriving late doesn't bring
+// them back. A stamp of 0 is applied unconditionally.
+//
+// A node that was down (or cut off) comes back with the registrations
+// it had, and sends them to its peers. Anything removed meanwhile is
+// only kept out by the peers' tombstones, so tombstones are kept as
+// long as the longest outage tolerated (a day by default, -k on the
+// server), not just the replication delay. They are saved in the store
+// with the registrations, so a restart doesn't lose them. A node away
+// for longer than that can bring back servers removed while it was
+// gone, and should be started without its store. A directory with no
+// peers keeps no tombstones.
+//-
+
+#ifndef __SVCREGISTRY_H__
+#define __SVCREGISTRY_H__
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "svcIntern.hpp"
+#include "timerWheel.hpp"
+
+// server name and port
+struct serverEntity {
+    std::string name;
+    uint16_t port;
+
+    bool operator==(const serverEntity & other) const {
+        return port == other.port && name == other.name;
+    }
+};
+
+// stream formatter for debugging
+std::ostream &operator << (std::ostream&s,serverEntity se);
+
+// a service name and server, used to report expired leases
+struct registration {
+    std::string svcName;
+    serverEntity server;
+
+    bool operator==(const registration & other) const {
+        return svcName == other.svcName && server == other.server;
+    }
+};
+
+// weight a server has if it doesn't give one
+#define DEFAULTWEIGHT 1
+
+// seconds a removal is remembered unless told otherwise
+#define DEFAULTTOMBSTONESECONDS (24 * 60 * 60)
+
+// a registration (or removal) as copied between directory nodes
+struct replica {
+    std::string svcName;
+    serverEntity server;
+    uint64_t stamp;
+    uint32_t leaseSeconds;  // left to run, 0 for no lease
+    bool present;           // false for a removal
+    uint16_t weight = DEFAULTWEIGHT;
+    uint16_t load = 0;      // last load reported, 0 for none
+};
+
+// how big the registry is, for the stats request
+struct registrySize {
+    uint32_t services = 0;
+    uint32_t servers = 0;
+    uint32_t leases = 0;        // lease timers, a removed server's stays until it is due
+    uint32_t tombstones = 0;
+    uint32_t names = 0;         // distinct service and server names
+    uint64_t bytes = 0;         // estimate of the heap used
+};
+
+// called with the shard lock held whenever a server is added to or
+// removed from a service (including by lease expiry), so the changes
+// to any one service are seen in the order they were made.
+typedef std::function<void(const std::string & svcName, bool added, const serverEntity & server)> changeObserver;
+
+class serviceRegistry {
+public:
+    explicit serviceRegistry(uint32_t numShards = 64);
+
+    // add a server to a service, returns false if it was already there
+    // or the stamp is older than the last change to the registration.
+    // A lease of 0 seconds never expires. Adding a server that is already
+    // there replaces its lease, so this is also how leases are renewed.
+    // The weight and load are replaced the same way, a weight of 0 is
+    // taken as DEFAULTWEIGHT.
+    //
+    // If passOn is given it is set to whether the peers and the store
+    // need to hear of the change: the server is new, its weight or load
+    // changed, its lease is shorter than or half way through the one
+    // they last heard of. Most renewals only push the expiry on and
+    // needn't be passed on. Without passOn the change is taken to have
+    // come from them.
+    bool add(const std::string & svcName, const serverEntity & server, uint32_t leaseSeconds = 0,
+             uint64_t stamp = 0, uint16_t weight = DEFAULTWEIGHT, uint16_t load = 0,
+             bool * passOn = nullptr);
+    // remove a server from a service, returns false if it wasn't there
+    // or the stamp is older than the last change to the registration.
+    bool remove(const std::string & svcName, const serverEntity & server, uint64_t stamp = 0);
+    // pick a server for the service by weight and load (see above),
+    // returns false if there are none. The lookups take the name
+    // straight from the packet, they don't need a string of their own.
+    bool pickRandom(std::string_view svcName, serverEntity & server) const;
+    // copy up to max servers for the service starting at index start into
+    // servers. Returns the total number of servers for the service.
+    uint32_t list(std::string_view svcName, uint32_t start, uint32_t max,
+                  std::vector<serverEntity> & servers) const;
+    // remove everything. The observer is not called.
+    void clear();
+    // copy every registration and tombstone, for bringing another
+    // directory node up to date.
+    void dump(std::vector<replica> & out) const;
+    // set the observer for adds and removes, before any threads start.
+    void observe(changeObserver obs);
+    // how long removals are remembered, before any threads start. 0
+    // keeps no tombstones, for a directory that isn't replicated.
+    void keepTombstones(uint32_t seconds) { tombstoneSeconds = seconds; }
+
+    // remove the servers whose leases have run out, they are appended
+    // to expired. Called about once a second by a single thread.
+    void expireLeases(std::vector<registration> & expired);
+
+    // seconds since the registry was created, the lease clock.
+    uint32_t now() const;
+
+    // count everything and estimate the memory it takes. The estimate
+    // adds up the containers and the strings too long to be kept
+    // inside a std::string, and allows two pointers for each hash
+    // table node; malloc's own overhead is not included.
+    void measure(registrySize & size) const;
+
+private:
+    // one registered server, all that a pick looks at
+    struct endpoint {
+        uint32_t name;          // interned server name
+        uint16_t port;
+        uint16_t load;          // 0 if none has been reported
+    };
+    static_assert(sizeof(endpoint) == 8, "endpoints are packed 8 to a cache line");
+
+    // the rest of what is kept for a server
+    struct endpointInfo {
+        uint64_t stamp;         // last change, for replication
+        uint32_t expiry;        // tick the lease runs out, 0 for no lease
+        uint32_t leaseGen;      // matches the wheel entry for this server
+        uint32_t sharedExpiry;  // the expiry the peers and store last heard of
+        uint16_t weight;
+    };
+
+    // one slot of an alias table. A draw picks a slot at random and
+    // uses it if a second random number is below threshold, otherwise
+    // it uses alias.
+    struct aliasSlot {
+        uint32_t threshold;
+        uint32_t alias;
+    };
+
+    // a removed registration
+    struct tombstone {
+        uint64_t stamp;
+        uint32_t expiry;        // tick it can be forgotten
+    };
+
+    // the servers for one service. servers and info are in the same order.
+    struct endpointSet {
+        uint32_t svcId = nameTable::NONAME;     // interned service name
+        std::vector<endpoint> servers;
+        std::vector<endpointInfo> info;
+        std::unordered_map<uint64_t, uint32_t> index;   // serverKey to position
+        uint32_t weighted = 0;          // servers whose weight isn't DEFAULTWEIGHT
+        uint32_t loaded = 0;            // servers that have reported a load
+        std::vector<aliasSlot> alias;   // empty unless weighted != 0
+    };
+
+    // what the timer wheel holds for each leased server, it holds
+    // references to both names.
+    struct leaseEntry {
+        uint32_t svc;
+        uint32_t name;
+        uint32_t leaseGen;
+        uint16_t port;
+    };
+
+    // a registration by name ids, for the tombstones
+    struct regKey {
+        uint32_t svc;
+        uint32_t name;
+        uint16_t port;
+
+        bool operator==(const regKey & other) const {
+            return svc == other.svc && name == other.name && port == other.port;
+        }
+    };
+    struct regKeyHash {
+        size_t operator()(const regKey & k) const {
+            return std::hash<uint64_t>()(((uint64_t)k.svc << 32 | k.name) * 31 + k.port);
+        }
+    };
+
+    static uint64_t serverKey(uint32_t name, uint16_t port){ return (uint64_t)name << 16 | port; }
+
+    // lets the services be found with a string_view
+    struct nameHash {
+        using is_transparent = void;
+        size_t operator()(std::string_view name) const { return std::hash<std::string_view>()(name); }
+    };
+    typedef std::unordered_map<std::string, endpointSet, nameHash, std::equal_to<>> serviceMap;
+
+    struct shard {
+        mutable std::shared_mutex lock;
+        serviceMap services;
+        timerWheel<leaseEntry> wheel;
+        uint32_t nextGen = 1;
+        // each holds references to both names
+        std::unordered_map<regKey, tombstone, regKeyHash> tombstones;
+    };
+
+    nameTable names;
+    uint32_t numShards;
+    std::unique_ptr<shard[]> shards;
+    uint32_t lastTick = 0;
+    uint32_t tombstoneSeconds = DEFAULTTOMBSTONESECONDS;
+    std::chrono::steady_clock::time_point startTime;
+    changeObserver observer;
+
+    shard & shardFor(std::string_view svcName) const;
+    void removeAt(shard & s, serviceMap::iterator svcIt, uint32_t pos);
+    static bool setLoad(endpointSet & set, uint32_t pos, uint16_t weight, uint16_t load);
+    static void buildAlias(endpointSet & set);
+    static uint32_t draw(const endpointSet & set);
+    bool olderThanTombstone(shard & s, const regKey & reg, uint64_t stamp);
+    void bury(shard & s, const regKey & reg, uint64_t stamp);
+    void unbury(shard & s, const regKey & reg);
+    void releaseAll(shard & s);
+};
+
+#endif
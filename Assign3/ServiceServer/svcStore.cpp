@@ -0,0 +1,328 @@
+//+
+// File:   svcStore.cpp
+//
+// Snapshot and change log for the service directory.
+//-
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+
+#include <chrono>
+#include <iostream>
+
+#include "svcCluster.hpp"
+#include "svcLog.hpp"
+#include "svcStore.hpp"
+
+using namespace std;
+
+static const uint32_t snapMagic = 'S' << 24 | 'V' << 16 | 'S' << 8 | 'N';
+// the log is always written in the same version as the snapshot.
+static const uint32_t snapVersion = 2;
+#define SNAPHEADERLEN 24
+
+//+
+// mapFile
+//
+// map a whole file read only. Returns nullptr (and len 0) if the file
+// isn't there or is empty.
+//-
+
+static uint8_t * mapFile(const string & name, size_t & len){
+    len = 0;
+    int fd = ::open(name.c_str(), O_RDONLY);
+    if (fd < 0) return nullptr;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0){
+        ::close(fd);
+        return nullptr;
+    }
+    void * p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) return nullptr;
+    len = st.st_size;
+    return (uint8_t*)p;
+}
+
+// how much of a lease is left after the time since it was written.
+static bool adjustLease(replica & r, uint64_t written, uint64_t now){
+    if (!r.present || r.leaseSeconds == 0) return true;
+    uint64_t gone = now > written ? now - written : 0;
+    if (gone >= r.leaseSeconds) return false;
+    r.leaseSeconds -= gone;
+    return true;
+}
+
+registryStore::~registryStore(){
+    if (logfd >= 0) ::close(logfd);
+}
+
+bool registryStore::open(const string & dir, const function<void(const replica &)> & apply){
+    snapName = dir + "/svcdir.snap";
+    logName = dir + "/svcdir.log";
+    oldLogName = logName + ".old";
+
+    struct stat st;
+    if (stat(dir.c_str(), &st) < 0 || !S_ISDIR(st.st_mode)){
+        cerr << "snapshot directory " << dir << " does not exist" << endl;
+        return false;
+    }
+
+    auto start = chrono::steady_clock::now();
+    uint32_t fromSnap = replaySnapshot(apply);
+    uint32_t fromLog = replayLog(oldLogName, apply) + replayLog(logName, apply);
+    auto took = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start);
+    SVCLOG(svcLog::lvlInfo, "Restored {} snapshot records and {} log records from {} in {}us",
+        fromSnap, fromLog, dir, (uint64_t)took.count());
+
+    logfd = ::open(logName.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (logfd < 0){
+        perror("opening change log failed");
+        return false;
+    }
+    logCount = fromLog;
+    return true;
+}
+
+uint32_t registryStore::replaySnapshot(const function<void(const replica &)> & apply){
+    size_t len;
+    uint8_t * base = mapFile(snapName, len);
+    if (base == nullptr) return 0;
+
+    uint32_t count = 0;
+    if (len >= SNAPHEADERLEN && *((uint32_t*)base) == snapMagic && *((uint32_t*)(base+4)) == snapVersion){
+        uint64_t written = *((uint64_t*)(base+8));
+        uint64_t now = time(nullptr);
+        uint32_t total = *((uint32_t*)(base+16));
+        uint32_t curPos = SNAPHEADERLEN;
+        replica r;
+        uint32_t skipped = 0;
+        for (uint32_t i = 0; i < total && curPos + 4 <= len; i++){
+            uint32_t recLen = *((uint32_t*)(base+curPos));
+            uint32_t pos = curPos + 4;
+            uint32_t end = pos + recLen;
+            if (end > len) break;
+            curPos = end;
+            // a record that can't be read is passed over, the ones
+            // after it are still good.
+            if (!cluster::readReplica(base, end, pos, r)){
+                skipped++;
+                continue;
+            }
+            if (adjustLease(r, written, now)) apply(r);
+            count++;
+        }
+        if (skipped != 0){
+            cerr << snapName << " has " << skipped << " records that can't be read, passed over" << endl;
+        }
+    } else {
+        // the log goes with it, it was written in the same version.
+        cerr << snapName << " is not a directory snapshot this server can read, ignored with the log" << endl;
+        truncate(logName.c_str(), 0);
+    }
+    munmap(base, len);
+    return count;
+}
+
+//+
+// replayLog
+//
+// a server that was killed part way through a write leaves a broken
+// record at the end, the log is cut back to the last whole record. A
+// whole record that can't be read is passed over, the log is only cut
+// where the lengths no longer fit the file.
+//-
+
+uint32_t registryStore::replayLog(const string & name, const function<void(const replica &)> & apply){
+    size_t len;
+    uint8_t * base = mapFile(name, len);
+    if (base == nullptr) return 0;
+
+    uint64_t now = time(nullptr);
+    uint32_t count = 0;
+    uint32_t curPos = 0;
+    uint32_t skipped = 0;
+    replica r;
+    while (curPos + 8 <= len){
+        uint32_t written = *((uint32_t*)(base+curPos));
+        uint32_t recLen = *((uint32_t*)(base+curPos+4));
+        uint32_t pos = curPos + 8;
+        uint32_t end = pos + recLen;
+        if (end > len) break;
+        curPos = end;
+        if (!cluster::readReplica(base, end, pos, r)){
+            skipped++;
+            continue;
+        }
+        // only the low 32 bits of the time are kept
+        uint64_t full = (now & 0xFFFFFFFF00000000ull) | written;
+        if (full > now) full -= 0x100000000ull;
+        if (adjustLease(r, full, now)) apply(r);
+        count++;
+    }
+    munmap(base, len);
+
+    if (skipped != 0){
+        cerr << name << " has " << skipped << " records that can't be read, passed over" << endl;
+    }
+    if (curPos != len){
+        cerr << name << " has a broken record at " << curPos << ", cut back" << endl;
+        truncate(name.c_str(), curPos);
+    }
+    return count;
+}
+
+void registryStore::appendLocked(const replica & r, uint32_t now){
+    uint32_t buffInt[(8 + MAXREPLICALEN) / 4 + 1];
+    uint8_t * buff = (uint8_t*)buffInt;
+    buffInt[0] = now;
+    uint32_t end = cluster::writeReplica(buff, 8, r);
+    if (end == 0){
+        // a cut short record would stop the log being replayed past it
+        SVCLOG(svcLog::lvlWarn, "change to {} -> ({},{}) is too long to log", r.svcName,
+            r.server.name, r.server.port);
+        return;
+    }
+    buffInt[1] = end - 8;
+    // one write per record so records from different threads never mix.
+    if (write(logfd, buff, end) != (ssize_t)end){
+        perror("writing change log failed");
+    }
+    logCount++;
+}
+
+void registryStore::append(const replica & r){
+    if (logfd < 0) return;
+    lock_guard<mutex> guard(lock);
+    appendLocked(r, time(nullptr));
+}
+
+void registryStore::append(const vector<replica> & rs){
+    if (logfd < 0) return;
+    lock_guard<mutex> guard(lock);
+    uint32_t now = time(nullptr);
+    for (auto & r : rs){
+        appendLocked(r, now);
+    }
+}
+
+uint32_t registryStore::logged(){
+    lock_guard<mutex> guard(lock);
+    return logCount;
+}
+
+//+
+// moveLogAside
+//
+// empty the log into the old log, with the store locked. The old log
+// is normally gone by now and the log is renamed; if the last snapshot
+// failed it is still there and the log is added to its end, since what
+// it holds isn't in any snapshot yet.
+//-
+
+bool registryStore::moveLogAside(){
+    struct stat st;
+    if (stat(oldLogName.c_str(), &st) < 0){
+        if (rename(logName.c_str(), oldLogName.c_str()) < 0){
+            perror("moving change log aside failed");
+            return false;
+        }
+        int fd = ::open(logName.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd < 0){
+            perror("starting change log failed");
+            rename(oldLogName.c_str(), logName.c_str());
+            return false;
+        }
+        ::close(logfd);
+        logfd = fd;
+        return true;
+    }
+
+    size_t len;
+    uint8_t * base = mapFile(logName, len);
+    if (base != nullptr){
+        int fd = ::open(oldLogName.c_str(), O_WRONLY | O_APPEND);
+        bool ok = fd >= 0 && write(fd, base, len) == (ssize_t)len;
+        if (fd >= 0) ::close(fd);
+        munmap(base, len);
+        if (!ok){
+            perror("adding to old change log failed");
+            return false;
+        }
+    }
+    if (ftruncate(logfd, 0) < 0){
+        perror("emptying change log failed");
+        return false;
+    }
+    return true;
+}
+
+//+
+// snapshot
+//
+// the store lock is held while the registry is dumped and the log moved
+// aside, so every change in the old log is in the dump and every change
+// logged after it is in the new log. Changes made to the registry but
+// not yet logged are logged again afterwards, which is harmless as the
+// stamps make replaying them a second time do nothing. Writing and
+// syncing the snapshot is done without the lock, the old log is only
+// removed once the snapshot is in place.
+//-
+
+bool registryStore::snapshot(const serviceRegistry & registry){
+    if (logfd < 0) return false;
+    lock_guard<mutex> snapGuard(snapLock);
+
+    vector<replica> state;
+    {
+        lock_guard<mutex> guard(lock);
+        registry.dump(state);
+        if (!moveLogAside()) return false;
+        logCount = 0;
+    }
+
+    vector<uint32_t> buffInt(SNAPHEADERLEN / 4 + state.size() * (4 + MAXREPLICALEN) / 4 + 1);
+    uint8_t * buff = (uint8_t*)buffInt.data();
+    *((uint32_t*)buff) = snapMagic;
+    *((uint32_t*)(buff+4)) = snapVersion;
+    *((uint64_t*)(buff+8)) = time(nullptr);
+    *((uint32_t*)(buff+20)) = 0;
+    uint32_t curPos = SNAPHEADERLEN;
+    uint32_t count = 0;
+    for (auto & r : state){
+        uint32_t start = curPos + 4;
+        uint32_t end = cluster::writeReplica(buff, start, r);
+        if (end == 0){
+            SVCLOG(svcLog::lvlWarn, "{} -> ({},{}) is too long to keep in the snapshot", r.svcName,
+                r.server.name, r.server.port);
+            continue;
+        }
+        *((uint32_t*)(buff+start-4)) = end - start;
+        curPos = end;
+        count++;
+    }
+    *((uint32_t*)(buff+16)) = count;
+
+    string tmpName = snapName + ".tmp";
+    int fd = ::open(tmpName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0){
+        perror("creating snapshot failed");
+        return false;
+    }
+    bool ok = write(fd, buff, curPos) == (ssize_t)curPos && fsync(fd) == 0;
+    ::close(fd);
+    if (!ok || rename(tmpName.c_str(), snapName.c_str()) < 0){
+        // the old log stays to be replayed, or added to next time
+        perror("writing snapshot failed");
+        unlink(tmpName.c_str());
+        return false;
+    }
+
+    // everything in the old log is in the snapshot now
+    unlink(oldLogName.c_str());
+    return true;
+}
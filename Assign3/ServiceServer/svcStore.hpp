@@ -0,0 +1,87 @@
+//+
+// File:   svcStore.hpp
+//
+// Keeps the directory on disk so a restarted server comes back with
+// every registration instead of waiting for the servers to register
+// again.
+//
+// There are up to three files in the directory given with -d:
+//
+//   svcdir.snap     every registration and tombstone at some moment,
+//                   written to a temporary file and renamed into place
+//   svcdir.log.old  the changes logged before the snapshot being
+//                   written, there only until it is in place
+//   svcdir.log      every change since, appended as it happens
+//
+// On start up they are mapped into memory and replayed into the
+// registry in that order. A snapshot is taken every so often (and when
+// the server stops). The registry is dumped and the log moved aside
+// with the store locked, but the snapshot is written and synced with
+// it unlocked, so changes are logged meanwhile. All the files hold
+// replicas in the encoding used between directory nodes
+// (svcCluster.hpp), so the stamps decide the order just as they do for
+// replication, and replaying a change twice does nothing.
+//
+// Leases are stored as seconds left at a wall clock time so time spent
+// stopped counts against them. Registrations whose leases ran out while
+// the server was down are not restored.
+//
+// The log is written but not synced, a crash of the server loses
+// nothing, a crash of the machine can lose the last few changes.
+//
+// snapshot file
+//     magic 'SVSN', version (4 bytes each)
+//     time: 8 bytes - seconds since the epoch
+//     count: 4 bytes, then 4 bytes of padding
+//     count records of length (4 bytes) and replica
+//
+// log file
+//     records of time (4 bytes, low 32 bits of the seconds since
+//     the epoch), length (4 bytes) and replica
+//-
+
+#ifndef __SVCSTORE_H__
+#define __SVCSTORE_H__
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "svcRegistry.hpp"
+
+class registryStore {
+public:
+    ~registryStore();
+
+    // open the files in dir and pass everything in them to apply.
+    // Returns false if the directory can't be used.
+    bool open(const std::string & dir, const std::function<void(const replica &)> & apply);
+    bool enabled() const { return logfd >= 0; }
+
+    // record changes that have been made to the registry.
+    void append(const replica & r);
+    void append(const std::vector<replica> & rs);
+    // number of changes logged since the last snapshot
+    uint32_t logged();
+
+    // write the whole registry as the new snapshot and empty the log.
+    bool snapshot(const serviceRegistry & registry);
+
+private:
+    std::string snapName;
+    std::string logName;
+    std::string oldLogName;
+    int logfd = -1;
+    uint32_t logCount = 0;
+    std::mutex lock;
+    std::mutex snapLock;        // one snapshot at a time
+
+    uint32_t replaySnapshot(const std::function<void(const replica &)> & apply);
+    uint32_t replayLog(const std::string & name, const std::function<void(const replica &)> & apply);
+    bool moveLogAside();
+    void appendLocked(const replica & r, uint32_t now);
+};
+
+#endif
@@ -0,0 +1,147 @@
+//+
+// File:   svcWatch.cpp
+//
+// Implementation of the watcher table.
+//-
+
+#include <chrono>
+#include <random>
+
+#include "svcWatch.hpp"
+
+using namespace std;
+
+// the notifier is only allowed to fall this far behind, after that
+// changes are dropped and watchers catch up when they see the gap.
+#define MAXQUEUED 4096
+
+static bool sameAddr(const sockaddr_in & a, const sockaddr_in & b){
+    return a.sin_addr.s_addr == b.sin_addr.s_addr && a.sin_port == b.sin_port;
+}
+
+// start the epochs somewhere random so a restarted directory
+// never hands out an epoch that a watcher already knows.
+watchTable::watchTable(){
+    random_device rd;
+    nextEpoch = rd() ^ (uint32_t)chrono::system_clock::now().time_since_epoch().count();
+    if (nextEpoch == 0) nextEpoch = 1;
+}
+
+//+
+// watch
+//
+// a service that nobody was watching gets a new epoch, its version
+// history only means something while it is being watched.
+//-
+
+void watchTable::watch(const string & svcName, const sockaddr_in & addr, uint32_t leaseSeconds,
+                       uint32_t now, uint32_t & epoch, uint32_t & version){
+    lock_guard<mutex> guard(lock);
+
+    auto it = services.find(svcName);
+    if (it == services.end()){
+        if (leaseSeconds == 0){
+            epoch = 0;
+            version = 0;
+            return;
+        }
+        it = services.emplace(svcName, watchedService{nextEpoch++, 0, {}}).first;
+        if (nextEpoch == 0) nextEpoch = 1;
+        watchedCount++;
+    }
+    watchedService & ws = it->second;
+    epoch = ws.epoch;
+    version = ws.version;
+
+    for (size_t i = 0; i < ws.watchers.size(); i++){
+        if (sameAddr(ws.watchers[i].addr, addr)){
+            if (leaseSeconds == 0){
+                ws.watchers[i] = ws.watchers.back();
+                ws.watchers.pop_back();
+            } else {
+                ws.watchers[i].expiry = now + leaseSeconds + 1;
+            }
+            leaseSeconds = 0;
+            break;
+        }
+    }
+    if (leaseSeconds != 0){
+        ws.watchers.push_back(watcher{addr, now + leaseSeconds + 1});
+    }
+
+    if (ws.watchers.empty()){
+        services.erase(it);
+        watchedCount--;
+    }
+}
+
+void watchTable::queueChange(const string & svcName, watchedService & ws, change what, const serverEntity & server){
+    if (queue.size() >= MAXQUEUED) return;
+    notification nt{svcName, ws.epoch, ws.version, what, server, {}};
+    nt.watchers.reserve(ws.watchers.size());
+    for (auto & w : ws.watchers){
+        nt.watchers.push_back(w.addr);
+    }
+    queue.push_back(std::move(nt));
+    ready.notify_one();
+}
+
+void watchTable::changed(const string & svcName, bool added, const serverEntity & server){
+    if (watchedCount.load(memory_order_relaxed) == 0) return;
+
+    lock_guard<mutex> guard(lock);
+    auto it = services.find(svcName);
+    if (it == services.end()) return;
+    it->second.version++;
+    queueChange(svcName, it->second, added ? chgAdd : chgRemove, server);
+}
+
+void watchTable::reset(){
+    lock_guard<mutex> guard(lock);
+    for (auto & [svcName, ws] : services){
+        ws.epoch = nextEpoch++;
+        if (nextEpoch == 0) nextEpoch = 1;
+        ws.version = 0;
+        queueChange(svcName, ws, chgEpoch, serverEntity{"", 0});
+    }
+}
+
+void watchTable::expire(uint32_t now){
+    lock_guard<mutex> guard(lock);
+    for (auto it = services.begin(); it != services.end();){
+        vector<watcher> & ws = it->second.watchers;
+        for (size_t i = 0; i < ws.size();){
+            if (ws[i].expiry <= now){
+                ws[i] = ws.back();
+                ws.pop_back();
+            } else {
+                i++;
+            }
+        }
+        if (ws.empty()){
+            it = services.erase(it);
+            watchedCount--;
+        } else {
+            it++;
+        }
+    }
+}
+
+bool watchTable::next(vector<notification> & out){
+    unique_lock<mutex> guard(lock);
+    ready.wait(guard, [this]{ return stopping || !queue.empty(); });
+    if (stopping) return false;
+    while (!queue.empty()){
+        out.push_back(std::move(queue.front()));
+        queue.pop_front();
+    }
+    return true;
+}
+
+void watchTable::stop(){
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    ready.notify_all();
+}
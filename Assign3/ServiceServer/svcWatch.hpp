@@ -0,0 +1,95 @@
+//+
+// File:   svcWatch.hpp
+//
+// Watchers for the service directory server.
+//
+// A client watching a service is sent a notification every time a
+// server is added to or removed from that service, instead of having
+// to poll with search. Each watched service has an epoch and a version.
+// The version goes up by one for every change, so a watcher that sees
+// a gap knows it missed a notification and fetches the whole service
+// again. The epoch changes when the service's history is lost (the
+// directory was reset, or restarted, or nobody was watching for a
+// while), a watcher that sees a new epoch also fetches it again.
+//
+// Watches carry a lease like registrations and are renewed by sending
+// the watch request again. Changes are queued under the registry lock
+// and sent by a separate notifier thread so registering never waits
+// for the network.
+//-
+
+#ifndef __SVCWATCH_H__
+#define __SVCWATCH_H__
+
+#include <netinet/in.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "svcRegistry.hpp"
+
+class watchTable {
+public:
+    // what happened to the service
+    enum change : uint8_t { chgAdd = 1, chgRemove, chgEpoch };
+
+    // one change to send to every watcher of the service
+    struct notification {
+        std::string svcName;
+        uint32_t epoch;
+        uint32_t version;
+        change what;
+        serverEntity server;
+        std::vector<sockaddr_in> watchers;
+    };
+
+    watchTable();
+
+    // add or renew the watch by addr on the service, a lease of 0
+    // stops watching. The current epoch and version are returned so
+    // the watcher can tell if it is up to date.
+    void watch(const std::string & svcName, const sockaddr_in & addr, uint32_t leaseSeconds,
+               uint32_t now, uint32_t & epoch, uint32_t & version);
+    // record a change to a service. Called with the registry shard
+    // lock held so changes to one service are numbered in order.
+    void changed(const std::string & svcName, bool added, const serverEntity & server);
+    // every service starts a new epoch, used when the directory is reset.
+    void reset();
+    // drop the watchers whose leases have run out.
+    void expire(uint32_t now);
+
+    // wait for queued notifications and move them to out.
+    // returns false once stop has been called.
+    bool next(std::vector<notification> & out);
+    void stop();
+
+private:
+    struct watcher {
+        sockaddr_in addr;
+        uint32_t expiry;
+    };
+    struct watchedService {
+        uint32_t epoch;
+        uint32_t version;
+        std::vector<watcher> watchers;
+    };
+
+    std::mutex lock;
+    std::condition_variable ready;
+    std::unordered_map<std::string, watchedService> services;
+    std::deque<notification> queue;
+    uint32_t nextEpoch;
+    bool stopping = false;
+    // lets changed skip the lock when nothing is being watched
+    std::atomic<uint32_t> watchedCount{0};
+
+    void queueChange(const std::string & svcName, watchedService & ws, change what, const serverEntity & server);
+};
+
+#endif
@@ -25,6 +25,16 @@ int main(int argc, char * argv[]){
     se = svcServer.searchService("mabxox");
     std::cout << ">>search returned " << se << std::endl;
     
+    std::cout << "***searching all of mabxox "  << std::endl;
+    for (auto & all : svcServer.searchServiceAll("mabxox")){
+        std::cout << ">>search all returned " << all << std::endl;
+    }
+
+    std::cout << "***batch searching mabxox and nosuch "  << std::endl;
+    for (auto & one : svcServer.searchServices({"mabxox", "nosuch"})){
+        std::cout << ">>batch search returned " << one << std::endl;
+    }
+
     std::cout << "***removing server take2 as mabxox "  << std::endl;
     se = serverEntity{"take2",25};
     abc = svcServer.removeService("mabxox",se);
@@ -7,17 +7,20 @@
 using namespace svcDir;
 
 int main(int argc, char * argv[]){
-    if (argc != 4){
-        std::cerr << "Usage: " << argv[0] << " serviceName serverName port" << std::endl;
+    if (argc != 4 && argc != 5){
+        std::cerr << "Usage: " << argv[0] << " serviceName serverName port [leaseSeconds]" << std::endl;
         return 1;
     }
 
     std::string serviceName = argv[1];
     serverEntity se = serverEntity{argv[2],static_cast<uint16_t>(atoi(argv[3]))};
+    uint32_t lease = argc == 5 ? atoi(argv[4]) : 0;
     serviceServer svcServer;
 
+    // this program exits straight away so a lease is not renewed,
+    // the registration disappears from the directory when it runs out.
     std::cout << "***registering server " << se << " as " << serviceName  << std::endl;
-    bool abc = svcServer.registerService(serviceName,se);
+    bool abc = svcServer.registerService(serviceName,se,lease);
 
     std::cout << "registerService returned " << abc << std::endl;
 }
@@ -0,0 +1,32 @@
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include "svcDirClient.hpp"
+
+using namespace svcDir;
+
+int main(int argc, char * argv[]){
+    if (argc != 2 && argc != 3){
+        std::cerr << "Usage: " << argv[0] << " serviceName [seconds]" << std::endl;
+        return 1;
+    }
+
+    serviceServer svcServer;
+
+    std::string serviceName = argv[1];
+    int seconds = argc == 3 ? atoi(argv[2]) : 60;
+
+    // print every change to the service until the time is up.
+    std::cout << "***watching " << serviceName << " for " << seconds << " seconds" << std::endl;
+    bool abc = svcServer.watchService(serviceName,
+        [](const std::string & name, watchEvent event, const serverEntity & se){
+            std::cout << ">>" << name << (event == watchEvent::added ? " added " : " removed ")
+                << se << std::endl;
+        });
+    if (!abc){
+        std::cout << "watchService failed" << std::endl;
+        return 1;
+    }
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+}
@@ -0,0 +1,101 @@
+//+
+// File:   timerWheel.hpp
+//
+// A hashed timing wheel. Items are scheduled for a tick and put in
+// slot (tick % number of slots). Advancing the clock by one tick only
+// looks at one slot, so scheduling and expiring are O(1) per item no
+// matter how many items are waiting.
+//
+// Items more than one revolution in the future share a slot with
+// nearer ones, they are just left where they are until their tick
+// comes around.
+//
+// The wheel does no locking, the owner must serialize access.
+//-
+
+#ifndef __TIMERWHEEL_H__
+#define __TIMERWHEEL_H__
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+template <typename T>
+class timerWheel {
+public:
+    explicit timerWheel(uint32_t numSlots = 256) : slots(numSlots) {}
+
+    void schedule(uint32_t tick, T item){
+        slots[tick % slots.size()].push_back(entry{tick, std::move(item)});
+        count++;
+    }
+
+    //+
+    // expire
+    //
+    // remove every item in the slot for tick that is due (scheduled
+    // for tick or earlier) and call f(tick, item) for each. f may
+    // schedule new items, even into the same slot.
+    //-
+
+    template <typename F>
+    void expire(uint32_t tick, F && f){
+        std::vector<entry> & slot = slots[tick % slots.size()];
+        due.clear();
+        for (size_t i = 0; i < slot.size();){
+            if (slot[i].tick <= tick){
+                due.push_back(std::move(slot[i]));
+                slot[i] = std::move(slot.back());
+                slot.pop_back();
+            } else {
+                i++;
+            }
+        }
+        count -= due.size();
+        for (entry & e : due){
+            f(e.tick, e.item);
+        }
+    }
+
+    size_t size() const { return count; }
+
+    // heap used by the wheel, itemBytes(item) gives what each item
+    // holds outside itself.
+    template <typename F>
+    size_t bytes(F && itemBytes) const {
+        size_t total = slots.capacity() * sizeof(slots[0]) + due.capacity() * sizeof(entry);
+        for (auto & slot : slots){
+            total += slot.capacity() * sizeof(entry);
+            for (auto & e : slot){
+                total += itemBytes(e.item);
+            }
+        }
+        return total;
+    }
+
+    // call f(item) for every item waiting, in no particular order
+    template <typename F>
+    void forEach(F && f) const {
+        for (auto & slot : slots){
+            for (auto & e : slot){
+                f(e.item);
+            }
+        }
+    }
+
+    void clear(){
+        for (auto & slot : slots) slot.clear();
+        count = 0;
+    }
+
+private:
+    struct entry {
+        uint32_t tick;
+        T item;
+    };
+    std::vector<std::vector<entry>> slots;
+    std::vector<entry> due;
+    size_t count = 0;
+};
+
+#endif
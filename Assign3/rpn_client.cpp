@@ -15,8 +15,10 @@
 #define TIMEOUT_SEC 2
 
 RPNClient::RPNClient(const std::string& service_name) : sockfd(-1), message_counter(0) {
+    // lookupService answers from the process wide cache, so making
+    // many clients for the same service only asks the directory once.
     svcDir::serviceServer svcServer;
-    svcDir::serverEntity serverInfo = svcServer.searchService(service_name);
+    svcDir::serverEntity serverInfo = svcServer.lookupService(service_name);
     
     if (serverInfo.name == "None" || serverInfo.port == 0) {
         std::cerr << "Service '" << service_name << "' not found" << std::endl;
@@ -1,5 +1,6 @@
 #include "rpn_server.hpp"
 #include "ServiceServer/svcDirClient.hpp"
+#include "ServiceServer/svcLog.hpp"
 #include "rpn.pb.h"
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -14,14 +15,19 @@
 #define MAGIC_NUMBER 0x52504E43
 #define VERSION 1
 #define BUFFER_SIZE 4096
+// lease on the service directory registration, renewed in the background
+// by svcDirClient. If the server dies the directory drops it after this.
+#define SERVICE_LEASE 15
 
 static volatile bool server_running = true;
 static std::string global_service_name;
 static std::string global_hostname;
 static uint16_t global_port;
 
+static volatile sig_atomic_t received_signal = 0;
+
 void signal_handler(int signum) {
-    std::cout << "\nReceived signal " << signum << ", shutting down..." << std::endl;
+    received_signal = signum;
     server_running = false;
 }
 
@@ -196,6 +202,8 @@ void run_server(uint16_t port, const std::string& service_name, bool isPrimary,
                 const std::string& primaryHost, uint16_t primaryPort,
                 const std::vector<uint16_t>& replicaPorts) {
     RPNCalculator calc;
+
+    svcLog::start();
     
     global_service_name = service_name;
     global_hostname = "localhost";
@@ -215,20 +223,20 @@ void run_server(uint16_t port, const std::string& service_name, bool isPrimary,
     
     svcDir::serviceServer svcServer;
     if (!service_name.empty()) {
-        std::cout << "Registering service '" << service_name << "' at " 
-                  << global_hostname << ":" << port << std::endl;
+        SVCLOG(svcLog::lvlInfo, "Registering service '{}' at {}:{}", service_name, global_hostname, port);
         
         svcDir::serverEntity server = {global_hostname, port};
-        if (svcServer.registerService(service_name, server)) {
-            std::cout << "Successfully registered with service directory" << std::endl;
+        if (svcServer.registerService(service_name, server, SERVICE_LEASE)) {
+            SVCLOG(svcLog::lvlInfo, "Successfully registered with service directory");
         } else {
-            std::cerr << "Failed to register with service directory" << std::endl;
+            SVCLOG(svcLog::lvlError, "Failed to register with service directory");
         }
     }
     
     int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
     if (sockfd < 0) {
-        std::cerr << "Error creating socket" << std::endl;
+        SVCLOG(svcLog::lvlError, "Error creating socket");
+        svcLog::stop();
         return;
     }
     
@@ -239,12 +247,13 @@ void run_server(uint16_t port, const std::string& service_name, bool isPrimary,
     servaddr.sin_port = htons(port);
 
     if (bind(sockfd, (struct sockaddr*)&servaddr, sizeof(servaddr)) < 0) {
-        std::cerr << "Error binding socket to port " << port << std::endl;
+        SVCLOG(svcLog::lvlError, "Error binding socket to port {}", port);
         close(sockfd);
+        svcLog::stop();
         return;
     }
     
-    std::cout << "Server listening on port " << port << std::endl;
+    SVCLOG(svcLog::lvlInfo, "Server listening on port {}", port);
     
     struct timeval tv;
     tv.tv_sec = 1;
@@ -267,17 +276,17 @@ void run_server(uint16_t port, const std::string& service_name, bool isPrimary,
         
         rpn::RPCMessage request;
         if (!request.ParseFromArray(buffer, recv_len)) {
-            std::cerr << "Error parsing request" << std::endl;
+            SVCLOG(svcLog::lvlWarn, "Error parsing request from port {}", srcPort);
             continue;
         }
         
         if (request.magic() != MAGIC_NUMBER) {
-            std::cerr << "Invalid magic number" << std::endl;
+            SVCLOG(svcLog::lvlWarn, "Invalid magic number {}", request.magic());
             continue;
         }
         
         if (request.version() != VERSION) {
-            std::cerr << "Invalid version" << std::endl;
+            SVCLOG(svcLog::lvlWarn, "Invalid version {}", request.version());
             continue;
         }
         
@@ -322,16 +331,21 @@ void run_server(uint16_t port, const std::string& service_name, bool isPrimary,
                (struct sockaddr*)&client_addr, client_len);
     }
     
+    if (received_signal != 0) {
+        SVCLOG(svcLog::lvlInfo, "Received signal {}, shutting down...", (int)received_signal);
+    }
+
     if (!service_name.empty()) {
-        std::cout << "Deregistering service '" << service_name << "'" << std::endl;
+        SVCLOG(svcLog::lvlInfo, "Deregistering service '{}'", service_name);
         svcDir::serverEntity server = {global_hostname, global_port};
         if (svcServer.removeService(service_name, server)) {
-            std::cout << "Successfully deregistered from service directory" << std::endl;
+            SVCLOG(svcLog::lvlInfo, "Successfully deregistered from service directory");
         } else {
-            std::cerr << "Failed to deregister from service directory" << std::endl;
+            SVCLOG(svcLog::lvlError, "Failed to deregister from service directory");
         }
     }
     
     close(sockfd);
-    std::cout << "Server shut down cleanly" << std::endl;
+    SVCLOG(svcLog::lvlInfo, "Server shut down cleanly");
+    svcLog::stop();
 }
\ No newline at end of file
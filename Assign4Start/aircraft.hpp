@@ -1,3 +1,6 @@
+#ifndef __AIRCRAFT_H__
+#define __AIRCRAFT_H__
+
 #include <iostream>
 #include <fstream>
 #include <sstream>
@@ -31,6 +34,10 @@ class Aircraft
     private:
         string         m_line;
 	void initVals();
+
+	friend class AircraftReader;
 };
 
 istream& operator>>(istream& str, Aircraft& data);
+
+#endif
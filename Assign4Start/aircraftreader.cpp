@@ -0,0 +1,132 @@
+#include <charconv>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "aircraftreader.hpp"
+
+AircraftReader::AircraftReader(const string& fileName) {
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0) {
+	return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+	m_size = st.st_size;
+	if (m_size == 0) {
+	    // nothing to map, but nothing wrong either
+	    m_failed = false;
+	} else {
+	    void* p = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	    if (p != MAP_FAILED) {
+		// read front to back, let the kernel read ahead
+		madvise(p, m_size, MADV_SEQUENTIAL);
+		m_data = (const char*)p;
+		m_pos = m_data;
+		m_end = m_data + m_size;
+		m_failed = false;
+	    }
+	}
+    }
+    // the mapping stays valid after the file is closed
+    close(fd);
+}
+
+AircraftReader::~AircraftReader() {
+    if (m_data != nullptr) {
+	munmap((void*)m_data, m_size);
+    }
+}
+
+// the next line without its end of line, m_pos is left at the start
+// of the line after it.
+string_view AircraftReader::nextLine() {
+    const char* start = m_pos;
+    const char* nl = (const char*)memchr(start, '\n', m_end - start);
+    const char* stop = nl == nullptr ? m_end : nl;
+    m_pos = nl == nullptr ? m_end : nl + 1;
+    if (stop > start && stop[-1] == '\r') {
+	stop--;
+    }
+    return string_view(start, stop - start);
+}
+
+void AircraftReader::skipLine() {
+    if (m_pos < m_end) {
+	nextLine();
+    }
+}
+
+// the cell at the front of line, which is left just past its comma.
+// Empty once the line has run out.
+static inline string_view nextCell(string_view& line) {
+    const char* comma = (const char*)memchr(line.data(), ',', line.size());
+    if (comma == nullptr) {
+	string_view cell = line;
+	line = string_view(line.data() + line.size(), 0);
+	return cell;
+    }
+    size_t len = comma - line.data();
+    string_view cell(line.data(), len);
+    line.remove_prefix(len + 1);
+    return cell;
+}
+
+// an empty or bad cell leaves value as it is. Integers stop at a '.',
+// as stoll did, so the fractional times read as whole seconds.
+template <typename T>
+static inline void toNumber(string_view cell, T& value) {
+    from_chars(cell.data(), cell.data() + cell.size(), value);
+}
+
+static inline bool isTrue(string_view cell) {
+    return cell == "True";
+}
+
+// time,icao24,lat,lon,velocity,heading,vertrate,callsign,onground,alert,spi,squawk,baroaltitude,geoaltitude,lastposupdate,lastcontact
+
+bool AircraftReader::readNextRow(Aircraft& data) {
+    string_view line;
+    do {
+	if (m_pos >= m_end) {
+	    return false;
+	}
+	line = nextLine();
+    } while (line.empty());
+
+    data.initVals();
+
+    toNumber(nextCell(line), data.time);
+    string_view cell = nextCell(line);
+    data.icao24.assign(cell.data(), cell.size());
+    toNumber(nextCell(line), data.lat);
+    toNumber(nextCell(line), data.lon);
+    toNumber(nextCell(line), data.velocity);
+    toNumber(nextCell(line), data.heading);
+    toNumber(nextCell(line), data.vertrate);
+
+    // callsign, padded with spaces in the file
+    cell = nextCell(line);
+    while (!cell.empty() && isspace((unsigned char)cell.back())) {
+	cell.remove_suffix(1);
+    }
+    if (cell.empty()) {
+	data.callsign = "unknown";
+    } else {
+	data.callsign.assign(cell.data(), cell.size());
+    }
+
+    data.onground = isTrue(nextCell(line));
+    data.alert = isTrue(nextCell(line));
+    data.spi = isTrue(nextCell(line));
+    // squawk - acutally octal value, but we treat it as decimal for convineience
+    toNumber(nextCell(line), data.squawk);
+    toNumber(nextCell(line), data.baroaltitude);
+    toNumber(nextCell(line), data.geoaltitude);
+    toNumber(nextCell(line), data.lastposupdate);
+    toNumber(nextCell(line), data.lastcontact);
+    return true;
+}
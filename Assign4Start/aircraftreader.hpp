@@ -0,0 +1,50 @@
+#ifndef __AIRCRAFTREADER_H__
+#define __AIRCRAFTREADER_H__
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+#include "aircraft.hpp"
+
+//
+// Reads the same CSV files as Aircraft::readNextRow, but maps the whole
+// file into memory and parses each row where it lies. Cells are found
+// with memchr and numbers converted with from_chars, so there are no
+// temporary strings or streams. icao24 and callsign are copied into the
+// Aircraft, they are short enough that std::string keeps them inline,
+// so reading a row doesn't allocate.
+//
+// Needs C++17 for from_chars.
+//
+
+class AircraftReader
+{
+    public:
+        explicit AircraftReader(const string& fileName);
+        ~AircraftReader();
+
+        AircraftReader(const AircraftReader&) = delete;
+        AircraftReader& operator=(const AircraftReader&) = delete;
+
+        // true if the file couldn't be opened or mapped
+        bool fail() const { return m_failed; }
+
+        // skip a line without parsing it, for the column headings
+        void skipLine();
+
+        // fill in data from the next row, false at the end of the file.
+        // Blank lines are skipped.
+        bool readNextRow(Aircraft& data);
+
+    private:
+        const char*    m_data = nullptr;
+        size_t         m_size = 0;
+        const char*    m_pos = nullptr;
+        const char*    m_end = nullptr;
+        bool           m_failed = true;
+
+        string_view nextLine();
+};
+
+#endif
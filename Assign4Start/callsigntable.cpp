@@ -0,0 +1,43 @@
+#include "callsigntable.hpp"
+
+uint32_t CallsignTable::intern(string_view callsign) {
+    uint32_t* found = m_numbers.find(callsign);
+    if (found != nullptr) {
+	return *found;
+    }
+    uint32_t n;
+    if (!m_free.empty()) {
+	n = m_free.back();
+	m_free.pop_back();
+    } else {
+	n = m_entries.size();
+	m_entries.emplace_back();
+    }
+    Entry& e = m_entries[n];
+    e.callsign.assign(callsign);
+    e.icao24.clear();
+    // not seen yet, but not evicted before it is
+    e.lastSeen = m_newest;
+    e.used = true;
+    m_numbers.insert(callsign, n);
+    return n;
+}
+
+void CallsignTable::seen(uint32_t n, string_view icao24, time_t time) {
+    Entry& e = m_entries[n];
+    if (e.icao24 != icao24) {
+	e.icao24.assign(icao24);
+    }
+    e.lastSeen = max(e.lastSeen, time);
+    m_newest = max(m_newest, time);
+}
+
+void CallsignTable::remove(uint32_t n) {
+    Entry& e = m_entries[n];
+    if (!e.used) {
+	return;
+    }
+    m_numbers.erase(e.callsign);
+    e.used = false;
+    m_free.push_back(n);
+}
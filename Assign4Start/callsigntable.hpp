@@ -0,0 +1,95 @@
+#ifndef __CALLSIGNTABLE_H__
+#define __CALLSIGNTABLE_H__
+
+#include <algorithm>
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "flatmap.hpp"
+
+using namespace std;
+
+//
+// Numbers the aircraft a controller is following by callsign, so what it
+// keeps about each one can be a plain array indexed by the number rather
+// than a map looked up by string for every zone. Numbers are small and
+// the ones of removed aircraft are used again, so the arrays only grow
+// to the most aircraft there have been at once.
+//
+// An aircraft goes when DDS says its instance is no longer alive, or
+// when it hasn't been seen for a while. The time is the newest sample
+// time seen, not the clock, so a replay at any speed evicts the same
+// aircraft.
+//
+
+class CallsignTable
+{
+    public:
+        static const uint32_t NONE = UINT32_MAX;
+
+        // the number for callsign, adding it if it's new
+        uint32_t intern(string_view callsign);
+
+        // the number for callsign, NONE if it isn't here
+        uint32_t find(string_view callsign) {
+            uint32_t* n = m_numbers.find(callsign);
+            return n == nullptr ? NONE : *n;
+        }
+
+        // a sample from aircraft n at time
+        void seen(uint32_t n, string_view icao24, time_t time);
+
+        // forget n, its number may be given to the next new callsign
+        void remove(uint32_t n);
+
+        //
+        // remove every aircraft not seen for age seconds, calling f(n)
+        // just before each one goes. Cheap to call for every batch, it
+        // only looks through the table when the time has moved on by an
+        // eighth of age since it last did.
+        //
+        template <typename F>
+        size_t evict(time_t age, F f) {
+            if (age <= 0 || m_newest < m_nextSweep) return 0;
+            m_nextSweep = m_newest + max<time_t>(1, age / 8);
+            size_t evicted = 0;
+            for (uint32_t n = 0; n < m_entries.size(); n++) {
+                if (m_entries[n].used && m_entries[n].lastSeen + age < m_newest) {
+                    f(n);
+                    remove(n);
+                    evicted++;
+                }
+            }
+            return evicted;
+        }
+
+        // how many aircraft there are, and one more than the biggest
+        // number, the size an array indexed by number needs
+        size_t size() const { return m_numbers.size(); }
+        size_t limit() const { return m_entries.size(); }
+
+        const string& callsign(uint32_t n) const { return m_entries[n].callsign; }
+        const string& icao24(uint32_t n) const { return m_entries[n].icao24; }
+
+        // the newest sample time seen
+        time_t now() const { return m_newest; }
+
+    private:
+        struct Entry {
+            string callsign;
+            string icao24;
+            time_t lastSeen = 0;
+            bool   used = false;
+        };
+
+        FlatMap<uint32_t> m_numbers;
+        vector<Entry>     m_entries;
+        vector<uint32_t>  m_free;
+        time_t            m_newest = 0;
+        time_t            m_nextSweep = 0;
+};
+
+#endif
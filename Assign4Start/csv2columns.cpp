@@ -0,0 +1,87 @@
+//
+// Converts an aircraft CSV file to the columns file flights can replay
+// without parsing (see flightcolumns.hpp).
+//
+//   ./csv2columns file.csv file.fcol
+//
+// The columns file is read back and checked against the CSV, and the
+// time to read every row both ways is printed.
+//
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "aircraft.hpp"
+#include "aircraftreader.hpp"
+#include "flightcolumns.hpp"
+
+using namespace std;
+
+static double secondsSince(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 3) {
+	cerr << "usage: " << argv[0] << " file.csv file.fcol" << endl;
+	exit(1);
+    }
+    string csvName = argv[1];
+    string columnsName = argv[2];
+
+    auto start = chrono::steady_clock::now();
+    AircraftReader csv(csvName);
+    if (csv.fail()) {
+	cerr << argv[0] << ": could not open file " << csvName << endl;
+	exit(1);
+    }
+    csv.skipLine();
+    vector<Aircraft> rows;
+    Aircraft aircraft;
+    while (csv.readNextRow(aircraft)) {
+	rows.push_back(aircraft);
+    }
+    double csvSeconds = secondsSince(start);
+
+    if (!FlightColumns::write(columnsName, rows)) {
+	cerr << argv[0] << ": could not write " << columnsName << endl;
+	exit(1);
+    }
+
+    start = chrono::steady_clock::now();
+    FlightColumns columns(columnsName);
+    if (columns.fail() || columns.rows() != rows.size()) {
+	cerr << argv[0] << ": " << columnsName << " does not read back" << endl;
+	exit(1);
+    }
+    double sum = 0.0;
+    for (size_t r = 0; r < columns.rows(); r++) {
+	sum += columns.time(r) + columns.lat(r) + columns.lon(r) + columns.velocity(r) + columns.callsign(r).size();
+    }
+    double columnsSeconds = secondsSince(start);
+
+    // the columns are in time order, the CSV rows may not be
+    stable_sort(rows.begin(), rows.end(), [](const Aircraft& a, const Aircraft& b) { return a.time < b.time; });
+    for (size_t r = 0; r < rows.size(); r++) {
+	columns.get(r, aircraft);
+	const Aircraft& a = rows[r];
+	if (a.time != aircraft.time || a.icao24 != aircraft.icao24 || a.lat != aircraft.lat || a.lon != aircraft.lon
+	    || a.velocity != aircraft.velocity || a.heading != aircraft.heading || a.vertrate != aircraft.vertrate
+	    || a.callsign != aircraft.callsign || a.onground != aircraft.onground || a.alert != aircraft.alert
+	    || a.spi != aircraft.spi || a.squawk != aircraft.squawk || a.baroaltitude != aircraft.baroaltitude
+	    || a.geoaltitude != aircraft.geoaltitude || a.lastposupdate != aircraft.lastposupdate
+	    || a.lastcontact != aircraft.lastcontact) {
+	    cerr << argv[0] << ": row " << r << " does not read back the same" << endl;
+	    exit(1);
+	}
+    }
+
+    size_t times = columns.timesEnd() - columns.timesBegin();
+    cout << columnsName << ": " << rows.size() << " rows, " << columns.names() << " distinct names, "
+	 << times << " distinct times" << endl;
+    cout << "reading the CSV took " << csvSeconds * 1e3 << " ms, mapping and reading the columns "
+	 << columnsSeconds * 1e3 << " ms" << endl;
+    if (sum == 0) cout << "nothing read" << endl;
+}
@@ -0,0 +1,19 @@
+#ifndef __DATALISTENER_H__
+#define __DATALISTENER_H__
+
+#include <functional>
+
+#include "dds/dds.hpp"
+
+// calls f with the reader as soon as it has data
+template <typename T>
+class DataListener : public dds::sub::NoOpDataReaderListener<T>
+{
+public:
+    explicit DataListener(std::function<void(dds::sub::DataReader<T>&)> f) : f(f) {}
+    void on_data_available(dds::sub::DataReader<T>& reader) override { f(reader); }
+private:
+    std::function<void(dds::sub::DataReader<T>&)> f;
+};
+
+#endif
@@ -0,0 +1,135 @@
+#ifndef __FLATMAP_H__
+#define __FLATMAP_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+//
+// FNV-1a, for callsigns. Unlike std::hash it is the same in every
+// process, so it can be used to split aircraft between processes.
+//
+
+inline uint32_t fnv1a(std::string_view s)
+{
+    uint32_t hash = 2166136261u;
+    for (char c : s){
+        hash = (hash ^ (uint8_t)c) * 16777619u;
+    }
+    return hash;
+}
+
+//
+// A hash map from short strings (callsigns) to V, kept in one array
+// with linear probing. A lookup hashes the key once and usually looks
+// at one slot, comparing the stored hash before the string. Keys are
+// found with a string_view, so looking up doesn't build a string, and
+// callsigns fit inside std::string so adding one doesn't allocate
+// either. Removing an entry moves later entries of its run back into
+// the gap, so there are no tombstones to skip.
+//
+
+template <typename V>
+class FlatMap
+{
+    public:
+        FlatMap() : FlatMap(64) {}
+        explicit FlatMap(size_t capacity) : m_slots(roundUp(capacity)) {}
+
+        // the value for key, nullptr if it isn't there
+        V* find(std::string_view key) {
+            uint32_t hash = fnv1a(key);
+            size_t mask = m_slots.size() - 1;
+            for (size_t i = hash & mask; m_slots[i].used; i = (i + 1) & mask){
+                if (m_slots[i].hash == hash && m_slots[i].key == key) return &m_slots[i].value;
+            }
+            return nullptr;
+        }
+
+        // add key, which must not be there already
+        V& insert(std::string_view key, const V& value) {
+            if ((m_count + 1) * 4 > m_slots.size() * 3){
+                grow();
+            }
+            m_count++;
+            return place(fnv1a(key), std::string(key), value);
+        }
+
+        // remove key, false if it wasn't there
+        bool erase(std::string_view key) {
+            uint32_t hash = fnv1a(key);
+            size_t mask = m_slots.size() - 1;
+            size_t i = hash & mask;
+            while (m_slots[i].used && !(m_slots[i].hash == hash && m_slots[i].key == key)){
+                i = (i + 1) & mask;
+            }
+            if (!m_slots[i].used) return false;
+
+            // move back any entry after the gap that can't be found
+            // from its home slot without going through it
+            for (size_t j = (i + 1) & mask; m_slots[j].used; j = (j + 1) & mask){
+                size_t home = m_slots[j].hash & mask;
+                if (((j - home) & mask) >= ((j - i) & mask)){
+                    m_slots[i] = std::move(m_slots[j]);
+                    i = j;
+                }
+            }
+            m_slots[i].used = false;
+            m_slots[i].key.clear();
+            m_count--;
+            return true;
+        }
+
+        size_t size() const { return m_count; }
+
+        // f(key, value) for every entry, in no particular order
+        template <typename F>
+        void forEach(F f) const {
+            for (const Slot& slot : m_slots){
+                if (slot.used) f(slot.key, slot.value);
+            }
+        }
+
+    private:
+        struct Slot {
+            uint32_t    hash = 0;
+            bool        used = false;
+            std::string key;
+            V           value = V();
+        };
+
+        std::vector<Slot> m_slots;
+        size_t            m_count = 0;
+
+        static size_t roundUp(size_t n) {
+            size_t size = 8;
+            while (size < n) size *= 2;
+            return size;
+        }
+
+        V& place(uint32_t hash, std::string&& key, const V& value) {
+            size_t mask = m_slots.size() - 1;
+            size_t i = hash & mask;
+            while (m_slots[i].used){
+                i = (i + 1) & mask;
+            }
+            Slot& slot = m_slots[i];
+            slot.hash = hash;
+            slot.used = true;
+            slot.key = std::move(key);
+            slot.value = value;
+            return slot.value;
+        }
+
+        void grow() {
+            std::vector<Slot> old(m_slots.size() * 2);
+            old.swap(m_slots);
+            for (Slot& slot : old){
+                if (slot.used) place(slot.hash, std::move(slot.key), slot.value);
+            }
+        }
+};
+
+#endif
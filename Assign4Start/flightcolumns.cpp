@@ -0,0 +1,220 @@
+#include <cstring>
+#include <numeric>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "flightcolumns.hpp"
+
+static const char MAGIC[8] = "FLTCOLS";
+
+// bytes each column takes for a row
+static const size_t columnWidth[FlightColumns::NUMCOLUMNS] = {
+    8, 8, 8,            // times
+    8, 8,               // lat, lon
+    4, 4, 4, 4, 4,      // floats
+    4,                  // squawk
+    4, 4,               // name numbers
+    1                   // flags
+};
+
+static inline uint64_t align8(uint64_t n) {
+    return (n + 7) & ~(uint64_t)7;
+}
+
+FlightColumns::FlightColumns(const string& fileName) {
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0) {
+	return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(Header)) {
+	void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p != MAP_FAILED) {
+	    m_data = (const char*)p;
+	    m_size = st.st_size;
+	}
+    }
+    close(fd);
+    if (m_data == nullptr) {
+	return;
+    }
+
+    m_header = (const Header*)m_data;
+    if (!check()) {
+	m_header = nullptr;
+	return;
+    }
+    m_nameOffsets = (const uint32_t*)(m_data + m_header->nameOffsets);
+    m_nameText = m_data + m_header->nameText;
+    m_times = (const TimeEntry*)(m_data + m_header->timeIndex);
+}
+
+FlightColumns::~FlightColumns() {
+    if (m_data != nullptr) {
+	munmap((void*)m_data, m_size);
+    }
+}
+
+// everything the accessors rely on, so they don't have to check
+bool FlightColumns::check() const {
+    const Header& h = *m_header;
+    if (memcmp(h.magic, MAGIC, sizeof(MAGIC)) != 0 || h.byteOrder != BYTEORDER
+	|| h.version != VERSION || h.fileSize != m_size) {
+	return false;
+    }
+    auto inside = [&](uint64_t offset, uint64_t bytes) {
+	return offset % 8 == 0 && offset >= sizeof(Header) && offset <= m_size && bytes <= m_size - offset;
+    };
+    for (int c = 0; c < NUMCOLUMNS; c++) {
+	if (!inside(h.column[c], (uint64_t)h.rows * columnWidth[c])) return false;
+    }
+    if (!inside(h.nameOffsets, ((uint64_t)h.names + 1) * sizeof(uint32_t))
+	|| !inside(h.timeIndex, (uint64_t)h.times * sizeof(TimeEntry))) {
+	return false;
+    }
+    // name offsets must only go up and stay in the text
+    const uint32_t* offsets = (const uint32_t*)(m_data + h.nameOffsets);
+    if (offsets[0] != 0 || !inside(h.nameText, offsets[h.names])) return false;
+    for (uint32_t n = 0; n < h.names; n++) {
+	if (offsets[n] > offsets[n + 1]) return false;
+    }
+    const uint32_t* icao24 = (const uint32_t*)(m_data + h.column[ICAO24]);
+    const uint32_t* callsign = (const uint32_t*)(m_data + h.column[CALLSIGN]);
+    for (uint32_t r = 0; r < h.rows; r++) {
+	if (icao24[r] >= h.names || callsign[r] >= h.names) return false;
+    }
+    const TimeEntry* times = (const TimeEntry*)(m_data + h.timeIndex);
+    uint64_t covered = 0;
+    for (uint32_t t = 0; t < h.times; t++) {
+	if (times[t].row != covered || (t > 0 && times[t].time <= times[t - 1].time)) return false;
+	covered += times[t].count;
+    }
+    return covered == h.rows;
+}
+
+bool FlightColumns::isColumns(const string& fileName) {
+    char magic[sizeof(MAGIC)];
+    ifstream file(fileName, ios::binary);
+    return file.read(magic, sizeof(magic)) && memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+}
+
+void FlightColumns::get(size_t row, Aircraft& data) const {
+    data.time = time(row);
+    data.icao24.assign(icao24(row));
+    data.lat = lat(row);
+    data.lon = lon(row);
+    data.velocity = velocity(row);
+    data.heading = heading(row);
+    data.vertrate = vertrate(row);
+    data.callsign.assign(callsign(row));
+    data.onground = (flags(row) & ONGROUND) != 0;
+    data.alert = (flags(row) & ALERT) != 0;
+    data.spi = (flags(row) & SPI) != 0;
+    data.squawk = squawk(row);
+    data.baroaltitude = baroaltitude(row);
+    data.geoaltitude = geoaltitude(row);
+    data.lastposupdate = lastposupdate(row);
+    data.lastcontact = lastcontact(row);
+}
+
+size_t FlightColumns::rowAt(time_t t) const {
+    const TimeEntry* it = lower_bound(timesBegin(), timesEnd(), t,
+	[](const TimeEntry& e, time_t t) { return e.time < t; });
+    return it == timesEnd() ? rows() : it->row;
+}
+
+//
+// write
+//
+// builds the whole file in memory, then writes it in one go.
+//
+
+bool FlightColumns::write(const string& fileName, const vector<Aircraft>& rows) {
+    // time order, keeping the file's order for rows with the same time
+    vector<uint32_t> order(rows.size());
+    iota(order.begin(), order.end(), 0);
+    stable_sort(order.begin(), order.end(),
+	[&](uint32_t a, uint32_t b) { return rows[a].time < rows[b].time; });
+
+    // number the names in the order they are first seen
+    unordered_map<string, uint32_t> numbers;
+    vector<uint32_t> nameOffsets{0};
+    string nameText;
+    auto number = [&](const string& name) {
+	auto [it, added] = numbers.try_emplace(name, (uint32_t)numbers.size());
+	if (added) {
+	    nameText += name;
+	    nameOffsets.push_back(nameText.size());
+	}
+	return it->second;
+    };
+
+    vector<TimeEntry> times;
+    for (uint32_t i = 0; i < order.size(); i++) {
+	const Aircraft& a = rows[order[i]];
+	if (times.empty() || times.back().time != a.time) {
+	    times.push_back(TimeEntry{a.time, i, 0});
+	}
+	times.back().count++;
+    }
+
+    Header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, MAGIC, sizeof(MAGIC));
+    h.byteOrder = BYTEORDER;
+    h.version = VERSION;
+    h.rows = rows.size();
+    h.times = times.size();
+
+    uint64_t end = align8(sizeof(Header));
+    for (int c = 0; c < NUMCOLUMNS; c++) {
+	h.column[c] = end;
+	end = align8(end + rows.size() * columnWidth[c]);
+    }
+
+    vector<char> file(end);
+    auto put = [&](Column c, size_t row, auto value) {
+	memcpy(file.data() + h.column[c] + row * sizeof(value), &value, sizeof(value));
+    };
+    for (size_t r = 0; r < order.size(); r++) {
+	const Aircraft& a = rows[order[r]];
+	put(TIME, r, (int64_t)a.time);
+	put(LASTPOSUPDATE, r, (int64_t)a.lastposupdate);
+	put(LASTCONTACT, r, (int64_t)a.lastcontact);
+	put(LAT, r, a.lat);
+	put(LON, r, a.lon);
+	put(VELOCITY, r, a.velocity);
+	put(HEADING, r, a.heading);
+	put(VERTRATE, r, a.vertrate);
+	put(BAROALTITUDE, r, a.baroaltitude);
+	put(GEOALTITUDE, r, a.geoaltitude);
+	put(SQUAWK, r, (int32_t)a.squawk);
+	put(ICAO24, r, number(a.icao24));
+	put(CALLSIGN, r, number(a.callsign));
+	put(FLAGS, r, (uint8_t)((a.onground ? ONGROUND : 0) | (a.alert ? ALERT : 0) | (a.spi ? SPI : 0)));
+    }
+    h.names = numbers.size();
+
+    // the names and time index go after the columns
+    h.nameOffsets = end;
+    end = align8(end + nameOffsets.size() * sizeof(uint32_t));
+    h.nameText = end;
+    end = align8(end + nameText.size());
+    h.timeIndex = end;
+    end += times.size() * sizeof(TimeEntry);
+    h.fileSize = end;
+
+    file.resize(end);
+    memcpy(file.data(), &h, sizeof(h));
+    memcpy(file.data() + h.nameOffsets, nameOffsets.data(), nameOffsets.size() * sizeof(uint32_t));
+    memcpy(file.data() + h.nameText, nameText.data(), nameText.size());
+    memcpy(file.data() + h.timeIndex, times.data(), times.size() * sizeof(TimeEntry));
+
+    ofstream out(fileName, ios::binary | ios::trunc);
+    out.write(file.data(), file.size());
+    return out.good();
+}
@@ -0,0 +1,137 @@
+#ifndef __FLIGHTCOLUMNS_H__
+#define __FLIGHTCOLUMNS_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "aircraft.hpp"
+
+//
+// A binary, column by column copy of an aircraft CSV file, made once by
+// csv2columns so replaying it doesn't parse any text. The file is
+//
+//   header        magic, counts and where each part starts
+//   columns       one array per field, rows long, fixed width:
+//                   time, lastposupdate, lastcontact   int64
+//                   lat, lon                           double
+//                   velocity, heading, vertrate,
+//                   baroaltitude, geoaltitude          float
+//                   squawk                             int32
+//                   icao24, callsign                   uint32 name number
+//                   flags                              uint8, onground/alert/spi
+//   names         the distinct icao24 and callsign strings: count+1
+//                 uint32 offsets into the text that follows them
+//   time index    one entry for each run of rows with the same time:
+//                 the time, the first row and how many rows
+//
+// Every part starts on an 8 byte boundary. Rows are in time order
+// (csv2columns sorts them, keeping the file's order for equal times).
+// Numbers are in the byte order of the machine that wrote the file, a
+// file from a machine with the other order fails to open.
+//
+// FlightColumns maps the file and checks once that every part is inside
+// it, after that reading a field is an array lookup.
+//
+
+class FlightColumns
+{
+    public:
+        enum Column { TIME, LASTPOSUPDATE, LASTCONTACT, LAT, LON,
+                      VELOCITY, HEADING, VERTRATE, BAROALTITUDE, GEOALTITUDE,
+                      SQUAWK, ICAO24, CALLSIGN, FLAGS, NUMCOLUMNS };
+
+        enum Flag : uint8_t { ONGROUND = 1, ALERT = 2, SPI = 4 };
+
+        struct Header {
+            char     magic[8];          // "FLTCOLS" and a nul
+            uint32_t byteOrder;         // BYTEORDER as written
+            uint32_t version;
+            uint32_t rows;
+            uint32_t names;
+            uint32_t times;             // time index entries
+            uint32_t pad;
+            uint64_t column[NUMCOLUMNS];
+            uint64_t nameOffsets;
+            uint64_t nameText;
+            uint64_t timeIndex;
+            uint64_t fileSize;
+        };
+
+        struct TimeEntry {
+            int64_t  time;
+            uint32_t row;
+            uint32_t count;
+        };
+
+        static const uint32_t BYTEORDER = 0x01020304;
+        static const uint32_t VERSION = 1;
+
+        explicit FlightColumns(const string& fileName);
+        ~FlightColumns();
+
+        FlightColumns(const FlightColumns&) = delete;
+        FlightColumns& operator=(const FlightColumns&) = delete;
+
+        // true if the file couldn't be mapped or isn't a columns file
+        bool fail() const { return m_header == nullptr; }
+
+        // true if fileName starts with the columns file magic
+        static bool isColumns(const string& fileName);
+
+        // write rows, which need not be in time order, to fileName.
+        static bool write(const string& fileName, const vector<Aircraft>& rows);
+
+        size_t rows() const { return m_header->rows; }
+        size_t names() const { return m_header->names; }
+
+        time_t time(size_t row) const { return column<int64_t>(TIME)[row]; }
+        time_t lastposupdate(size_t row) const { return column<int64_t>(LASTPOSUPDATE)[row]; }
+        time_t lastcontact(size_t row) const { return column<int64_t>(LASTCONTACT)[row]; }
+        double lat(size_t row) const { return column<double>(LAT)[row]; }
+        double lon(size_t row) const { return column<double>(LON)[row]; }
+        float velocity(size_t row) const { return column<float>(VELOCITY)[row]; }
+        float heading(size_t row) const { return column<float>(HEADING)[row]; }
+        float vertrate(size_t row) const { return column<float>(VERTRATE)[row]; }
+        float baroaltitude(size_t row) const { return column<float>(BAROALTITUDE)[row]; }
+        float geoaltitude(size_t row) const { return column<float>(GEOALTITUDE)[row]; }
+        int squawk(size_t row) const { return column<int32_t>(SQUAWK)[row]; }
+        string_view icao24(size_t row) const { return name(icao24Number(row)); }
+        string_view callsign(size_t row) const { return name(callsignNumber(row)); }
+        uint8_t flags(size_t row) const { return column<uint8_t>(FLAGS)[row]; }
+
+        // the name numbers, and the name for a number (below names())
+        uint32_t icao24Number(size_t row) const { return column<uint32_t>(ICAO24)[row]; }
+        uint32_t callsignNumber(size_t row) const { return column<uint32_t>(CALLSIGN)[row]; }
+        string_view name(uint32_t n) const {
+            return string_view(m_nameText + m_nameOffsets[n], m_nameOffsets[n + 1] - m_nameOffsets[n]);
+        }
+
+        // the whole row as an Aircraft, for code that wants one
+        void get(size_t row, Aircraft& data) const;
+
+        // the runs of rows with the same time, in time order
+        const TimeEntry* timesBegin() const { return m_times; }
+        const TimeEntry* timesEnd() const { return m_times + m_header->times; }
+
+        // the first row at or after t, rows() if there is none
+        size_t rowAt(time_t t) const;
+
+    private:
+        const char*       m_data = nullptr;
+        size_t            m_size = 0;
+        const Header*     m_header = nullptr;
+        const uint32_t*   m_nameOffsets = nullptr;
+        const char*       m_nameText = nullptr;
+        const TimeEntry*  m_times = nullptr;
+
+        template <typename T>
+        const T* column(Column c) const { return (const T*)(m_data + m_header->column[c]); }
+
+        bool check() const;
+};
+
+#endif
@@ -7,8 +7,17 @@
 #include <chrono>
 #include <thread>
 #include <map>
+#include <memory>
+#include <algorithm>
+#include <mutex>
+#include <cstdlib>
+
+#include <unistd.h>
 
 #include "aircraft.hpp"
+#include "aircraftreader.hpp"
+#include "flatmap.hpp"
+#include "flightcolumns.hpp"
 
 #include "dds/dds.hpp"
 #include "statekey.hpp"
@@ -21,33 +30,163 @@ using namespace org::eclipse::cyclonedds;
 uint32_t domainID = 7;
 char * programName;
 
-int main(int argc, char * argv[])
+typedef std::chrono::steady_clock replayClock;
+
+// keeps the trace output of the threads apart
+static mutex traceLock;
+
+// what each writer thread keeps between samples
+struct Replay {
+    dds::pub::DataWriter<State::Update>& writer;
+    double speed = 1.0;         // times real time, 0 for as fast as possible
+    bool trace = true;
+    uint32_t thread = 0;
+    bool batch = true;          // the writer batches until write_flush
+    FlatMap<dds::core::InstanceHandle> allAircraft;
+    int count = 0;
+    time_t groupTime = 0;       // time of the samples written since the last flush
+    // the file's first time, and when the replay started. The same for
+    // every thread so they keep the file's timing between them.
+    time_t firstTime = 0;
+    time_t lastTime = 0;
+    replayClock::time_point start;
+    replayClock::time_point end;
+    // the most any sample was sent after its deadline
+    replayClock::duration worstLate = replayClock::duration::zero();
+};
+
+//
+// partitions
+//
+// aircraft are split between processes (-p k/n) and then between the
+// writer threads of a process (-t) by a hash of the callsign. Each
+// aircraft is only ever published by one thread of one process, from
+// its own DataWriter, so its samples go out in the file's order. The
+// hash is fnv1a rather than std::hash so every process agrees on it.
+//
+
+// more writer threads than this is a mistake, not a load test
+static const uint32_t MAX_THREADS = 256;
+
+struct Partition {
+    uint32_t process = 0;
+    uint32_t processes = 1;
+    uint32_t threads = 1;
+
+    // the thread that publishes callsign, or threads if another
+    // process does
+    uint32_t threadFor(string_view callsign) const {
+        uint32_t hash = fnv1a(callsign);
+        if (hash % processes != process) return threads;
+        return (hash / processes) % threads;
+    }
+};
+
+//
+// publish
+//
+// wait until msg is due, then send it on the aircraft's instance.
+//
+// A sample is due (time - first time) / speed after the first one was
+// sent. Each wait is until that deadline rather than for the gap since
+// the last sample, so the time spent sending doesn't add up over the
+// run. A sample that is already late is sent straight away.
+//
+// When batching, the samples with the same time are written into the
+// writer's batch and only sent, together, when the first sample of the
+// next time comes along (or the file ends).
+//
+
+static void publish(Replay& replay, State::Update& msg)
 {
-    time_t lastUsedTime = 0;
-    const string fileName = "../test4.csv";
-    ifstream file(fileName);
-    Aircraft aircraft;
-    string headings; // variable to read the first line of the CSV file
-    map<string,dds::core::InstanceHandle> allAircraft;
-    
-    // save program name
-    programName = argv[0];
-    
-    // check that file opened correctly.
-    if (file.fail()){
-        cerr << programName << ": could not open file " << fileName << endl;
-        exit(1);
+    time_t time = msg.timestamp();
+    if (replay.batch && replay.count > 0 && time != replay.groupTime){
+        replay.writer->write_flush();
+    }
+    replay.groupTime = time;
+    if (replay.speed > 0 && time > replay.firstTime){
+        chrono::duration<double> offset((time - replay.firstTime) / replay.speed);
+        replayClock::time_point due = replay.start + chrono::duration_cast<replayClock::duration>(offset);
+        replayClock::time_point now = replayClock::now();
+        if (due > now){
+            std::this_thread::sleep_until(due);
+        } else {
+            replay.worstLate = max(replay.worstLate, now - due);
+        }
+    }
+
+    // trace output
+    replay.count++;
+    if (replay.trace){
+        lock_guard<mutex> lock(traceLock);
+        if (replay.thread != 0) cout << "Thread " << replay.thread << " ";
+        cout << "Count " << replay.count - 1 << endl;
+        cout << "time " << time << endl;
+        cout << "icao24 " << msg.icao24() << endl;
+        cout << "callsign " << msg.callsign() << endl;
+    }
+
+    // explictly manage instances.
+    dds::core::InstanceHandle* h = replay.allAircraft.find(msg.callsign());
+    if (h == nullptr){
+        // not there, register and add to the map.
+        h = &replay.allAircraft.insert(msg.callsign(), replay.writer.register_instance(msg));
     }
-    
-    // create the main DDS entities Participant, Topic, Publisher and DataWriter
-    cout << programName << ": Domain is " << domainID << endl;
-    dds::domain::DomainParticipant participant(domainID);
-    dds::topic::Topic<State::Update> topic(participant, "Flights");
-    dds::pub::Publisher publisher(participant);
-    dds::pub::DataWriter<State::Update> writer(publisher, topic);
 
-    // Type variable to use when writing
-    State::Update msg(
+    // send the sample
+    replay.writer.write(msg,*h);
+
+    replay.lastTime = max(replay.lastTime, time);
+}
+
+// the rate that was reached by all the threads together, for load tests
+static void report(const vector<Replay>& replays)
+{
+    int count = 0;
+    time_t lastTime = 0;
+    replayClock::time_point end;
+    replayClock::duration worstLate = replayClock::duration::zero();
+    for (const Replay& replay : replays){
+        count += replay.count;
+        lastTime = max(lastTime, replay.lastTime);
+        end = max(end, replay.end);
+        worstLate = max(worstLate, replay.worstLate);
+    }
+    if (count == 0) return;
+    const Replay& first = replays.front();
+    chrono::duration<double> took = end - first.start;
+    double covered = lastTime - first.firstTime;
+    cout << programName << ": published " << count << " samples";
+    if (replays.size() > 1) cout << " on " << replays.size() << " threads";
+    cout << " in " << took.count() << " s, " << count / max(took.count(), 1e-9) << " samples/s";
+    if (covered > 0){
+        cout << ", " << covered / max(took.count(), 1e-9) << " times real time";
+    }
+    cout << endl;
+    if (first.speed > 0){
+        cout << programName << ": samples were sent up to "
+             << chrono::duration<double, milli>(worstLate).count() << " ms after their time" << endl;
+    }
+}
+
+static void usage()
+{
+    cerr << "usage: " << programName << " [-s speed] [-q] [-t threads] [-p k/n] [-i] [file]" << endl
+         << "  -s speed   1 for real time (the default), N for N times real time," << endl
+         << "             max for as fast as possible" << endl
+         << "  -q         no output for each sample" << endl
+         << "  -t threads writer threads, each publishing its share of the aircraft" << endl
+         << "             (1 to " << MAX_THREADS << ")" << endl
+         << "  -p k/n     publish only partition k (0 to n-1) of n, for running n" << endl
+         << "             copies of flights on the same file" << endl
+         << "  -i         send each sample as it is written, no batching" << endl;
+    exit(1);
+}
+
+// Type variable to use when writing
+static State::Update newMessage()
+{
+    return State::Update(
         "abc",  // icao24
         0,	// timestamp.
 	0.0,    // lat
@@ -59,109 +198,258 @@ int main(int argc, char * argv[])
 	7400,   // squawk
 	0.0,	// baroaltitude
 	0.0);   // geoaltigude
+}
+
+// transfer data from helper class to message class
+static void fill(State::Update& msg, const Aircraft& aircraft)
+{
+    msg.timestamp(aircraft.time);
+    msg.icao24(aircraft.icao24);
+    msg.lat(aircraft.lat);
+    msg.lon(aircraft.lon);
+    msg.velocity(aircraft.velocity);
+    msg.heading(aircraft.heading);
+    msg.vertrate(aircraft.vertrate);
+    msg.callsign(aircraft.callsign);
+    msg.squawk(aircraft.squawk);
+    msg.baroaltitude(aircraft.baroaltitude);
+    msg.geoaltitude(aircraft.geoaltitude);
+}
+
+// straight from the mapped columns, the strings are copied into the
+// message's own (short names don't allocate)
+static void fill(State::Update& msg, const FlightColumns& columns, size_t row)
+{
+    msg.timestamp(columns.time(row));
+    string_view icao24 = columns.icao24(row);
+    msg.icao24().assign(icao24.data(), icao24.size());
+    msg.lat(columns.lat(row));
+    msg.lon(columns.lon(row));
+    msg.velocity(columns.velocity(row));
+    msg.heading(columns.heading(row));
+    msg.vertrate(columns.vertrate(row));
+    string_view callsign = columns.callsign(row);
+    msg.callsign().assign(callsign.data(), callsign.size());
+    msg.squawk(columns.squawk(row));
+    msg.baroaltitude(columns.baroaltitude(row));
+    msg.geoaltitude(columns.geoaltitude(row));
+}
+
+//
+// replayColumns, replayCsv
+//
+// one writer thread's share of the file. Every thread goes through the
+// whole file and skips the aircraft that aren't its own. With a columns
+// file that is one array lookup a row, a CSV is parsed by every thread
+// so big files should be converted with csv2columns first.
+//
+
+static void replayColumns(Replay& replay, const FlightColumns& columns, const vector<uint32_t>& threadOf)
+{
+    State::Update msg = newMessage();
+    for (size_t row = 0; row < columns.rows(); row++){
+        if (threadOf[columns.callsignNumber(row)] != replay.thread) continue;
+        fill(msg, columns, row);
+        publish(replay, msg);
+
+        // limit number of updates for testing
+        //if (replay.count > 100){
+        //    break;
+        //}
+    }
+    if (replay.batch) replay.writer->write_flush();
+    replay.end = replayClock::now();
+}
+
+static void replayCsv(Replay& replay, const string& fileName, const Partition& partition)
+{
+    State::Update msg = newMessage();
+    AircraftReader csv(fileName);
+
+    // first line is the column headings, discard them.
+    csv.skipLine();
+
+    // the reader knows how to read the columns in the CSV file
+    // into the aircraft helper class.
+    Aircraft aircraft;
+    while(csv.readNextRow(aircraft))
+    {
+        if (partition.threadFor(aircraft.callsign) != replay.thread) continue;
+        fill(msg, aircraft);
+        publish(replay, msg);
+    }
+    if (replay.batch) replay.writer->write_flush();
+    replay.end = replayClock::now();
+}
+
+// the time of the earliest sample in the file
+static time_t firstTimeIn(const FlightColumns* columns, const string& fileName)
+{
+    if (columns){
+        return columns->rows() == 0 ? 0 : columns->time(0);
+    }
+    AircraftReader csv(fileName);
+    csv.skipLine();
+    Aircraft aircraft;
+    time_t first = 0;
+    while (csv.readNextRow(aircraft)){
+        if (first == 0 || aircraft.time < first) first = aircraft.time;
+    }
+    return first;
+}
+
+//
+// the file is a CSV or a columns file made from one by csv2columns,
+// which replays without parsing.
+//
+//   ./flights [-s speed] [-q] [-t threads] [-p k/n] [-i] [file]
+//
+// speed 100 replays the file 100 times faster than it was recorded,
+// max as fast as the writers take the samples. -q leaves out the
+// output for each sample, which would otherwise set the pace.
+//
+// -t 4 publishes from 4 threads, each with its own DataWriter and a
+// quarter of the aircraft. -p 1/3 publishes only the second of three
+// partitions, so three copies of flights run with -p 0/3, 1/3 and 2/3
+// publish every aircraft once between them.
+//
+// The writers batch samples (Cyclone's WriterBatching) and send each
+// time's samples together, in as few packets as fit them. -i sends
+// every sample on its own as it is written.
+//
+
+int main(int argc, char * argv[])
+{
+    double speed = 1.0;
+    bool trace = true;
+    bool batch = true;
+    Partition partition;
+    unique_ptr<FlightColumns> columns;
+
+    // save program name
+    programName = argv[0];
+
+    int c;
+    while ((c = getopt(argc, argv, "s:qt:p:i")) != -1){
+        switch (c){
+            case 's':
+                speed = string(optarg) == "max" ? 0.0 : atof(optarg);
+                if (speed <= 0 && string(optarg) != "max") usage();
+                break;
+            case 'q':
+                trace = false;
+                break;
+            case 't': {
+                char* end;
+                unsigned long threads = strtoul(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || optarg[0] == '-'
+                    || threads == 0 || threads > MAX_THREADS) usage();
+                partition.threads = threads;
+                break;
+            }
+            case 'p':
+                if (sscanf(optarg, "%u/%u", &partition.process, &partition.processes) != 2
+                    || partition.processes == 0 || partition.process >= partition.processes) usage();
+                break;
+            case 'i':
+                batch = false;
+                break;
+            default:
+                usage();
+        }
+    }
+    if (argc - optind > 1) usage();
+    const string fileName = optind < argc ? argv[optind] : "../test4.csv";
+
+    // check that file opened correctly.
+    bool opened;
+    if (FlightColumns::isColumns(fileName)){
+        columns.reset(new FlightColumns(fileName));
+        opened = !columns->fail();
+    } else {
+        opened = !AircraftReader(fileName).fail();
+    }
+    if (!opened){
+        cerr << programName << ": could not open file " << fileName << endl;
+        exit(1);
+    }
+
+    // create the main DDS entities Participant, Topic, Publisher and a
+    // DataWriter for each thread
+    cout << programName << ": Domain is " << domainID << endl;
+    dds::domain::DomainParticipant participant(domainID);
+    dds::topic::Topic<State::Update> topic(participant, "Flights");
+    dds::pub::Publisher publisher(participant);
+    dds::pub::qos::DataWriterQos writerQos = publisher.default_datawriter_qos();
+    if (batch){
+        writerQos << org::eclipse::cyclonedds::core::policy::WriterBatching::BatchUpdates();
+    }
+    vector<unique_ptr<dds::pub::DataWriter<State::Update>>> writers;
+    for (uint32_t t = 0; t < partition.threads; t++){
+        writers.emplace_back(new dds::pub::DataWriter<State::Update>(publisher, topic, writerQos));
+    }
 
     // wait for subscriber before we start the loop.
     cout << programName << ": waiting for subscriber to start" << endl;
-    dds::core::cond::WaitSet waitset;
-    dds::core::cond::StatusCondition wsc(writer);
-    wsc.enabled_statuses(dds::core::status::StatusMask::publication_matched());
-    waitset.attach_condition(wsc);
     try{
-        while (writer.publication_matched_status().current_count() < 2) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        for (auto& writer : writers){
+            while (writer->publication_matched_status().current_count() < 2) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            }
         }
     }
     catch (const dds::core::Exception &e){
         cerr << programName << ": encountered an exception while waiting for subscriber: \"" << e.what() << "\"" << endl;
         exit(1);
     }
-    
+
+    // the thread for each callsign in a columns file, worked out once
+    vector<uint32_t> threadOf;
+    if (columns){
+        threadOf.resize(columns->names());
+        for (uint32_t n = 0; n < columns->names(); n++){
+            threadOf[n] = partition.threadFor(columns->name(n));
+        }
+    }
+
     //
-    // Process the csv file line by line
+    // Process the file row by row
     //
-    
-    // first line is the column headings, discard them.
-    getline(file,headings);
 
-    // aircraft is a helper class that knows how to read
-    // the columns in the CSV file.
-    
     cout << programName << ": starting the data loop" << endl;
-    
-    int count = 0;
-    while(file >> aircraft)
-    {
-        if (lastUsedTime == 0){
-           // if it the first aircraft, we don't have a last used time
-           // to get the real time intervals right.
-           lastUsedTime = aircraft.time;
-        }
-        
-        if (aircraft.time > lastUsedTime){
-            // if the timestamp of the current aircraft is greater than the current time
-            // then we have to wait until the current time catches up.
-            // in practice there are groups of samples several seconds apart in the data file.
-            
-            // for fast testing
-            //std::this_thread::sleep_for(std::chrono::milliseconds(20));
-            std::this_thread::sleep_for(std::chrono::seconds(aircraft.time - lastUsedTime));
-
-        }
-        
-        // trace output
-        cout << "Count " << count++ << endl;
-        cout << "time " << aircraft.time << endl;
-        cout << "icao24 " << aircraft.icao24 << endl;
-        cout << "callsign " << aircraft.callsign << endl;
-        
-        // transfer data from helper class to message class
-    	msg.timestamp(aircraft.time);
-    	msg.icao24(aircraft.icao24);
-	msg.lat(aircraft.lat);
-	msg.lon(aircraft.lon);
-	msg.velocity(aircraft.velocity);
-	msg.heading(aircraft.heading);
-	msg.vertrate(aircraft.vertrate);
-	msg.callsign(aircraft.callsign);
-	msg.squawk(aircraft.squawk);
-	msg.baroaltitude(aircraft.baroaltitude);
-	msg.geoaltitude(aircraft.geoaltitude);
-        
-        // explictly manage instances.
-        dds::core::InstanceHandle h;
-        map<string,dds::core::InstanceHandle>::iterator it = allAircraft.find(aircraft.callsign);
-        if (it == allAircraft.end()){
-            // not there
-            h = writer.register_instance(msg);
-            // need to add to the map.
-            allAircraft[aircraft.callsign] = h;
-        } else {
-            h = it->second;
-        }
 
-        // send the sample
-	writer.write(msg,h);
-        
-        // only needed for unkeyed version.
-        //std::this_thread::sleep_for(std::chrono::milliseconds(20));
-        
-        // update the time stamp of the last aircraft
-        lastUsedTime = aircraft.time;
-        
-        // limit number of updates for testing
-        //if (count > 100){
-        //    break;
-        //}
+    time_t firstTime = firstTimeIn(columns.get(), fileName);
+    replayClock::time_point start = replayClock::now();
+    vector<Replay> replays;
+    for (uint32_t t = 0; t < partition.threads; t++){
+        replays.push_back(Replay{*writers[t], speed, trace, t, batch});
+        replays.back().firstTime = firstTime;
+        replays.back().start = start;
+    }
+    vector<thread> threads;
+    for (uint32_t t = 0; t < partition.threads; t++){
+        threads.emplace_back([&, t](){
+            Replay& replay = replays[t];
+            if (columns){
+                replayColumns(replay, *columns, threadOf);
+            } else {
+                replayCsv(replay, fileName, partition);
+            }
+        });
     }
-    
+    for (auto& t : threads){
+        t.join();
+    }
+
+    report(replays);
+
     // unregister all of the aircraft
-    map<string,dds::core::InstanceHandle>::iterator it;
-    for (it = allAircraft.begin(); it != allAircraft.end(); it++){
-        cout << "unregistering flight " << it->first << endl;
-        dds::core::InstanceHandle handle = it->second;
-        writer.unregister_instance(handle);
+    for (Replay& replay : replays){
+        replay.allAircraft.forEach([&](const string& callsign, const dds::core::InstanceHandle& handle){
+            if (trace) cout << "unregistering flight " << callsign << endl;
+            replay.writer.unregister_instance(handle);
+        });
     }
 
-    // done
-    file.close();
+    // done, the readers unmap the file
 }
@@ -0,0 +1,115 @@
+//
+// Checks LocalProjection (geo.hpp) against haversine and times both.
+//
+//   ./geo_check [positions]
+//
+// For airports at several latitudes, random positions out to 8, 50 and
+// 250nm are measured both ways and the worst relative error printed.
+// Positions near the 8nm circle are also sorted in and out both ways;
+// any that disagree must be within a metre of it. Exits with 1 if the
+// error inside 50nm is over 0.01% or a disagreement is further out.
+//
+// Then the time for a distance: haversine, the projection one at a time
+// and the projection over an array, as toronto_ad does a take().
+//
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "geo.hpp"
+
+using namespace std;
+
+static const double AIRPORT_LON = -79.6248;
+
+template <typename F>
+static double nsPer(size_t n, F f)
+{
+    auto start = chrono::steady_clock::now();
+    f();
+    chrono::duration<double, nano> took = chrono::steady_clock::now() - start;
+    return took.count() / n;
+}
+
+// n positions up to radius metres from lat/lon, spread evenly over the area
+static void around(double lat, double lon, double radius, size_t n, mt19937_64& gen,
+                   vector<double>& lats, vector<double>& lons)
+{
+    uniform_real_distribution<double> unit(0, 1);
+    double metresPerDegree = EARTH_RADIUS_M * M_PI / 180.0;
+    lats.resize(n);
+    lons.resize(n);
+    for (size_t i = 0; i < n; i++) {
+        double r = radius * sqrt(unit(gen)), bearing = 2 * M_PI * unit(gen);
+        lats[i] = lat + r * cos(bearing) / metresPerDegree;
+        lons[i] = lon + r * sin(bearing) / (metresPerDegree * cos(lat * M_PI / 180.0));
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    size_t n = argc > 1 ? strtoull(argv[1], nullptr, 10) : 1000000;
+    mt19937_64 gen(42);
+    vector<double> lats, lons;
+    bool ok = true;
+
+    cout << "worst error against haversine" << endl;
+    for (double lat : {0.0, 43.6777, 60.0, 70.0}) {
+        LocalProjection proj(lat, AIRPORT_LON);
+        cout << "  lat " << lat << ":";
+        for (double nm : {8.0, 50.0, 250.0}) {
+            around(lat, AIRPORT_LON, nm * METRES_PER_NM, n, gen, lats, lons);
+            double worst = 0;
+            for (size_t i = 0; i < n; i++) {
+                double exact = haversine(lat, AIRPORT_LON, lats[i], lons[i]);
+                if (exact < 1.0) continue;
+                worst = max(worst, fabs(sqrt(proj.distance2(lats[i], lons[i])) - exact) / exact);
+            }
+            cout << "  " << nm << "nm " << worst * 100 << "%";
+            if (nm <= 50 && worst > 1e-4) ok = false;
+        }
+        cout << endl;
+
+        // in or out of the 8nm circle, near its edge
+        double radius = 8 * METRES_PER_NM;
+        around(lat, AIRPORT_LON, radius * 1.01, n, gen, lats, lons);
+        size_t disagree = 0;
+        double furthest = 0;
+        for (size_t i = 0; i < n; i++) {
+            double exact = haversine(lat, AIRPORT_LON, lats[i], lons[i]);
+            if ((exact <= radius) != (proj.distance2(lats[i], lons[i]) <= radius * radius)) {
+                disagree++;
+                furthest = max(furthest, fabs(exact - radius));
+            }
+        }
+        cout << "    8nm circle: " << disagree << " of " << n << " differ, all within " << furthest << " m" << endl;
+        if (furthest > 1.0) ok = false;
+    }
+
+    // timing, around Toronto
+    LocalProjection proj(43.6777, AIRPORT_LON);
+    around(43.6777, AIRPORT_LON, 50 * METRES_PER_NM, n, gen, lats, lons);
+    vector<double> out(n);
+    double sink = 0;
+    double exact = nsPer(n, [&]() {
+        for (size_t i = 0; i < n; i++) out[i] = haversine(43.6777, AIRPORT_LON, lats[i], lons[i]);
+    });
+    sink += out[n / 2];
+    double single = nsPer(n, [&]() {
+        for (size_t i = 0; i < n; i++) out[i] = proj.distance2(lats[i], lons[i]);
+    });
+    sink += out[n / 2];
+    double batch = nsPer(n, [&]() { proj.distance2(lats.data(), lons.data(), n, out.data()); });
+    sink += out[n / 2];
+    cout << "ns a distance: haversine " << exact << "  projection " << single << "  batch " << batch << endl;
+    if (sink == 0) cout << "nothing measured" << endl;
+
+    if (!ok) {
+        cerr << "projection error over the limit" << endl;
+        return 1;
+    }
+    return 0;
+}
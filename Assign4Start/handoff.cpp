@@ -0,0 +1,73 @@
+#include <iostream>
+
+#include "handoff.hpp"
+
+static const double AIRPORT_LAT = 43.6777;
+static const double AIRPORT_LON = -79.6248;
+static const double AD_RADIUS_M = 8.0 * METRES_PER_NM;
+static const float AD_CEILING_FT = 2500.0f;
+
+ZoneConfig torontoAD()
+{
+    return ZoneConfig{"AD", Transfer::Zone::TORONTO_AD, "Centre", Transfer::Zone::TORONTO_CENTRE,
+                      AIRPORT_LAT, AIRPORT_LON, AD_RADIUS_M, AD_CEILING_FT, true, true};
+}
+
+ZoneConfig torontoCentre()
+{
+    return ZoneConfig{"Centre", Transfer::Zone::TORONTO_CENTRE, "AD", Transfer::Zone::TORONTO_AD,
+                      AIRPORT_LAT, AIRPORT_LON, AD_RADIUS_M, AD_CEILING_FT, false, false};
+}
+
+bool HandoffEngine::accept(const Transfer::Handoff& handoff, uint32_t aircraft)
+{
+    if (handoff.destination() != m_zone.zone) return false;
+    state(aircraft).handedOff = false;
+    cout << m_zone.name << ": received handoff for " << handoff.callsign() << endl;
+    return true;
+}
+
+//
+// update
+//
+// the two ways out of the zone, as in the comment on ZoneConfig. For an
+// inside zone "out" is away from the centre and up, for an outside zone
+// it is towards the centre and down.
+//
+
+HandoffEngine::Reason HandoffEngine::update(const State::Update& msg, uint32_t aircraft, double dist2, Transfer::Handoff& handoff)
+{
+    float alt = metresToFeet(msg.baroaltitude());
+    if (m_zone.traceFlights) {
+        cout << m_zone.name << ": got " << msg.callsign() << " dist=" << sqrt(dist2)/METRES_PER_NM << "nm alt=" << alt << "ft" << endl;
+    }
+    AircraftState& st = state(aircraft);
+
+    Reason reason = NONE;
+    if (!st.handedOff) {
+        bool wasInCircle = st.lastDist2 <= m_radius2;
+        bool inCircle = dist2 <= m_radius2;
+        bool wasBelow = st.lastAlt <= m_zone.ceiling;
+        bool below = alt <= m_zone.ceiling;
+        bool leftCircle = m_zone.inside ? (wasInCircle && !inCircle) : (!wasInCircle && inCircle);
+        bool leftCeiling = m_zone.inside ? (wasBelow && !below) : (!wasBelow && below);
+
+        if (st.lastDist2 >= 0 && below && leftCircle) {
+            reason = RADIUS;
+        } else if (st.lastAlt > 0 && inCircle && leftCeiling) {
+            reason = CEILING;
+        }
+        if (reason != NONE) {
+            cout << m_zone.name << ": handoff to " << m_zone.neighbourName << " ("
+                 << (reason == RADIUS ? m_zone.radius/METRES_PER_NM : m_zone.ceiling)
+                 << (reason == RADIUS ? "nm" : "ft") << ") " << msg.callsign() << endl;
+            handoff = Transfer::Handoff(msg.callsign(), msg.icao24(),
+                m_zone.zone, m_zone.neighbour, msg.timestamp());
+            st.handedOff = true;
+        }
+    }
+
+    st.lastDist2 = dist2;
+    st.lastAlt = alt;
+    return reason;
+}
@@ -0,0 +1,100 @@
+#ifndef __HANDOFF_H__
+#define __HANDOFF_H__
+
+#include <string>
+#include <vector>
+
+#include "callsigntable.hpp"
+#include "geo.hpp"
+#include "statekey.hpp"
+#include "transfer.hpp"
+
+using namespace std;
+
+//
+// A zone is a circle and a ceiling. An inside zone (the aerodrome)
+// controls the aircraft within the circle at or below the ceiling and
+// hands them to its neighbour when they leave: cross the circle going
+// out below the ceiling, or climb through the ceiling inside it. An
+// outside zone (the centre) hands them over going the other way, in
+// across the circle below the ceiling or down through the ceiling
+// inside it.
+//
+
+struct ZoneConfig {
+    string         name;            // for the output, "AD"
+    Transfer::Zone zone;
+    string         neighbourName;
+    Transfer::Zone neighbour;       // where aircraft are handed
+    double         lat;             // centre of the circle
+    double         lon;
+    double         radius;          // metres
+    float          ceiling;         // feet
+    bool           inside;
+    bool           traceFlights;    // print every position
+};
+
+// the Toronto aerodrome and centre
+ZoneConfig torontoAD();
+ZoneConfig torontoCentre();
+
+//
+// The handoff decisions for one zone. An engine only holds the zone and
+// what it knows about each aircraft, so one process can run many, with
+// the DDS entities shared between them (zonehost.hpp). Aircraft are
+// given by their number in the host's CallsignTable, what the engine
+// knows is an array indexed by it.
+//
+// Not thread safe, the caller serializes.
+//
+
+class HandoffEngine
+{
+public:
+    enum Reason { NONE, RADIUS, CEILING };
+
+    explicit HandoffEngine(const ZoneConfig& zone)
+        : m_zone(zone), m_projection(zone.lat, zone.lon), m_radius2(zone.radius * zone.radius) {}
+
+    const ZoneConfig& zone() const { return m_zone; }
+
+    // for working out the squared distances of a batch of positions
+    const LocalProjection& projection() const { return m_projection; }
+
+    // a handoff for aircraft has been published, false if it isn't to
+    // this zone
+    bool accept(const Transfer::Handoff& handoff, uint32_t aircraft);
+
+    // a new position. If it means the aircraft goes to the neighbour,
+    // handoff is filled in and the reason returned.
+    Reason update(const State::Update& msg, uint32_t aircraft, Transfer::Handoff& handoff) {
+        return update(msg, aircraft, m_projection.distance2(msg.lat(), msg.lon()), handoff);
+    }
+
+    // the same, given the squared distance from projection()
+    Reason update(const State::Update& msg, uint32_t aircraft, double distance2, Transfer::Handoff& handoff);
+
+    // the aircraft has gone, its number may be used again
+    void forget(uint32_t aircraft) {
+        if (aircraft < m_aircraft.size()) m_aircraft[aircraft] = AircraftState();
+    }
+
+private:
+    struct AircraftState {
+        double lastDist2 = -1.0;       // squared metres
+        float lastAlt = -1.0;
+        bool handedOff = false;
+    };
+
+    ZoneConfig m_zone;
+    LocalProjection m_projection;
+    double m_radius2;
+    vector<AircraftState> m_aircraft;
+
+    AircraftState& state(uint32_t aircraft) {
+        if (aircraft >= m_aircraft.size()) m_aircraft.resize(aircraft + 1);
+        return m_aircraft[aircraft];
+    }
+};
+
+#endif
@@ -0,0 +1,155 @@
+//
+// Times reading an aircraft CSV file with operator>> (getline, a
+// stringstream and stod/stof for every row) against AircraftReader
+// (mapped file, memchr and from_chars), and checks that both read
+// the same records.
+//
+//   ./parse_bench [file] [passes]
+//
+// The file defaults to the Toronto sample. It is small, so it is read
+// passes times (default 2000) to get a steady figure; after the first
+// pass it is in the page cache for both.
+//
+// Heap allocations are counted while each reader runs, AircraftReader
+// should make none per row.
+//
+
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "aircraft.hpp"
+#include "aircraftreader.hpp"
+
+using namespace std;
+
+static size_t allocations = 0;
+
+void* operator new(size_t size) {
+    allocations++;
+    void* p = malloc(size == 0 ? 1 : size);
+    if (p == nullptr) throw bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+// what a pass adds up, so the compiler can't drop the parsing
+struct totals {
+    size_t rows = 0;
+    double sum = 0.0;
+};
+
+static void add(totals& t, const Aircraft& a) {
+    t.rows++;
+    t.sum += a.time + a.lat + a.lon + a.velocity + a.squawk + a.lastcontact + a.callsign.size();
+}
+
+static bool legacyPass(const string& fileName, totals& t) {
+    ifstream file(fileName);
+    if (file.fail()) return false;
+    string headings;
+    getline(file, headings);
+    Aircraft aircraft;
+    while (file >> aircraft) {
+	add(t, aircraft);
+    }
+    return true;
+}
+
+static bool mappedPass(const string& fileName, totals& t) {
+    AircraftReader reader(fileName);
+    if (reader.fail()) return false;
+    reader.skipLine();
+    Aircraft aircraft;
+    while (reader.readNextRow(aircraft)) {
+	add(t, aircraft);
+    }
+    return true;
+}
+
+// floats may differ in the last bit between stof and from_chars
+static bool close(double a, double b) {
+    return a == b || fabs(a - b) <= 1e-6 * max(fabs(a), fabs(b));
+}
+
+static bool same(const Aircraft& a, const Aircraft& b) {
+    return a.time == b.time && a.icao24 == b.icao24 && close(a.lat, b.lat) && close(a.lon, b.lon)
+	&& close(a.velocity, b.velocity) && close(a.heading, b.heading) && close(a.vertrate, b.vertrate)
+	&& a.callsign == b.callsign && a.onground == b.onground && a.alert == b.alert && a.spi == b.spi
+	&& a.squawk == b.squawk && close(a.baroaltitude, b.baroaltitude) && close(a.geoaltitude, b.geoaltitude)
+	&& a.lastposupdate == b.lastposupdate && a.lastcontact == b.lastcontact;
+}
+
+// read the file both ways and compare row by row
+static bool check(const string& fileName) {
+    vector<Aircraft> legacy;
+    ifstream file(fileName);
+    string headings;
+    getline(file, headings);
+    Aircraft aircraft;
+    while (file >> aircraft) {
+	legacy.push_back(aircraft);
+    }
+
+    AircraftReader reader(fileName);
+    reader.skipLine();
+    size_t row = 0;
+    while (reader.readNextRow(aircraft)) {
+	if (row >= legacy.size() || !same(legacy[row], aircraft)) {
+	    cerr << "row " << row + 1 << " reads differently" << endl;
+	    return false;
+	}
+	row++;
+    }
+    if (row != legacy.size()) {
+	cerr << "read " << row << " rows, operator>> read " << legacy.size() << endl;
+	return false;
+    }
+    cout << row << " rows read the same both ways" << endl;
+    return true;
+}
+
+template <typename F>
+static void timePasses(const char* name, const string& fileName, int passes, F pass) {
+    totals t;
+    size_t before = allocations;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < passes; i++) {
+	if (!pass(fileName, t)) {
+	    cerr << "could not read " << fileName << endl;
+	    exit(1);
+	}
+    }
+    chrono::duration<double> took = chrono::steady_clock::now() - start;
+    size_t allocs = allocations - before;
+    cout << name << ": " << t.rows << " rows in " << took.count() << " s, "
+	 << took.count() * 1e9 / t.rows << " ns a row, " << t.rows / took.count() / 1e6 << " M rows/s, "
+	 << (double)allocs / t.rows << " allocations a row (" << t.sum << ")" << endl;
+}
+
+int main(int argc, char* argv[]) {
+    string fileName = argc > 1 ? argv[1] : "../Toronto_2202-06-27-12.csv";
+    int passes = argc > 2 ? atoi(argv[2]) : 2000;
+
+    if (AircraftReader(fileName).fail()) {
+	cerr << argv[0] << ": could not open file " << fileName << endl;
+	exit(1);
+    }
+    if (!check(fileName)) {
+	exit(1);
+    }
+    timePasses("operator>>    ", fileName, passes, legacyPass);
+    timePasses("AircraftReader", fileName, passes, mappedPass);
+}
@@ -0,0 +1,113 @@
+//
+// Times SectorMap::locate and checks it against testing every sector in
+// turn.
+//
+//   ./sector_bench [side] [lookups]
+//
+// The map is side x side sectors (default 20) in two layers, below and
+// above FL240, over the Toronto area. The corners of a square grid are
+// moved about at random so the sectors are uneven four sided polygons
+// that share their edges, as real sectors do. Positions are random over
+// the map and a bit past it, at random heights.
+//
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "sectors.hpp"
+
+using namespace std;
+
+static const double MIN_LAT = 42.0, MAX_LAT = 45.5;
+static const double MIN_LON = -82.0, MAX_LON = -77.0;
+
+static SectorMap build(int side, mt19937_64& gen)
+{
+    // the shared corners, jittered by up to a third of a cell inside
+    uniform_real_distribution<double> jitter(-0.33, 0.33);
+    double dLat = (MAX_LAT - MIN_LAT) / side, dLon = (MAX_LON - MIN_LON) / side;
+    vector<double> lat((side + 1) * (side + 1)), lon(lat.size());
+    for (int r = 0; r <= side; r++) {
+        for (int c = 0; c <= side; c++) {
+            bool edge = r == 0 || c == 0 || r == side || c == side;
+            lat[r * (side + 1) + c] = MIN_LAT + (r + (edge ? 0 : jitter(gen))) * dLat;
+            lon[r * (side + 1) + c] = MIN_LON + (c + (edge ? 0 : jitter(gen))) * dLon;
+        }
+    }
+
+    SectorMap sectors;
+    for (int layer = 0; layer < 2; layer++) {
+        for (int r = 0; r < side; r++) {
+            for (int c = 0; c < side; c++) {
+                int corner[4] = { r * (side + 1) + c, r * (side + 1) + c + 1,
+                                  (r + 1) * (side + 1) + c + 1, (r + 1) * (side + 1) + c };
+                vector<double> la, lo;
+                for (int k : corner) {
+                    la.push_back(lat[k]);
+                    lo.push_back(lon[k]);
+                }
+                sectors.add(to_string(layer) + "-" + to_string(r) + "-" + to_string(c),
+                            layer == 0 ? 0 : 24000, layer == 0 ? 24000 : 60000, la, lo);
+            }
+        }
+    }
+    sectors.index();
+    return sectors;
+}
+
+// what locate does without the grid
+static int everySector(const SectorMap& sectors, double lat, double lon, float alt)
+{
+    for (size_t n = 0; n < sectors.size(); n++) {
+        SectorMap one;
+        const SectorMap::Sector& s = sectors[n];
+        if (alt < s.floor || alt >= s.ceiling) continue;
+        one.add(s.name, s.floor, s.ceiling, s.lat, s.lon);
+        one.index();
+        if (one.locate(lat, lon, alt) == 0) return n;
+    }
+    return SectorMap::NONE;
+}
+
+int main(int argc, char* argv[])
+{
+    int side = argc > 1 ? atoi(argv[1]) : 20;
+    size_t lookups = argc > 2 ? strtoull(argv[2], nullptr, 10) : 10000000;
+    mt19937_64 gen(42);
+    SectorMap sectors = build(side, gen);
+
+    struct Position { double lat, lon; float alt; };
+    uniform_real_distribution<double> lat(MIN_LAT - 0.2, MAX_LAT + 0.2), lon(MIN_LON - 0.2, MAX_LON + 0.2);
+    uniform_real_distribution<float> alt(0, 65000);
+    vector<Position> positions(1 << 16);
+    for (Position& p : positions) {
+        p = Position{lat(gen), lon(gen), alt(gen)};
+    }
+
+    // every position is in exactly the sector testing them all finds
+    size_t outside = 0;
+    for (size_t i = 0; i < 20000; i++) {
+        const Position& p = positions[i % positions.size()];
+        int n = sectors.locate(p.lat, p.lon, p.alt);
+        if (n != everySector(sectors, p.lat, p.lon, p.alt)) {
+            cerr << "locate disagrees at " << p.lat << " " << p.lon << " " << p.alt << endl;
+            return 1;
+        }
+        outside += n == SectorMap::NONE;
+    }
+
+    auto start = chrono::steady_clock::now();
+    size_t sink = 0;
+    for (size_t i = 0; i < lookups; i++) {
+        const Position& p = positions[i & (positions.size() - 1)];
+        sink += sectors.locate(p.lat, p.lon, p.alt);
+    }
+    chrono::duration<double, nano> took = chrono::steady_clock::now() - start;
+
+    cout << sectors.size() << " sectors, " << took.count() / lookups << " ns a lookup ("
+         << outside * 100 / 20000 << "% outside every sector, " << (sink & 1) << ")" << endl;
+    return 0;
+}
@@ -0,0 +1,149 @@
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+
+#include <unistd.h>
+
+#include "zonehost.hpp"
+#include "sectorhandoff.hpp"
+#include "sectors.hpp"
+
+using namespace org::eclipse::cyclonedds;
+
+//
+// controls some of the sectors in a sectors file (sectors.hpp):
+//
+//   sector_host [-l] [-e seconds] sectorsfile [sector...]
+//
+// all of them if none are named. Every position is looked up once in
+// the sector map, and when an aircraft moves from a sector hosted here
+// into any other a Sectors::Handoff is published, so every pair of
+// sectors that share a border hands off without being told about it.
+// Outside all the sectors an aircraft stays with the one it was last
+// in. -l and -e are as for toronto_ad.
+//
+
+// the data may be taken on the main thread (WaitSet) or on DDS threads
+// (listeners), the lock covers both
+struct Host {
+    const SectorMap& sectors;
+    vector<bool> hosted;
+    dds::pub::DataWriter<Sectors::Handoff>& handoffWriter;
+    time_t evictAfter;
+    CallsignTable aircraft;
+    vector<int> sector;             // the sector each was last in, by number
+    mutex lock;
+};
+
+static void takeHandoffs(Host& host, dds::sub::DataReader<Sectors::Handoff>& reader)
+{
+    lock_guard<mutex> guard(host.lock);
+    auto handoffSamples = reader.take();
+    for (auto it = handoffSamples.begin(); it != handoffSamples.end(); ++it) {
+        if (!it->info().valid()) continue;
+        const Sectors::Handoff& h = it->data();
+        if (h.destination() >= host.sectors.size() || !host.hosted[h.destination()]) continue;
+        cout << host.sectors[h.destination()].name << ": received handoff for " << h.callsign() << endl;
+    }
+}
+
+// the aircraft has gone, its number may be used again
+static void forget(Host& host, uint32_t n)
+{
+    host.sector[n] = SectorMap::NONE;
+    host.aircraft.remove(n);
+}
+
+static void position(Host& host, const State::Update& msg)
+{
+    uint32_t n = host.aircraft.intern(msg.callsign());
+    host.aircraft.seen(n, msg.icao24(), msg.timestamp());
+    if (n >= host.sector.size()) host.sector.resize(n + 1, SectorMap::NONE);
+
+    int sector = host.sectors.locate(msg.lat(), msg.lon(), metresToFeet(msg.baroaltitude()));
+    int& last = host.sector[n];
+    if (sector == SectorMap::NONE || sector == last) return;
+
+    if (last != SectorMap::NONE && host.hosted[last]) {
+        cout << host.sectors[last].name << ": handoff to " << host.sectors[sector].name
+             << " " << msg.callsign() << endl;
+        Sectors::Handoff h(msg.callsign(), msg.icao24(), last, sector, msg.timestamp());
+        host.handoffWriter.write(h);
+    }
+    last = sector;
+}
+
+static void takeFlights(Host& host, dds::sub::DataReader<State::Update>& reader)
+{
+    lock_guard<mutex> guard(host.lock);
+    auto flightSamples = reader.take();
+    for (auto it = flightSamples.begin(); it != flightSamples.end(); ++it) {
+        if (it->info().valid()) {
+            position(host, it->data());
+        }
+        // the writer disposed or unregistered it, or went away. If the
+        // sample isn't valid only the key is there.
+        if (it->info().state().instance_state() != dds::sub::status::InstanceState::alive()) {
+            uint32_t n = host.aircraft.find(it->data().callsign());
+            if (n != CallsignTable::NONE) forget(host, n);
+        }
+    }
+    host.aircraft.evict(host.evictAfter, [&](uint32_t n) { host.sector[n] = SectorMap::NONE; });
+}
+
+int main(int argc, char* argv[])
+{
+    bool listeners = false;
+    time_t evictAfter = DEFAULT_EVICT_AFTER;
+    int c;
+    while ((c = getopt(argc, argv, "le:")) != -1) {
+        if (c == 'l') {
+            listeners = true;
+        } else if (c == 'e') {
+            evictAfter = atol(optarg);
+        } else {
+            optind = argc;
+            break;
+        }
+    }
+    if (optind >= argc) {
+        cerr << "usage: " << argv[0] << " [-l] [-e seconds] sectorsfile [sector...]" << endl;
+        return 1;
+    }
+
+    SectorMap sectors;
+    if (!sectors.read(argv[optind])) {
+        return 1;
+    }
+    vector<bool> hosted(sectors.size(), optind + 1 == argc);
+    for (int i = optind + 1; i < argc; i++) {
+        int n = sectors.find(argv[i]);
+        if (n == SectorMap::NONE) {
+            cerr << "no sector " << argv[i] << " in " << argv[optind] << endl;
+            return 1;
+        }
+        hosted[n] = true;
+    }
+
+    dds::domain::DomainParticipant participant(DOMAIN_ID);
+
+    dds::topic::Topic<State::Update> flightTopic(participant, "Flights");
+    dds::topic::Topic<Sectors::Handoff> handoffTopic(participant, "SectorHandoffs");
+
+    dds::pub::Publisher handoffPub(participant);
+    dds::pub::DataWriter<Sectors::Handoff> handoffWriter(handoffPub, handoffTopic);
+
+    dds::sub::Subscriber sub(participant);
+    dds::sub::DataReader<State::Update> flightReader(sub, flightTopic);
+    dds::sub::DataReader<Sectors::Handoff> handoffReader(sub, handoffTopic);
+
+    Host host{sectors, hosted, handoffWriter, evictAfter, {}};
+    for (size_t n = 0; n < sectors.size(); n++) {
+        if (hosted[n]) cout << sectors[n].name << ": waiting for data" << endl;
+    }
+
+    return runHost(handoffReader, flightReader,
+        [&](dds::sub::DataReader<Sectors::Handoff>& reader) { takeHandoffs(host, reader); },
+        [&](dds::sub::DataReader<State::Update>& reader) { takeFlights(host, reader); },
+        listeners);
+}
@@ -0,0 +1,151 @@
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+
+#include "sectors.hpp"
+
+bool SectorMap::read(const string& fileName) {
+    ifstream file(fileName);
+    if (!file) {
+	cerr << "can't open " << fileName << endl;
+	return false;
+    }
+    string line;
+    int lineNo = 0;
+    while (getline(file, line)) {
+	lineNo++;
+	line = line.substr(0, line.find('#'));
+	istringstream in(line);
+	string name;
+	if (!(in >> name)) continue;
+
+	float floor = 0, ceiling = 0;
+	vector<double> numbers, lat, lon;
+	double x;
+	if (in >> floor >> ceiling) {
+	    while (in >> x) numbers.push_back(x);
+	}
+	for (size_t i = 0; i + 1 < numbers.size(); i += 2) {
+	    lat.push_back(numbers[i]);
+	    lon.push_back(numbers[i + 1]);
+	}
+	if (!in.eof() || numbers.size() % 2 != 0 || lat.size() < 3 || !(floor < ceiling)) {
+	    cerr << fileName << ":" << lineNo << ": expected name floor ceiling and three or more lat lon corners" << endl;
+	    return false;
+	}
+	if (find(name) != NONE) {
+	    cerr << fileName << ":" << lineNo << ": sector " << name << " is there twice" << endl;
+	    return false;
+	}
+	add(name, floor, ceiling, lat, lon);
+    }
+    index();
+    return true;
+}
+
+void SectorMap::add(const string& name, float floor, float ceiling,
+		    const vector<double>& lat, const vector<double>& lon) {
+    Sector s{name, floor, ceiling, lat, lon,
+	     *min_element(lat.begin(), lat.end()), *max_element(lat.begin(), lat.end()),
+	     *min_element(lon.begin(), lon.end()), *max_element(lon.begin(), lon.end())};
+    m_sectors.push_back(s);
+}
+
+int SectorMap::find(const string& name) const {
+    for (size_t n = 0; n < m_sectors.size(); n++) {
+	if (m_sectors[n].name == name) return n;
+    }
+    return NONE;
+}
+
+//
+// index
+//
+// about four cells for each sector each way, so a cell is usually
+// touched by one or two sectors. A sector is listed in every cell its
+// bounding box touches; the polygon test sorts out the rest.
+//
+
+void SectorMap::index() {
+    m_cellStart.assign(1, 0);
+    m_cellSectors.clear();
+    m_rows = m_cols = 0;
+    if (m_sectors.empty()) return;
+
+    double maxLat = m_sectors[0].maxLat, maxLon = m_sectors[0].maxLon;
+    m_minLat = m_sectors[0].minLat;
+    m_minLon = m_sectors[0].minLon;
+    for (const Sector& s : m_sectors) {
+	m_minLat = min(m_minLat, s.minLat);
+	m_minLon = min(m_minLon, s.minLon);
+	maxLat = max(maxLat, s.maxLat);
+	maxLon = max(maxLon, s.maxLon);
+    }
+    int side = max(1, min(1024, (int)ceil(4 * sqrt((double)m_sectors.size()))));
+    m_rows = m_cols = side;
+    // a little over so the top and right edges fall in the last cell
+    m_cellLat = max((maxLat - m_minLat) / side, 1e-9) * 1.000001;
+    m_cellLon = max((maxLon - m_minLon) / side, 1e-9) * 1.000001;
+
+    auto cellsOf = [&](const Sector& s, int& r0, int& r1, int& c0, int& c1) {
+	r0 = (int)((s.minLat - m_minLat) / m_cellLat);
+	r1 = min(m_rows - 1, (int)((s.maxLat - m_minLat) / m_cellLat));
+	c0 = (int)((s.minLon - m_minLon) / m_cellLon);
+	c1 = min(m_cols - 1, (int)((s.maxLon - m_minLon) / m_cellLon));
+    };
+
+    // count, then fill, so each cell's list is one run of the array
+    vector<uint32_t> count(m_rows * m_cols + 1, 0);
+    int r0, r1, c0, c1;
+    for (const Sector& s : m_sectors) {
+	cellsOf(s, r0, r1, c0, c1);
+	for (int r = r0; r <= r1; r++) {
+	    for (int c = c0; c <= c1; c++) {
+		count[r * m_cols + c + 1]++;
+	    }
+	}
+    }
+    for (size_t i = 1; i < count.size(); i++) {
+	count[i] += count[i - 1];
+    }
+    m_cellStart = count;
+    m_cellSectors.resize(m_cellStart.back());
+    for (uint32_t n = 0; n < m_sectors.size(); n++) {
+	cellsOf(m_sectors[n], r0, r1, c0, c1);
+	for (int r = r0; r <= r1; r++) {
+	    for (int c = c0; c <= c1; c++) {
+		m_cellSectors[count[r * m_cols + c]++] = n;
+	    }
+	}
+    }
+}
+
+// even-odd rule: a ray going east from the point crosses the edges an
+// odd number of times if it's inside
+bool SectorMap::inside(const Sector& s, double lat, double lon) {
+    bool in = false;
+    size_t n = s.lat.size();
+    for (size_t i = 0, j = n - 1; i < n; j = i++) {
+	if ((s.lat[i] > lat) != (s.lat[j] > lat)
+	    && lon < s.lon[j] + (lat - s.lat[j]) * (s.lon[i] - s.lon[j]) / (s.lat[i] - s.lat[j])) {
+	    in = !in;
+	}
+    }
+    return in;
+}
+
+int SectorMap::locate(double lat, double lon, float altFeet) const {
+    double r = (lat - m_minLat) / m_cellLat;
+    double c = (lon - m_minLon) / m_cellLon;
+    if (!(r >= 0 && r < m_rows && c >= 0 && c < m_cols)) return NONE;
+    int cell = (int)r * m_cols + (int)c;
+    for (uint32_t i = m_cellStart[cell]; i < m_cellStart[cell + 1]; i++) {
+	const Sector& s = m_sectors[m_cellSectors[i]];
+	if (altFeet < s.floor || altFeet >= s.ceiling
+	    || lat < s.minLat || lat > s.maxLat || lon < s.minLon || lon > s.maxLon) {
+	    continue;
+	}
+	if (inside(s, lat, lon)) return m_cellSectors[i];
+    }
+    return NONE;
+}
@@ -0,0 +1,78 @@
+#ifndef __SECTORS_H__
+#define __SECTORS_H__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "aircraft.hpp"
+
+//
+// Airspace split into sectors, each a polygon on the map between a floor
+// and a ceiling. A sectors file has one sector per line:
+//
+//   name floor ceiling lat lon lat lon ...
+//
+// heights in feet, then three or more corners in order. # starts a
+// comment. Sectors may overlap, a position in more than one is in the
+// one listed first, so a small sector can sit inside a big one listed
+// after it. A sector's number is its place in the file and is what
+// goes in a Sector::Handoff, every process must read the same file.
+//
+// Polygons are tested on the lat/lon plane, which is close enough for
+// sectors of a few hundred miles that don't cross the 180th meridian.
+//
+// Finding the sector for a position uses a grid over the whole map.
+// Each cell lists the sectors whose bounding box touches it, so only
+// those few are tested however many sectors there are.
+//
+
+class SectorMap
+{
+    public:
+        static const int NONE = -1;
+
+        struct Sector {
+            string         name;
+            float          floor;       // feet
+            float          ceiling;
+            vector<double> lat;         // the corners
+            vector<double> lon;
+            double         minLat, maxLat, minLon, maxLon;
+        };
+
+        // read a sectors file, false with a message on cerr if it can't
+        bool read(const string& fileName);
+
+        // add a sector, call index() when they're all added
+        void add(const string& name, float floor, float ceiling,
+                 const vector<double>& lat, const vector<double>& lon);
+
+        // build the grid, after adding sectors and before locate()
+        void index();
+
+        // the sector a position is in, NONE if it's in none of them
+        int locate(double lat, double lon, float altFeet) const;
+
+        size_t size() const { return m_sectors.size(); }
+        const Sector& operator[](int n) const { return m_sectors[n]; }
+
+        // the number of the sector called name, NONE if there isn't one
+        int find(const string& name) const;
+
+    private:
+        vector<Sector>   m_sectors;
+
+        // the grid: cell (row, col) has the sectors
+        // m_cellSectors[m_cellStart[cell] .. m_cellStart[cell + 1]),
+        // in file order
+        double           m_minLat = 0, m_minLon = 0;
+        double           m_cellLat = 1, m_cellLon = 1;
+        int              m_rows = 0, m_cols = 0;
+        vector<uint32_t> m_cellStart;
+        vector<uint32_t> m_cellSectors;
+
+        static bool inside(const Sector& s, double lat, double lon);
+};
+
+#endif
@@ -0,0 +1,60 @@
+#include <cstdlib>
+#include <iostream>
+#include <map>
+
+#include <unistd.h>
+
+#include "zonehost.hpp"
+
+//
+// several zones in one process, sharing one DDS participant:
+//
+//   zone_host [-l] [zone...]
+//
+// zones are named from the list below, all of them if none are given.
+// -l and -e are as for toronto_ad.
+//
+
+static const map<string, ZoneConfig (*)()> knownZones = {
+    {"ad", torontoAD},
+    {"centre", torontoCentre},
+};
+
+static void usage(const char* name)
+{
+    cerr << "usage: " << name << " [-l] [-e seconds] [zone...], zones are";
+    for (auto& z : knownZones) cerr << " " << z.first;
+    cerr << endl;
+}
+
+int main(int argc, char* argv[])
+{
+    bool listeners = false;
+    time_t evictAfter = DEFAULT_EVICT_AFTER;
+    int c;
+    while ((c = getopt(argc, argv, "le:")) != -1) {
+        if (c == 'l') {
+            listeners = true;
+        } else if (c == 'e') {
+            evictAfter = atol(optarg);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    vector<ZoneConfig> zones;
+    for (int i = optind; i < argc; i++) {
+        auto it = knownZones.find(argv[i]);
+        if (it == knownZones.end()) {
+            usage(argv[0]);
+            return 1;
+        }
+        zones.push_back(it->second());
+    }
+    if (zones.empty()) {
+        for (auto& z : knownZones) zones.push_back(z.second());
+    }
+
+    return runZones(zones, listeners, evictAfter);
+}
@@ -0,0 +1,127 @@
+#include <iostream>
+#include <mutex>
+
+#include "zonehost.hpp"
+
+using namespace org::eclipse::cyclonedds;
+
+// the zones and what they publish. The data may be taken on the main
+// thread (WaitSet) or on DDS threads (listeners), the lock covers both.
+struct Host {
+    dds::pub::DataWriter<Transfer::Handoff>& handoffWriter;
+    time_t evictAfter;
+    vector<HandoffEngine> engines;
+    CallsignTable aircraft;
+    mutex lock;
+    // the batch being decided, kept to reuse the space
+    vector<const State::Update*> batch;
+    vector<uint32_t> numbers;
+    vector<double> lat, lon, dist2;
+    vector<uint32_t> gone;
+};
+
+static void forget(Host& host, uint32_t n)
+{
+    for (HandoffEngine& engine : host.engines) {
+        engine.forget(n);
+    }
+    host.aircraft.remove(n);
+}
+
+// handoffs to these zones, taken before the flights that come with them
+static void takeHandoffs(Host& host, dds::sub::DataReader<Transfer::Handoff>& reader)
+{
+    lock_guard<mutex> guard(host.lock);
+    auto handoffSamples = reader.take();
+    for (auto it = handoffSamples.begin(); it != handoffSamples.end(); ++it) {
+        if (!it->info().valid()) continue;
+        uint32_t n = host.aircraft.intern(it->data().callsign());
+        for (HandoffEngine& engine : host.engines) {
+            engine.accept(it->data(), n);
+        }
+    }
+}
+
+//
+// the positions in a take() are gathered into arrays once, then each
+// zone works out all their distances in one pass before deciding.
+// Aircraft whose instances are no longer alive (the writer disposed or
+// unregistered them, or went away) are forgotten after the batch, and
+// any not seen for evictAfter seconds.
+//
+
+static void takeFlights(Host& host, dds::sub::DataReader<State::Update>& reader)
+{
+    lock_guard<mutex> guard(host.lock);
+    auto flightSamples = reader.take();
+    vector<const State::Update*>& msgs = host.batch;
+    msgs.clear();
+    host.numbers.clear();
+    host.lat.clear();
+    host.lon.clear();
+    host.gone.clear();
+    for (auto it = flightSamples.begin(); it != flightSamples.end(); ++it) {
+        if (it->info().valid()) {
+            const State::Update& msg = it->data();
+            uint32_t n = host.aircraft.intern(msg.callsign());
+            host.aircraft.seen(n, msg.icao24(), msg.timestamp());
+            host.numbers.push_back(n);
+            msgs.push_back(&msg);
+            host.lat.push_back(msg.lat());
+            host.lon.push_back(msg.lon());
+        }
+        // checked after the sample is taken in, so the last position of
+        // an aircraft that is going still counts. If the sample isn't
+        // valid only the key is there.
+        if (it->info().state().instance_state() != dds::sub::status::InstanceState::alive()) {
+            uint32_t n = host.aircraft.find(it->data().callsign());
+            if (n != CallsignTable::NONE) host.gone.push_back(n);
+        }
+    }
+    host.dist2.resize(msgs.size());
+
+    Transfer::Handoff h;
+    for (HandoffEngine& engine : host.engines) {
+        engine.projection().distance2(host.lat.data(), host.lon.data(), msgs.size(), host.dist2.data());
+        for (size_t i = 0; i < msgs.size(); i++) {
+            if (engine.update(*msgs[i], host.numbers[i], host.dist2[i], h) != HandoffEngine::NONE) {
+                host.handoffWriter.write(h);
+            }
+        }
+    }
+
+    for (uint32_t n : host.gone) {
+        forget(host, n);
+    }
+    host.aircraft.evict(host.evictAfter, [&](uint32_t n) {
+        for (HandoffEngine& engine : host.engines) {
+            engine.forget(n);
+        }
+    });
+}
+
+int runZones(const vector<ZoneConfig>& zones, bool listeners, time_t evictAfter)
+{
+    dds::domain::DomainParticipant participant(DOMAIN_ID);
+
+    dds::topic::Topic<State::Update> flightTopic(participant, "Flights");
+    dds::topic::Topic<Transfer::Handoff> handoffTopic(participant, "Handoffs");
+
+    dds::pub::Publisher handoffPub(participant);
+    dds::pub::DataWriter<Transfer::Handoff> handoffWriter(handoffPub, handoffTopic);
+
+    dds::sub::Subscriber sub(participant);
+    dds::sub::DataReader<State::Update> flightReader(sub, flightTopic);
+    dds::sub::DataReader<Transfer::Handoff> handoffReader(sub, handoffTopic);
+
+    Host host{handoffWriter, evictAfter, {}};
+    for (const ZoneConfig& zone : zones) {
+        host.engines.emplace_back(zone);
+        cout << zone.name << ": waiting for data" << endl;
+    }
+
+    return runHost(handoffReader, flightReader,
+        [&](dds::sub::DataReader<Transfer::Handoff>& reader) { takeHandoffs(host, reader); },
+        [&](dds::sub::DataReader<State::Update>& reader) { takeFlights(host, reader); },
+        listeners);
+}
@@ -0,0 +1,80 @@
+#ifndef __ZONEHOST_H__
+#define __ZONEHOST_H__
+
+#include <iostream>
+#include <vector>
+
+#include <unistd.h>
+
+#include "datalistener.hpp"
+#include "handoff.hpp"
+
+// the domain the hosts join, the one flights publishes in
+static const uint32_t DOMAIN_ID = 7;
+
+//
+// Runs zones in this process: one DDS participant, one flight reader,
+// one handoff reader and one handoff writer however many zones there
+// are. Every flight is given to every zone and a handoff to the zones
+// it is for. Handoffs between two zones in the process still go through
+// DDS, so a zone can't tell whether its neighbour is here or elsewhere.
+//
+// With listeners the decisions are made on the DDS thread that received
+// the data, otherwise the calling thread waits for it on a WaitSet.
+// Aircraft not seen for evictAfter seconds of sample time are forgotten,
+// 0 keeps them until their instance goes. Only returns if waiting fails.
+//
+
+static const time_t DEFAULT_EVICT_AFTER = 600;
+
+int runZones(const vector<ZoneConfig>& zones, bool listeners, time_t evictAfter);
+
+//
+// The loop under runZones and sector_host: passes each reader to its
+// take function whenever it has data, handoffs before flights. With
+// listeners the takes run on the DDS threads, so they must lock
+// whatever they share, and this never returns. Otherwise they run on
+// the calling thread, woken by a WaitSet, and it returns 1 if waiting
+// fails.
+//
+
+template <typename H, typename F, typename TakeH, typename TakeF>
+int runHost(dds::sub::DataReader<H>& handoffReader, dds::sub::DataReader<F>& flightReader,
+            TakeH takeHandoffs, TakeF takeFlights, bool listeners)
+{
+    if (listeners) {
+        DataListener<H> handoffListener(takeHandoffs);
+        DataListener<F> flightListener(takeFlights);
+        handoffReader.listener(&handoffListener, dds::core::status::StatusMask::data_available());
+        flightReader.listener(&flightListener, dds::core::status::StatusMask::data_available());
+        // nothing for this thread to do
+        while (true) {
+            pause();
+        }
+    }
+
+    dds::core::cond::WaitSet waitset;
+    dds::core::cond::StatusCondition handoffCond(handoffReader);
+    handoffCond.enabled_statuses(dds::core::status::StatusMask::data_available());
+    waitset.attach_condition(handoffCond);
+    dds::core::cond::StatusCondition flightCond(flightReader);
+    flightCond.enabled_statuses(dds::core::status::StatusMask::data_available());
+    waitset.attach_condition(flightCond);
+
+    while (true) {
+        try {
+            waitset.wait(dds::core::Duration::infinite());
+        }
+        catch (const dds::core::Exception &e) {
+            std::cerr << "exception while waiting for data: \"" << e.what() << "\"" << std::endl;
+            break;
+        }
+        // whichever woke us, taking from a reader with nothing is cheap
+        takeHandoffs(handoffReader);
+        takeFlights(flightReader);
+    }
+
+    return 1;
+}
+
+#endif